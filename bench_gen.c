@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include "lib_tar.h"
+
+/**
+ * Generates synthetic ustar archives for the benchmarks.
+ *
+ * The archive holds a tree of directories of a given depth and fan-out, then regular files spread
+ * over those directories with sizes drawn log-uniformly between a minimum and a maximum, and a share
+ * of symlinks pointing to earlier files through relative paths.
+ */
+
+typedef struct gen_options {
+    long nb_entries;
+    int depth;
+    int fanout;
+    double symlink_ratio;
+    uint64_t min_size;
+    uint64_t max_size;
+    unsigned seed;
+    const char *output;
+} gen_options_t;
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double rng_unit(void) {
+    return (double) (rng_next() >> 11) / (double) (1ULL << 53);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n entries] [-d depth] [-f fanout] [-l symlink_ratio] [-s min_size] [-S max_size]"
+                    " [-r seed] -o archive.tar\n", prog);
+}
+
+static void set_octal(char *field, size_t len, uint64_t value) {
+    snprintf(field, len, "%0*llo", (int) len - 1, (unsigned long long) value);
+}
+
+static void write_block(FILE *out, const void *block) {
+    if (fwrite(block, 512, 1, out) != 1) {
+        perror("fwrite");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void write_header(FILE *out, const char *name, char typeflag, uint64_t size, const char *linkname) {
+    tar_header_t header;
+    memset(&header, 0, sizeof(tar_header_t));
+
+    strncpy(header.name, name, sizeof(header.name));
+    set_octal(header.mode, sizeof(header.mode), typeflag == DIRTYPE ? 0755 : 0644);
+    set_octal(header.uid, sizeof(header.uid), 1000);
+    set_octal(header.gid, sizeof(header.gid), 1000);
+    set_octal(header.size, sizeof(header.size), size);
+    set_octal(header.mtime, sizeof(header.mtime), 1672531200);
+    header.typeflag = typeflag;
+    if (linkname != NULL) strncpy(header.linkname, linkname, sizeof(header.linkname));
+    memcpy(header.magic, TMAGIC, TMAGLEN);
+    memcpy(header.version, TVERSION, TVERSLEN);
+    strcpy(header.uname, "bench");
+    strcpy(header.gname, "bench");
+
+    memset(header.chksum, ' ', sizeof(header.chksum));
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(tar_header_t); ++i) sum += ((uint8_t *) &header)[i];
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", sum);
+
+    write_block(out, &header);
+}
+
+static void write_payload(FILE *out, uint64_t size) {
+    uint8_t block[512];
+    while (size > 0) {
+        for (size_t i = 0; i < sizeof(block); i += 8) {
+            uint64_t word = rng_next();
+            memcpy(block + i, &word, 8);
+        }
+        if (size < sizeof(block)) memset(block + size, 0, sizeof(block) - size);
+        write_block(out, block);
+        size = size > sizeof(block) ? size - sizeof(block) : 0;
+    }
+}
+
+int main(int argc, char **argv) {
+    gen_options_t opt = { 10000, 3, 8, 0.05, 0, 16384, 42, NULL };
+    int c;
+
+    while ((c = getopt(argc, argv, "n:d:f:l:s:S:r:o:")) != -1) {
+        switch (c) {
+            case 'n': opt.nb_entries = atol(optarg); break;
+            case 'd': opt.depth = atoi(optarg); break;
+            case 'f': opt.fanout = atoi(optarg); break;
+            case 'l': opt.symlink_ratio = atof(optarg); break;
+            case 's': opt.min_size = strtoull(optarg, NULL, 10); break;
+            case 'S': opt.max_size = strtoull(optarg, NULL, 10); break;
+            case 'r': opt.seed = (unsigned) atoi(optarg); break;
+            case 'o': opt.output = optarg; break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (opt.output == NULL || opt.nb_entries <= 0 || opt.depth < 0 || opt.depth > 8 || opt.fanout <= 0
+        || opt.max_size < opt.min_size) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    rng_state = 0x9E3779B97F4A7C15ULL ^ opt.seed;
+
+    FILE *out = fopen(opt.output, "w");
+    if (out == NULL) {
+        perror("fopen");
+        return EXIT_FAILURE;
+    }
+
+    // Directories, breadth first, each one before its children
+    long nb_dirs = 0;
+    long level_count = 1;
+    for (int level = 1; level <= opt.depth; ++level) {
+        level_count *= opt.fanout;
+        nb_dirs += level_count;
+    }
+    char (*dirs)[100] = calloc((size_t) nb_dirs + 1, sizeof(*dirs));
+    int *dir_depth = calloc((size_t) nb_dirs + 1, sizeof(int));
+    if (dirs == NULL || dir_depth == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    long nb = 1;        /* dirs[0] is the root of the archive, not written */
+    for (long parent = 0; parent < nb && nb <= nb_dirs; ++parent) {
+        if (dir_depth[parent] == opt.depth) continue;
+        for (int i = 0; i < opt.fanout; ++i) {
+            char dir_name[100];
+            snprintf(dir_name, sizeof(dir_name), "%sd%d/", dirs[parent], i);
+            memcpy(dirs[nb], dir_name, sizeof(dir_name));
+            dir_depth[nb] = dir_depth[parent] + 1;
+            write_header(out, dirs[nb], DIRTYPE, 0, NULL);
+            nb++;
+        }
+    }
+
+    // Files and symlinks
+    char (*files)[100] = calloc((size_t) opt.nb_entries, sizeof(*files));
+    if (files == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    long nb_files = 0;
+    double log_min = log((double) opt.min_size + 1);
+    double log_max = log((double) opt.max_size + 1);
+    char name[100];
+    char target[200];
+
+    for (long n = 0; n < opt.nb_entries; ++n) {
+        long dir = (long) (rng_next() % (uint64_t) nb);
+        bool link = nb_files > 0 && rng_unit() < opt.symlink_ratio;
+
+        snprintf(name, sizeof(name), "%s%s%ld", dirs[dir], link ? "l" : "f", n);
+        if (link) {
+            // relative to the directory of the link
+            target[0] = '\0';
+            for (int i = 0; i < dir_depth[dir]; ++i) strcat(target, "../");
+            strcat(target, files[rng_next() % (uint64_t) nb_files]);
+            write_header(out, name, SYMTYPE, 0, target);
+        } else {
+            uint64_t size = (uint64_t) exp(log_min + (log_max - log_min) * rng_unit()) - 1;
+            if (size < opt.min_size) size = opt.min_size;
+            if (size > opt.max_size) size = opt.max_size;
+            write_header(out, name, REGTYPE, size, NULL);
+            write_payload(out, size);
+            strcpy(files[nb_files++], name);
+        }
+    }
+
+    uint8_t zero[512] = { 0 };
+    write_block(out, zero);
+    write_block(out, zero);
+
+    if (fclose(out) != 0) {
+        perror("fclose");
+        return EXIT_FAILURE;
+    }
+    free(files);
+    free(dirs);
+    free(dir_depth);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "lib_tar.h"
+
+/**
+ * Benchmark driver.
+ *
+ * Runs each operation of the library many times on random entries of an archive, with a warm page
+ * cache and optionally a cold one (the archive pages are dropped before every call), and prints one
+ * JSON object per operation and cache state: number of calls, throughput and latency percentiles.
+ */
+
+#define NAME_LEN 256
+#define LIST_ENTRIES 64
+
+typedef struct bench_ctx {
+    int tar_fd;
+    tar_index_t *idx;
+    char (*files)[NAME_LEN];
+    size_t nb_files;
+    char (*dirs)[NAME_LEN];
+    size_t nb_dirs;
+    char **list_entries;
+    uint8_t *buf;
+    size_t buf_len;
+    bool cold;
+} bench_ctx_t;
+
+typedef void (*bench_op_fn)(bench_ctx_t *ctx, size_t n);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static const char *pick_file(bench_ctx_t *ctx, size_t n) {
+    return ctx->files[(n * 2654435761u) % ctx->nb_files];
+}
+
+static const char *pick_dir(bench_ctx_t *ctx, size_t n) {
+    return ctx->dirs[(n * 2654435761u) % ctx->nb_dirs];
+}
+
+static void op_check_archive(bench_ctx_t *ctx, size_t n) {
+    check_archive(ctx->tar_fd);
+}
+
+static void op_exists(bench_ctx_t *ctx, size_t n) {
+    exists(ctx->tar_fd, (char *) pick_file(ctx, n));
+}
+
+static void op_is_dir(bench_ctx_t *ctx, size_t n) {
+    is_dir(ctx->tar_fd, (char *) pick_dir(ctx, n));
+}
+
+static void op_list(bench_ctx_t *ctx, size_t n) {
+    size_t no_entries = LIST_ENTRIES;
+    list(ctx->tar_fd, (char *) pick_dir(ctx, n), ctx->list_entries, &no_entries);
+}
+
+static void op_read_file(bench_ctx_t *ctx, size_t n) {
+    size_t len = ctx->buf_len;
+    read_file(ctx->tar_fd, (char *) pick_file(ctx, n), 0, ctx->buf, &len);
+}
+
+static void op_index_open(bench_ctx_t *ctx, size_t n) {
+    tar_index_close(tar_index_open(ctx->tar_fd));
+}
+
+static void op_index_exists(bench_ctx_t *ctx, size_t n) {
+    tar_index_exists(ctx->idx, (char *) pick_file(ctx, n));
+}
+
+static void op_index_list(bench_ctx_t *ctx, size_t n) {
+    size_t no_entries = LIST_ENTRIES;
+    tar_index_list(ctx->idx, (char *) pick_dir(ctx, n), ctx->list_entries, &no_entries);
+}
+
+static void op_index_read_file(bench_ctx_t *ctx, size_t n) {
+    size_t len = ctx->buf_len;
+    tar_index_read_file(ctx->idx, (char *) pick_file(ctx, n), 0, ctx->buf, &len);
+}
+
+static void run(bench_ctx_t *ctx, const char *name, bench_op_fn op, size_t calls) {
+    uint64_t *latencies = malloc(calls * sizeof(uint64_t));
+    if (latencies == NULL) return;
+
+    uint64_t total = 0;
+    for (size_t n = 0; n < calls; ++n) {
+        if (ctx->cold) posix_fadvise(ctx->tar_fd, 0, 0, POSIX_FADV_DONTNEED);
+        uint64_t start = now_ns();
+        op(ctx, n);
+        latencies[n] = now_ns() - start;
+        total += latencies[n];
+    }
+    qsort(latencies, calls, sizeof(uint64_t), cmp_u64);
+
+    printf("{\"op\":\"%s\",\"cache\":\"%s\",\"calls\":%zu,\"ops_per_sec\":%.1f,"
+           "\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f}\n",
+           name, ctx->cold ? "cold" : "warm", calls, total ? calls * 1e9 / (double) total : 0.0,
+           latencies[calls / 2] / 1e3, latencies[calls * 9 / 10] / 1e3, latencies[calls * 99 / 100] / 1e3,
+           latencies[calls - 1] / 1e3);
+    fflush(stdout);
+    free(latencies);
+}
+
+/**
+ * Collects the names of the files and directories of the archive to pick queries from.
+ */
+static int collect_names(bench_ctx_t *ctx) {
+    tar_iter_t iter;
+    if (tar_iter_init(&iter, ctx->tar_fd) < 0) return -1;
+
+    size_t cap_files = 0, cap_dirs = 0;
+    const tar_iter_entry_t *entry;
+    while ((entry = tar_iter_next(&iter)) != NULL) {
+        bool dir = entry->typeflag == DIRTYPE;
+        if (!dir && entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE) continue;
+
+        size_t *nb = dir ? &ctx->nb_dirs : &ctx->nb_files;
+        size_t *cap = dir ? &cap_dirs : &cap_files;
+        char (**names)[NAME_LEN] = dir ? &ctx->dirs : &ctx->files;
+        if (*nb == *cap) {
+            *cap = *cap ? *cap * 2 : 1024;
+            void *more = realloc(*names, *cap * NAME_LEN);
+            if (more == NULL) return -1;
+            *names = more;
+        }
+        size_t len = strnlen(entry->header->name, sizeof(entry->header->name));
+        memcpy((*names)[*nb], entry->header->name, len);
+        (*names)[*nb][len] = '\0';
+        (*nb)++;
+    }
+    tar_iter_release(&iter);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    size_t iterations = 1000;
+    size_t scan_iterations = 20;
+    bool with_cold = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "i:s:c")) != -1) {
+        switch (c) {
+            case 'i': iterations = strtoul(optarg, NULL, 10); break;
+            case 's': scan_iterations = strtoul(optarg, NULL, 10); break;
+            case 'c': with_cold = true; break;
+            default:
+                fprintf(stderr, "Usage: %s [-i lookups] [-s scans] [-c] archive.tar\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || iterations == 0 || scan_iterations == 0) {
+        fprintf(stderr, "Usage: %s [-i lookups] [-s scans] [-c] archive.tar\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    bench_ctx_t ctx;
+    memset(&ctx, 0, sizeof(bench_ctx_t));
+    ctx.tar_fd = open(argv[optind], O_RDONLY);
+    if (ctx.tar_fd == -1) {
+        perror("open(tar_file)");
+        return EXIT_FAILURE;
+    }
+    if (collect_names(&ctx) < 0 || ctx.nb_files == 0 || ctx.nb_dirs == 0) {
+        fprintf(stderr, "%s: need an archive with at least one file and one directory\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    ctx.buf_len = 1 << 20;
+    ctx.buf = malloc(ctx.buf_len);
+    ctx.list_entries = malloc(LIST_ENTRIES * sizeof(char *));
+    for (int i = 0; i < LIST_ENTRIES; ++i) ctx.list_entries[i] = malloc(NAME_LEN);
+    ctx.idx = tar_index_open(ctx.tar_fd);
+    if (ctx.buf == NULL || ctx.idx == NULL) {
+        fprintf(stderr, "could not prepare the benchmark\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int pass = 0; pass < (with_cold ? 2 : 1); ++pass) {
+        ctx.cold = pass == 1;
+        run(&ctx, "check_archive", op_check_archive, scan_iterations);
+        run(&ctx, "exists", op_exists, iterations);
+        run(&ctx, "is_dir", op_is_dir, iterations);
+        run(&ctx, "list", op_list, iterations);
+        run(&ctx, "read_file", op_read_file, iterations);
+        run(&ctx, "tar_index_open", op_index_open, scan_iterations);
+        run(&ctx, "tar_index_exists", op_index_exists, iterations);
+        run(&ctx, "tar_index_list", op_index_list, iterations);
+        run(&ctx, "tar_index_read_file", op_index_read_file, iterations);
+    }
+
+    tar_index_close(ctx.idx);
+    close(ctx.tar_fd);
+    return EXIT_SUCCESS;
+}
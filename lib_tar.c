@@ -1,504 +1,4984 @@
+#define _GNU_SOURCE
 #include <string.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#ifdef LIB_TAR_ZSTD
+#include <zstd.h>
+#endif
 #include "lib_tar.h"
 
 #define block_size 512
 
+#define MAX_LINK_HOPS 16
+#define PATH_MAX_INDEX TAR_PATH_MAX
+
+/*
+ * Statistics.
+ *
+ * Built with LIB_TAR_STATS, the library counts its system calls, the bytes it reads, the headers it
+ * parses and the payload bytes it passes over, for each index and for everything else together. Each
+ * public function also counts its calls and the time spent in it. A public function built on another
+ * one calls its internal helper, which has no scope, so that a call is only counted once. The counters
+ * updated are those the public function running in the thread points stats_current to, so that the
+ * internal functions need no handle. Without LIB_TAR_STATS, the macros below expand to nothing.
+ */
+
+#ifdef LIB_TAR_STATS
+
+static tar_stats_t stats_fd;                    /* everything not done through an index */
+static __thread tar_stats_t *stats_current;     /* NULL for stats_fd */
+
+#define STATS_ADD(field, n) \
+    __atomic_fetch_add(&(stats_current != NULL ? stats_current : &stats_fd)->field, (uint64_t) (n), __ATOMIC_RELAXED)
+
+/* Makes the counters of the current thread those of `stats` (NULL for stats_fd), for worker threads */
+#define STATS_ATTACH(stats) (stats_current = (stats))
+
+typedef struct stats_scope {
+    tar_stats_t *stats;
+    tar_stats_t *previous;
+    int function;
+    uint64_t start;
+} stats_scope_t;
+
+static uint64_t stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static stats_scope_t stats_enter(tar_stats_t *stats, int function) {
+    stats_scope_t scope = { stats != NULL ? stats : &stats_fd, stats_current, function, stats_now() };
+    stats_current = scope.stats;
+    return scope;
+}
+
+static void stats_leave(stats_scope_t *scope) {
+    __atomic_fetch_add(&scope->stats->calls[scope->function], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&scope->stats->nanoseconds[scope->function], stats_now() - scope->start, __ATOMIC_RELAXED);
+    stats_current = scope->previous;
+}
+
+/* Counts a call to a public function and its time until it returns, against `stats` (NULL for stats_fd) */
+#define STATS_SCOPE(stats, function) \
+    __attribute__((cleanup(stats_leave))) stats_scope_t stats_scope = stats_enter((stats), (function))
+
+#else
+
+#define STATS_ADD(field, n) ((void) 0)
+#define STATS_ATTACH(stats) ((void) 0)
+#define STATS_SCOPE(stats, function) ((void) 0)
+
+#endif
+
+/**
+ * Rounds an entry size up to the number of bytes its payload occupies in the archive.
+ */
+static uint64_t padded_size(uint64_t size) {
+    return (size + block_size - 1) / block_size * block_size;
+}
+
+/**
+ * Finds where the archive starts in its file: at the current file offset, which is never moved.
+ */
+static off_t archive_start(int fd) {
+    STATS_ADD(syscalls, 1);
+    return lseek(fd, 0, SEEK_CUR);
+}
+
+/**
+ * Reads up to `len` bytes at `offset` without moving the file offset, retrying short reads.
+ *
+ * @return the number of bytes read, less than `len` only at the end of the file or on error.
+ */
+static size_t pread_full(int fd, void *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t reading = pread(fd, (uint8_t *) buf + done, len - done, offset + (off_t) done);
+        STATS_ADD(syscalls, 1);
+        if (reading < 0 && errno == EINTR) continue;
+        if (reading <= 0) break;
+        STATS_ADD(bytes_read, reading);
+        done += (size_t) reading;
+    }
+    return done;
+}
+
+/**
+ * Reads into several buffers at `offset` without moving the file offset, retrying short reads.
+ * The buffers described by `iov` are advanced past what was read.
+ *
+ * @return the number of bytes read, less than the total length only at the end of the file or on error.
+ */
+static size_t preadv_full(int fd, struct iovec *iov, int count, off_t offset) {
+    size_t done = 0;
+    int first = 0;
+    while (first < count) {
+        ssize_t reading = preadv(fd, iov + first, count - first, offset + (off_t) done);
+        STATS_ADD(syscalls, 1);
+        if (reading < 0 && errno == EINTR) continue;
+        if (reading <= 0) break;
+        STATS_ADD(bytes_read, reading);
+        done += (size_t) reading;
+        // skip the buffers filled, and what was read of the next one
+        while (first < count && (size_t) reading >= iov[first].iov_len) {
+            reading -= (ssize_t) iov[first].iov_len;
+            first++;
+        }
+        if (first < count) {
+            iov[first].iov_base = (uint8_t *) iov[first].iov_base + reading;
+            iov[first].iov_len -= (size_t) reading;
+        }
+    }
+    return done;
+}
+
+/**
+ * Writes `len` bytes, retrying short writes.
+ *
+ * @return zero on success, -1 on failure.
+ */
+static int write_full(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t writing = write(fd, (const uint8_t *) buf + done, len - done);
+        if (writing < 0 && errno == EINTR) continue;
+        if (writing <= 0) return -1;
+        done += (size_t) writing;
+    }
+    return 0;
+}
+
+/**
+ * Joins a link target to the directory of the link and removes "." and ".." components.
+ * The result is written to `out` (of size PATH_MAX_INDEX) without a trailing slash.
+ *
+ * @return the length of the result, or -1 if it escapes the archive or is too long.
+ */
+static long join_link_path(const char *link_name, const char *target, char *out) {
+    char buf[PATH_MAX_INDEX];
+    size_t len = 0;
+
+    if (target[0] != '/') {
+        const char *slash = strrchr(link_name, '/');
+        /* a trailing slash belongs to the link name itself, not to its directory */
+        if (slash != NULL && slash[1] == '\0') {
+            const char *p = slash;
+            slash = NULL;
+            while (p > link_name) {
+                --p;
+                if (*p == '/') { slash = p; break; }
+            }
+        }
+        if (slash != NULL) {
+            len = (size_t) (slash - link_name) + 1;
+            if (len >= sizeof(buf)) return -1;
+            memcpy(buf, link_name, len);
+        }
+    }
+    size_t target_len = strlen(target);
+    if (len + target_len + 1 > sizeof(buf)) return -1;
+    memcpy(buf + len, target, target_len + 1);
+
+    size_t out_len = 0;
+    char *component = buf;
+    while (*component != '\0') {
+        char *end = strchr(component, '/');
+        size_t comp_len = end ? (size_t) (end - component) : strlen(component);
+
+        if (comp_len == 0 || (comp_len == 1 && component[0] == '.')) {
+            /* nothing */
+        } else if (comp_len == 2 && component[0] == '.' && component[1] == '.') {
+            if (out_len == 0) return -1;
+            while (out_len > 0 && out[out_len - 1] != '/') out_len--;
+            if (out_len > 0) out_len--;
+        } else {
+            if (out_len > 0) out[out_len++] = '/';
+            memcpy(out + out_len, component, comp_len);
+            out_len += comp_len;
+        }
+        if (end == NULL) break;
+        component = end + 1;
+    }
+    out[out_len] = '\0';
+    return (long) out_len;
+}
+
+/*
+ * Path keys.
+ *
+ * Entries are looked up by key rather than by name, so that "dir", "dir/" and "./dir/" all name the
+ * same entry. The key of a path has no leading slash, no empty or "." components and no trailing
+ * slash. Names written by tar(1) only differ from their key by a leading "./" and the trailing slash
+ * of directories, so the key of a name is a part of it, found without copying it.
+ */
+
+/**
+ * Computes the key of a path given by a caller.
+ *
+ * @param out Receives the key, null-terminated, of size PATH_MAX_INDEX.
+ *
+ * @return the length of the key, or -1 if it is too long.
+ */
+static long path_normalize(const char *path, char *out) {
+    size_t len = 0;
+    const char *component = path;
+
+    while (*component != '\0') {
+        const char *end = strchrnul(component, '/');
+        size_t comp_len = (size_t) (end - component);
+
+        if (comp_len > 0 && !(comp_len == 1 && component[0] == '.')) {
+            if (len + 1 + comp_len >= PATH_MAX_INDEX) return -1;
+            if (len > 0) out[len++] = '/';
+            memcpy(out + len, component, comp_len);
+            len += comp_len;
+        }
+        if (*end == '\0') break;
+        component = end + 1;
+    }
+    out[len] = '\0';
+    return (long) len;
+}
+
+/**
+ * Finds the key of an entry name inside it.
+ *
+ * @param key_len Set to the length of the key.
+ *
+ * @return the first byte of the key, which is not null-terminated.
+ */
+static const char *path_key(const char *name, size_t len, size_t *key_len) {
+    while (len > 0 && (name[0] == '/' || (name[0] == '.' && (len == 1 || name[1] == '/')))) {
+        name++;
+        len--;
+    }
+    while (len > 0 && name[len - 1] == '/') len--;
+    *key_len = len;
+    return name;
+}
+
+/**
+ * FNV-1a hash of a name.
+ */
+static uint32_t hash_name(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (uint8_t) name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Numeric fields.
+ *
+ * Octal fields are decoded 8 digits at a time in a 64-bit word (SWAR): the digits are found with a
+ * mask, aligned to the end of the word, then merged pairwise into 6, 12 and 24-bit groups. A 12-byte
+ * size field therefore takes two rounds and no loop over its characters.
+ */
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/**
+ * Decodes the octal digits at the start of 8 bytes.
+ *
+ * @param digits Set to the number of leading octal digits, among the first `limit` bytes.
+ */
+static uint64_t octal_word(const char *bytes, size_t limit, unsigned *digits) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+
+    // a byte is an octal digit when it is 0x30 to 0x37, the high bit of each other byte is set
+    uint64_t other = (word & 0xf8f8f8f8f8f8f8f8ull) ^ 0x3030303030303030ull;
+    other = (((other & 0x7f7f7f7f7f7f7f7full) + 0x7f7f7f7f7f7f7f7full) | other) & 0x8080808080808080ull;
+    if (limit < 8) other |= 0x8080808080808080ull << (8 * limit);
+    *digits = other != 0 ? (unsigned) __builtin_ctzll(other) / 8 : 8;
+    if (*digits == 0) return 0;
+
+    // the first digit is the lowest byte, the digits are shifted up so that missing ones read as zeros
+    word = (word & 0x0707070707070707ull) << (8 * (8 - *digits));
+    word = ((word & 0x00ff00ff00ff00ffull) << 3) + ((word >> 8) & 0x00ff00ff00ff00ffull);
+    word = ((word & 0x0000ffff0000ffffull) << 6) + ((word >> 16) & 0x0000ffff0000ffffull);
+    return ((word & 0xffffffffull) << 12) + (word >> 32);
+}
+#endif
+
+/**
+ * Decodes a numeric header field, in octal (possibly padded with spaces and ended by a space or a null)
+ * or, when the high bit of its first byte is set, in base-256: the other bits of the field are a
+ * big-endian two's complement number.
+ *
+ * @param field A field of a header. Up to 7 bytes after it may be read, as any header field is followed
+ *              by others in the 512-byte block.
+ * @param len The width of the field.
+ *
+ * @return the value of the field.
+ */
+int64_t tar_number(const char *field, size_t len) {
+    const uint8_t *bytes = (const uint8_t *) field;
+    if (bytes[0] & 0x80) {
+        uint64_t value = (bytes[0] & 0x40) ? UINT64_MAX : 0;
+        value = (value << 6) | (bytes[0] & 0x3f);
+        for (size_t i = 1; i < len; ++i) {
+            value = (value << 8) | bytes[i];
+        }
+        return (int64_t) value;
+    }
+
+    size_t i = 0;
+    while (i < len && field[i] == ' ') i++;
+    uint64_t value = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    unsigned digits = 8;
+    while (i < len && digits == 8) {
+        uint64_t word = octal_word(field + i, len - i, &digits);
+        value = digits == 8 ? (value << 24) | word : (value << (3 * digits)) | word;
+        i += digits;
+    }
+#else
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+        value = (value << 3) | (uint64_t) (field[i] - '0');
+    }
+#endif
+    return (int64_t) value;
+}
+
+/*
+ * Header validation kernels.
+ *
+ * The byte sum of the checksum and the all-zero test of the end-of-archive blocks run over whole
+ * 512-byte blocks, so they are vectorized with SSE2 or AVX2 when the CPU has them. The variant is
+ * picked once at run time, the scalar one is kept for other architectures.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+typedef uint32_t (*block_sum_fn)(const uint8_t *block);
+typedef bool (*block_zero_fn)(const uint8_t *block);
+
+static uint32_t block_sum_scalar(const uint8_t *block) {
+    uint32_t tot = 0;
+    for (size_t i = 0; i < block_size; ++i) {
+        tot += block[i];
+    }
+    return tot;
+}
+
+static bool block_zero_scalar(const uint8_t *block) {
+    uint64_t acc = 0;
+    for (size_t i = 0; i < block_size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, block + i, sizeof(word));
+        acc |= word;
+    }
+    return acc == 0;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static uint32_t block_sum_sse2(const uint8_t *block) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (size_t i = 0; i < block_size; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) (block + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(bytes, zero));
+    }
+    return (uint32_t) (_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+}
+
+__attribute__((target("sse2")))
+static bool block_zero_sse2(const uint8_t *block) {
+    __m128i acc = _mm_setzero_si128();
+    for (size_t i = 0; i < block_size; i += 16) {
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *) (block + i)));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+}
+
+__attribute__((target("avx2")))
+static uint32_t block_sum_avx2(const uint8_t *block) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t i = 0; i < block_size; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) (block + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(bytes, zero));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return (uint32_t) (_mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8)));
+}
+
+__attribute__((target("avx2")))
+static bool block_zero_avx2(const uint8_t *block) {
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t i = 0; i < block_size; i += 32) {
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *) (block + i)));
+    }
+    return _mm256_testz_si256(acc, acc);
+}
+#endif
+
+static block_sum_fn block_sum_impl;
+static block_zero_fn block_zero_impl;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Picks the kernels for the running CPU, once through kernels_once.
+ */
+static void select_kernels(void) {
+    block_sum_fn sum = block_sum_scalar;
+    block_zero_fn zero = block_zero_scalar;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        sum = block_sum_avx2;
+        zero = block_zero_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        sum = block_sum_sse2;
+        zero = block_zero_sse2;
+    }
+#endif
+    block_zero_impl = zero;
+    block_sum_impl = sum;
+}
+
+static uint32_t block_sum(const uint8_t *block) {
+    pthread_once(&kernels_once, select_kernels);
+    return block_sum_impl(block);
+}
+
+/**
+ * Checks whether a 512-byte block only holds zeroes, as the blocks ending an archive do.
+ */
+static bool block_is_zero(const uint8_t *block) {
+    pthread_once(&kernels_once, select_kernels);
+    return block_zero_impl(block);
+}
+
+/**
+ * Checks the magic value, the version and the checksum of a header.
+ * The magic ("ustar") and the first version byte sit in the same 8 bytes, which are compared at once.
+ *
+ * @param header A non-null header.
+ *
+ * @return zero if the header is valid,
+ *         -1 if its magic value is invalid,
+ *         -2 if its version value is invalid,
+ *         -3 if its checksum value is invalid
+ */
+int tar_check_header(const tar_header_t *header) {
+    static const uint8_t expected[8] = { 'u', 's', 't', 'a', 'r', 0, '0', 0 };
+    static const uint8_t mask[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0, 0xFF, 0 };
+    uint64_t word, want, keep;
+    memcpy(&word, header->magic, sizeof(word));
+    memcpy(&want, expected, sizeof(want));
+    memcpy(&keep, mask, sizeof(keep));
+
+    if ((word & keep) != want) {
+        if (strncmp(header->magic, TMAGIC, TMAGLEN-1) != 0) return -1;
+        return -2;
+    }
+
+    // The checksum is computed with its own field filled with spaces
+    uint32_t tot = block_sum((const uint8_t *) header);
+    for (size_t i = 0; i < sizeof(header->chksum); ++i) {
+        tot += ' ' - (uint8_t) header->chksum[i];
+    }
+    if (TAR_NUMBER(header->chksum) != (int64_t) tot) return -3;
+    return 0;
+}
+
+/*
+ * Compressed archives.
+ *
+ * A gzip archive (or a zstd one with LIB_TAR_ZSTD) is decompressed by a cursor which only moves
+ * forward: a read after the cursor decompresses up to it and discards what lies before. While the
+ * cursor goes through parts of the archive it never saw, it records a checkpoint every DECODER_SPAN
+ * bytes of output. A read before the cursor, or far enough after it, restarts from the last checkpoint
+ * before the read instead of the start of the archive.
+ * A gzip checkpoint is a deflate block boundary along with the 32 KiB of output before it, as in the
+ * zran example of zlib. A zstd checkpoint is the start of a frame, so only archives compressed in
+ * several frames (like the zstd seekable format) have any.
+ */
+
+#define DECODER_SPAN (1024 * 1024)
+#define DECODER_WINDOW 32768
+#define DECODER_INPUT (64 * 1024)
+
+enum {
+    DECODER_GZIP,
+    DECODER_ZSTD,
+};
+
+typedef struct decoder_point {
+    uint64_t in;                /* compressed offset of the first byte not entirely used */
+    uint64_t out;               /* archive offset */
+    int bits;                   /* bits of the byte before `in` not used yet, gzip only */
+    uint8_t *window;            /* the output before `out`, oldest first, gzip only */
+} decoder_point_t;
+
+typedef struct tar_decoder {
+    int fd;
+    off_t base;
+    int format;
+    pthread_mutex_t lock;
+
+    decoder_point_t *points;    /* by increasing archive offset */
+    size_t nb_points;
+    size_t points_cap;
+
+    bool started;
+    bool ended;
+    bool raw;                   /* restarted in a gzip member, whose trailer zlib will not read */
+    uint64_t out;               /* archive offset of the next output byte */
+
+    uint8_t input[DECODER_INPUT];
+    uint64_t input_offset;      /* compressed offset of input[0] */
+    size_t input_len;
+    size_t input_pos;
+
+    uint8_t window[DECODER_WINDOW];     /* the last output, written in circles */
+    size_t window_pos;
+
+    z_stream zs;
+#ifdef LIB_TAR_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+} decoder_t;
+
+/**
+ * Recognizes a compressed archive from its first bytes.
+ *
+ * @param decoder Set to a new decoder if the archive is compressed, NULL otherwise.
+ *
+ * @return zero if the archive is not compressed, 1 if it is, -1 if it uses a compression this build
+ *         cannot decompress or memory could not be allocated.
+ */
+static int decoder_open(int fd, off_t base, decoder_t **decoder) {
+    *decoder = NULL;
+    uint8_t magic[4] = { 0 };
+    pread_full(fd, magic, sizeof(magic), base);
+
+    int format;
+    if (magic[0] == 0x1f && magic[1] == 0x8b) format = DECODER_GZIP;
+    else if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) format = DECODER_ZSTD;
+    else return 0;
+
+#ifndef LIB_TAR_ZSTD
+    if (format == DECODER_ZSTD) return -1;
+#endif
+
+    decoder_t *dec = calloc(1, sizeof(decoder_t));
+    if (dec == NULL) return -1;
+    dec->fd = fd;
+    dec->base = base;
+    dec->format = format;
+#ifdef LIB_TAR_ZSTD
+    if (format == DECODER_ZSTD && (dec->zstd = ZSTD_createDCtx()) == NULL) {
+        free(dec);
+        return -1;
+    }
+#endif
+    pthread_mutex_init(&dec->lock, NULL);
+    *decoder = dec;
+    return 1;
+}
+
+/**
+ * Releases a decoder, NULL is allowed.
+ */
+static void decoder_close(decoder_t *dec) {
+    if (dec == NULL) return;
+    if (dec->started && dec->format == DECODER_GZIP) inflateEnd(&dec->zs);
+#ifdef LIB_TAR_ZSTD
+    ZSTD_freeDCtx(dec->zstd);
+#endif
+    for (size_t i = 0; i < dec->nb_points; ++i) {
+        free(dec->points[i].window);
+    }
+    free(dec->points);
+    pthread_mutex_destroy(&dec->lock);
+    free(dec);
+}
+
+/**
+ * Finds the last checkpoint at or before an archive offset.
+ *
+ * @return the checkpoint, or NULL if there is none before the offset.
+ */
+static const decoder_point_t *decoder_point_before(const decoder_t *dec, uint64_t offset) {
+    size_t low = 0, high = dec->nb_points;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (dec->points[mid].out <= offset) low = mid + 1;
+        else high = mid;
+    }
+    return low > 0 ? &dec->points[low - 1] : NULL;
+}
+
+/**
+ * Records a checkpoint at the cursor if it is far enough from the last one.
+ * Failing to record one is not an error, reads only restart from further back.
+ */
+static void decoder_mark(decoder_t *dec, int bits) {
+    uint64_t last = dec->nb_points > 0 ? dec->points[dec->nb_points - 1].out : 0;
+    if (dec->out < last + DECODER_SPAN) return;
+
+    if (dec->nb_points == dec->points_cap) {
+        size_t cap = dec->points_cap ? dec->points_cap * 2 : 64;
+        decoder_point_t *points = realloc(dec->points, cap * sizeof(decoder_point_t));
+        if (points == NULL) return;
+        dec->points = points;
+        dec->points_cap = cap;
+    }
+
+    decoder_point_t *point = &dec->points[dec->nb_points];
+    point->in = dec->input_offset + dec->input_pos;
+    point->out = dec->out;
+    point->bits = bits;
+    point->window = NULL;
+    if (dec->format == DECODER_GZIP) {
+        point->window = malloc(DECODER_WINDOW);
+        if (point->window == NULL) return;
+        size_t older = DECODER_WINDOW - dec->window_pos;
+        memcpy(point->window, dec->window + dec->window_pos, older);
+        memcpy(point->window + older, dec->window, dec->window_pos);
+    }
+    dec->nb_points++;
+}
+
+/**
+ * Reads the next compressed bytes once the current ones are used.
+ *
+ * @return the number of compressed bytes available, zero at the end of the file.
+ */
+static size_t decoder_fill(decoder_t *dec) {
+    if (dec->input_pos == dec->input_len) {
+        dec->input_offset += dec->input_len;
+        dec->input_len = pread_full(dec->fd, dec->input, sizeof(dec->input), dec->base + (off_t) dec->input_offset);
+        dec->input_pos = 0;
+    }
+    return dec->input_len - dec->input_pos;
+}
+
+/**
+ * Moves the cursor to the last checkpoint before an archive offset, or to the start of the archive.
+ */
+static int decoder_restart(decoder_t *dec, uint64_t offset) {
+    const decoder_point_t *point = decoder_point_before(dec, offset);
+
+    dec->ended = false;
+    dec->out = point ? point->out : 0;
+    dec->input_offset = point ? point->in : 0;
+    dec->input_len = 0;
+    dec->input_pos = 0;
+    dec->window_pos = 0;
+
+#ifdef LIB_TAR_ZSTD
+    if (dec->format == DECODER_ZSTD) {
+        dec->started = true;
+        return ZSTD_isError(ZSTD_DCtx_reset(dec->zstd, ZSTD_reset_session_only)) ? -1 : 0;
+    }
+#endif
+
+    if (dec->started) inflateEnd(&dec->zs);
+    memset(&dec->zs, 0, sizeof(z_stream));
+    dec->started = false;
+    dec->raw = point != NULL;
+
+    // 31 reads a gzip header, -15 raw deflate data from the middle of a member
+    if (inflateInit2(&dec->zs, dec->raw ? -15 : 31) != Z_OK) return -1;
+    dec->started = true;
+    if (point == NULL) return 0;
+
+    if (point->bits > 0) {
+        uint8_t byte;
+        if (pread_full(dec->fd, &byte, 1, dec->base + (off_t) point->in - 1) != 1) return -1;
+        inflatePrime(&dec->zs, point->bits, byte >> (8 - point->bits));
+    }
+    memcpy(dec->window, point->window, DECODER_WINDOW);
+    return inflateSetDictionary(&dec->zs, point->window, DECODER_WINDOW) == Z_OK ? 0 : -1;
+}
+
+/**
+ * Decompresses at most `room` bytes into the window, at window_pos.
+ *
+ * @return the number of bytes produced, zero at the end of the archive or on corrupted data.
+ */
+static size_t decoder_step(decoder_t *dec, size_t room) {
+    if (dec->window_pos == DECODER_WINDOW) dec->window_pos = 0;
+    if (room > DECODER_WINDOW - dec->window_pos) room = DECODER_WINDOW - dec->window_pos;
+    uint8_t *output = dec->window + dec->window_pos;
+
+#ifdef LIB_TAR_ZSTD
+    if (dec->format == DECODER_ZSTD) {
+        ZSTD_outBuffer out = { output, room, 0 };
+        while (out.pos == 0 && !dec->ended) {
+            size_t available = decoder_fill(dec);
+            ZSTD_inBuffer in = { dec->input, dec->input_len, dec->input_pos };
+            size_t ret = ZSTD_decompressStream(dec->zstd, &out, &in);
+            dec->input_pos = in.pos;
+            dec->window_pos += out.pos;
+            dec->out += out.pos;
+
+            if (ZSTD_isError(ret) || (out.pos == 0 && available == 0)) dec->ended = true;
+            else if (ret == 0) decoder_mark(dec, 0);     /* a frame ended, the next one starts here */
+        }
+        return out.pos;
+    }
+#endif
+
+    size_t produced = 0;
+    while (produced == 0 && !dec->ended) {
+        // inflate may still have output to give once all the input is used
+        size_t available = decoder_fill(dec);
+        dec->zs.next_in = dec->input + dec->input_pos;
+        dec->zs.avail_in = (uInt) (dec->input_len - dec->input_pos);
+        dec->zs.next_out = output;
+        dec->zs.avail_out = (uInt) room;
+
+        int ret = inflate(&dec->zs, Z_BLOCK);
+        dec->input_pos = dec->input_len - dec->zs.avail_in;
+        produced = room - dec->zs.avail_out;
+        dec->window_pos += produced;
+        dec->out += produced;
+
+        if (ret == Z_STREAM_END) {
+            // a raw stream leaves the member trailer (CRC and size) to skip
+            for (size_t trailer = dec->raw ? 8 : 0; trailer > 0 && decoder_fill(dec) > 0;) {
+                size_t skip = dec->input_len - dec->input_pos < trailer ? dec->input_len - dec->input_pos : trailer;
+                dec->input_pos += skip;
+                trailer -= skip;
+            }
+            // another member may follow
+            dec->raw = false;
+            if (inflateReset2(&dec->zs, 31) != Z_OK) dec->ended = true;
+        } else if ((ret != Z_OK && ret != Z_BUF_ERROR) || (ret == Z_BUF_ERROR && available == 0)) {
+            dec->ended = true;
+        } else if ((dec->zs.data_type & 128) && !(dec->zs.data_type & 64)) {
+            decoder_mark(dec, dec->zs.data_type & 7);
+        }
+    }
+    return produced;
+}
+
+/**
+ * Reads decompressed archive bytes.
+ *
+ * @param offset The archive offset of the first byte to read.
+ *
+ * @return the number of bytes read, fewer than `len` only at the end of the archive.
+ */
+static size_t decoder_read(decoder_t *dec, void *dest, size_t len, uint64_t offset) {
+    pthread_mutex_lock(&dec->lock);
+
+    const decoder_point_t *point = decoder_point_before(dec, offset);
+    bool restart = !dec->started || offset < dec->out || (point != NULL && point->out > dec->out);
+    size_t done = 0;
+
+    if (!restart || decoder_restart(dec, offset) == 0) {
+        uint64_t end = offset + len;
+        while (dec->out < end) {
+            size_t produced = decoder_step(dec, end - dec->out < DECODER_WINDOW ? (size_t) (end - dec->out) : DECODER_WINDOW);
+            if (produced == 0) break;
+
+            // the part of the output falling in the requested range
+            uint64_t start = dec->out - produced;
+            if (dec->out > offset) {
+                size_t skip = start < offset ? (size_t) (offset - start) : 0;
+                memcpy((uint8_t *) dest + done, dec->window + dec->window_pos - produced + skip, produced - skip);
+                done += produced - skip;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&dec->lock);
+    return done;
+}
+
+/*
+ * Extension headers.
+ *
+ * PAX extended headers (x for the next entry, g for all the entries after it) hold records of the form
+ * "length key=value\n", of which path, linkpath, size and mtime are used. GNU long names (L) and long
+ * link targets (K) hold the string alone. Their values wait in a tar_extensions structure until the
+ * entry they apply to, whose name, link target, size and modification time they override.
+ */
+
+#define EXTENSION_MAX (1024 * 1024)     /* larger extension headers are skipped */
+#define ENTRY_SIZE_MAX ((uint64_t) INT64_MAX)   /* larger sizes, as given by an invalid PAX record, are corrupt */
+
+typedef struct ext_values {
+    char path[TAR_PATH_MAX];
+    char link[TAR_PATH_MAX];
+    size_t path_len;            /* zero if not set */
+    size_t link_len;
+    bool has_size;
+    bool has_mtime;
+    uint64_t size;
+    int64_t mtime;
+} ext_values_t;
+
+typedef struct tar_extensions {
+    ext_values_t next;          /* from x, L and K headers, for the next entry only */
+    ext_values_t global;        /* from g headers */
+    char name[TAR_PATH_MAX];    /* prefix and name of the current entry */
+    char link[sizeof(((tar_header_t *) NULL)->linkname) + 1];
+    tar_header_t header;        /* copy of an extension header, reading its payload may move the scan buffer */
+    uint8_t *payload;           /* extension payloads not at hand, allocated on first use */
+} tar_extensions_t;
+
+/**
+ * Decodes a decimal PAX value, ignoring a fractional part.
+ *
+ * @return false if the value is not a number or does not fit in an int64_t.
+ */
+static bool pax_number(const char *value, size_t len, int64_t *number) {
+    bool negative = len > 0 && value[0] == '-';
+    size_t first = negative ? 1 : 0;
+    size_t i = first;
+    uint64_t magnitude = 0;
+    for (; i < len && value[i] >= '0' && value[i] <= '9'; ++i) {
+        uint64_t digit = (uint64_t) (value[i] - '0');
+        if (magnitude > ((uint64_t) INT64_MAX - digit) / 10) return false;
+        magnitude = magnitude * 10 + digit;
+    }
+    if (i == first || (i < len && value[i] != '.')) return false;
+    *number = negative ? -(int64_t) magnitude : (int64_t) magnitude;
+    return true;
+}
+
+static void ext_set_string(char *dest, size_t *dest_len, const char *value, size_t len) {
+    // too long to be used anywhere, the field of the header is kept instead
+    if (len >= TAR_PATH_MAX) return;
+    memcpy(dest, value, len);
+    dest[len] = '\0';
+    *dest_len = len;
+}
+
+/**
+ * Reads the records of a PAX extended header.
+ */
+static void ext_read_pax(ext_values_t *values, const char *data, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        size_t record_len = 0;
+        size_t i = pos;
+        while (i < len && data[i] >= '0' && data[i] <= '9' && record_len <= len) {
+            record_len = record_len * 10 + (size_t) (data[i++] - '0');
+        }
+        if (i >= len || data[i] != ' ' || record_len > len - pos || pos + record_len <= i + 1) return;
+
+        const char *key = data + i + 1;
+        const char *end = data + pos + record_len - 1;
+        const char *equal = memchr(key, '=', (size_t) (end - key));
+        if (*end != '\n' || equal == NULL) return;
+
+        size_t key_len = (size_t) (equal - key);
+        const char *value = equal + 1;
+        size_t value_len = (size_t) (end - value);
+
+        if (key_len == 4 && memcmp(key, "path", 4) == 0) {
+            ext_set_string(values->path, &values->path_len, value, value_len);
+        } else if (key_len == 8 && memcmp(key, "linkpath", 8) == 0) {
+            ext_set_string(values->link, &values->link_len, value, value_len);
+        } else if (key_len == 4 && memcmp(key, "size", 4) == 0) {
+            // a size which is not a valid length makes the entry corrupt, rather than being ignored
+            int64_t size;
+            values->has_size = true;
+            values->size = pax_number(value, value_len, &size) && size >= 0 ? (uint64_t) size : UINT64_MAX;
+        } else if (key_len == 5 && memcmp(key, "mtime", 5) == 0) {
+            values->has_mtime = pax_number(value, value_len, &values->mtime);
+        }
+        pos += record_len;
+    }
+}
+
+/**
+ * Records the values of an extension header for the entries after it.
+ */
+static void ext_read(tar_extensions_t *ext, char typeflag, const uint8_t *payload, size_t len) {
+    const char *data = (const char *) payload;
+    switch (typeflag) {
+        case XHDTYPE:
+            ext_read_pax(&ext->next, data, len);
+            break;
+        case XGLTYPE:
+            ext_read_pax(&ext->global, data, len);
+            break;
+        case GNU_LONGNAME:
+            ext_set_string(ext->next.path, &ext->next.path_len, data, strnlen(data, len));
+            break;
+        case GNU_LONGLINK:
+            ext_set_string(ext->next.link, &ext->next.link_len, data, strnlen(data, len));
+            break;
+    }
+}
+
+static void ext_apply(const ext_values_t *values, tar_iter_entry_t *entry) {
+    if (values->path_len > 0) {
+        entry->name = values->path;
+        entry->name_len = values->path_len;
+    }
+    if (values->link_len > 0) {
+        entry->linkname = values->link;
+        entry->link_len = values->link_len;
+    }
+    if (values->has_size) entry->size = values->size;
+    if (values->has_mtime) entry->mtime = values->mtime;
+}
+
+/**
+ * Decodes a header into an entry, with the values of the extension headers before it.
+ * Those meant for this entry only are then forgotten, unless the header is an extension header itself.
+ */
+static void ext_entry(tar_extensions_t *ext, const tar_header_t *header, tar_iter_entry_t *entry) {
+    int64_t size = TAR_NUMBER(header->size);
+    entry->header = header;
+    entry->typeflag = header->typeflag;
+    entry->size = size > 0 ? (uint64_t) size : 0;
+    entry->mtime = TAR_NUMBER(header->mtime);
+    entry->mode = (mode_t) TAR_NUMBER(header->mode);
+
+    // the prefix field only means that in POSIX archives, GNU ones keep other data there
+    size_t name_len = strnlen(header->name, sizeof(header->name));
+    size_t prefix_len = 0;
+    if (memcmp(header->magic, TMAGIC, TMAGLEN) == 0) {
+        prefix_len = strnlen(header->prefix, sizeof(header->prefix));
+        memcpy(ext->name, header->prefix, prefix_len);
+        if (prefix_len > 0) ext->name[prefix_len++] = '/';
+    }
+    memcpy(ext->name + prefix_len, header->name, name_len);
+    ext->name[prefix_len + name_len] = '\0';
+    entry->name = ext->name;
+    entry->name_len = prefix_len + name_len;
+
+    entry->link_len = strnlen(header->linkname, sizeof(header->linkname));
+    memcpy(ext->link, header->linkname, entry->link_len);
+    ext->link[entry->link_len] = '\0';
+    entry->linkname = ext->link;
+
+    if (TAR_IS_EXTENSION(entry->typeflag)) return;
+    ext_apply(&ext->global, entry);
+    ext_apply(&ext->next, entry);
+    ext->next.path_len = 0;
+    ext->next.link_len = 0;
+    ext->next.has_size = false;
+    ext->next.has_mtime = false;
+}
+
+/**
+ * Finds where the header after an entry starts. Sizes are bounded so that a scan never wraps around
+ * or goes backwards.
+ *
+ * @param archive_len The length of the archive, UINT64_MAX if it is not known.
+ * @param next Receives the archive offset of the next header, left as it is if the entry is corrupt.
+ *
+ * @return false if the entry is corrupt: its size is invalid, or it is an extension header giving the
+ *         entries after it a size which does not fit in what is left of the archive.
+ */
+static bool entry_next(const tar_extensions_t *ext, const tar_iter_entry_t *entry, uint64_t archive_len, uint64_t *next) {
+    if (entry->size > ENTRY_SIZE_MAX) return false;
+    uint64_t after = entry->offset + sizeof(tar_header_t) + padded_size(entry->size);
+    if (TAR_IS_EXTENSION(entry->typeflag)) {
+        const ext_values_t *values = entry->typeflag == XGLTYPE ? &ext->global : &ext->next;
+        if (values->has_size) {
+            if (values->size > ENTRY_SIZE_MAX) return false;
+            if (archive_len != UINT64_MAX
+                && (after + sizeof(tar_header_t) > archive_len || values->size > archive_len - after - sizeof(tar_header_t)))
+                return false;
+        }
+    }
+    *next = after;
+    return true;
+}
+
+/*
+ * Block cache.
+ *
+ * Archive bytes can be kept in a bounded cache of 64 KiB blocks shared by every function reading an
+ * archive, so that an archive queried over and over is served from memory instead of one system call
+ * per read. Blocks are keyed by archive and offset. An archive is identified by the device, inode,
+ * size and modification time of its file and by where it starts in it, so the blocks of an archive
+ * that was modified are never used again and simply age out. The whole key is kept in each block and
+ * compared on every hit, its hash only picks the bucket. An index or a handle keeps the key of the
+ * archive as it was when opened, as it keeps the offsets of its entries. The least recently used
+ * block is the first one reused.
+ *
+ * Missing blocks are read in runs, with a single vectored read (or decompressed one after the other).
+ * A miss starting where the previous one ended is taken as a scan and the run is extended by the
+ * readahead. Blocks being read are neither in the hash table nor in the LRU list, so the lock is not
+ * held while reading: other threads do not see those blocks and cannot reuse them.
+ */
+
+#define CACHE_BLOCK (64 * 1024)
+#define CACHE_MAX_RUN 32
+#define CACHE_NONE UINT32_MAX
+
+typedef struct cache_block {
+    tar_cache_key_t key;        /* archive of the block, key.hash is zero if the block is free */
+    uint64_t number;            /* archive offset / CACHE_BLOCK */
+    uint32_t len;               /* less than CACHE_BLOCK at the end of the archive */
+    uint32_t hash_next;
+    uint32_t lru_prev;
+    uint32_t lru_next;
+    uint8_t *data;              /* allocated on first use */
+} cache_block_t;
+
+static struct {
+    pthread_mutex_t lock;
+    cache_block_t *blocks;
+    uint32_t nb_blocks;
+    uint32_t *buckets;          /* heads of the hash chains */
+    uint32_t nb_buckets;
+    uint32_t lru_head;          /* most recently used */
+    uint32_t lru_tail;          /* least recently used */
+    uint32_t readahead;         /* in blocks */
+
+    uint64_t last_id;           /* key hash and block where the last miss ended, to recognize scans */
+    uint64_t last_end;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t read_ahead;
+    uint64_t used;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .lru_head = CACHE_NONE, .lru_tail = CACHE_NONE };
+
+/**
+ * Identifies an archive in the cache, from the file holding it and where it starts.
+ *
+ * @param key Receives the key, with a non-zero hash.
+ */
+static void cache_archive_key(const struct stat *st, off_t base, tar_cache_key_t *key) {
+    key->dev = (uint64_t) st->st_dev;
+    key->ino = (uint64_t) st->st_ino;
+    key->size = (uint64_t) st->st_size;
+    key->mtime_sec = (uint64_t) st->st_mtim.tv_sec;
+    key->mtime_nsec = (uint64_t) st->st_mtim.tv_nsec;
+    key->base = (uint64_t) base;
+    // FNV-1a over the fields
+    uint64_t h = 14695981039346656037u;
+    const uint8_t *bytes = (const uint8_t *) &key->dev;
+    for (size_t i = 0; i < sizeof(tar_cache_key_t) - offsetof(tar_cache_key_t, dev); ++i) {
+        h ^= bytes[i];
+        h *= 1099511628211u;
+    }
+    key->hash = h != 0 ? h : 1;
+}
+
+static bool cache_same_key(const tar_cache_key_t *a, const tar_cache_key_t *b) {
+    return memcmp(a, b, sizeof(tar_cache_key_t)) == 0;
+}
+
+static uint32_t cache_bucket(const tar_cache_key_t *key, uint64_t number) {
+    uint64_t h = (key->hash ^ (number * 0x9e3779b97f4a7c15u)) * 0xff51afd7ed558ccdu;
+    return (uint32_t) (h >> 32) & (cache.nb_buckets - 1);
+}
+
+static void cache_lru_unlink(uint32_t i) {
+    cache_block_t *block = &cache.blocks[i];
+    if (block->lru_prev != CACHE_NONE) cache.blocks[block->lru_prev].lru_next = block->lru_next;
+    else cache.lru_head = block->lru_next;
+    if (block->lru_next != CACHE_NONE) cache.blocks[block->lru_next].lru_prev = block->lru_prev;
+    else cache.lru_tail = block->lru_prev;
+    block->lru_prev = block->lru_next = CACHE_NONE;
+}
+
+/**
+ * Links a block at the head of the LRU list, or at its tail if it is free so that it is reused first.
+ */
+static void cache_lru_push(uint32_t i) {
+    cache_block_t *block = &cache.blocks[i];
+    if (block->key.hash != 0) {
+        block->lru_prev = CACHE_NONE;
+        block->lru_next = cache.lru_head;
+        if (cache.lru_head != CACHE_NONE) cache.blocks[cache.lru_head].lru_prev = i;
+        else cache.lru_tail = i;
+        cache.lru_head = i;
+    } else {
+        block->lru_next = CACHE_NONE;
+        block->lru_prev = cache.lru_tail;
+        if (cache.lru_tail != CACHE_NONE) cache.blocks[cache.lru_tail].lru_next = i;
+        else cache.lru_head = i;
+        cache.lru_tail = i;
+    }
+}
+
+static uint32_t cache_find(const tar_cache_key_t *key, uint64_t number) {
+    uint32_t i = cache.buckets[cache_bucket(key, number)];
+    while (i != CACHE_NONE && (cache.blocks[i].number != number || !cache_same_key(&cache.blocks[i].key, key))) {
+        i = cache.blocks[i].hash_next;
+    }
+    return i;
+}
+
+/**
+ * Takes the least recently used block out of the cache to read new content into it.
+ *
+ * @return the block, or CACHE_NONE if every block is being read or memory could not be allocated.
+ */
+static uint32_t cache_take(void) {
+    uint32_t i = cache.lru_tail;
+    if (i == CACHE_NONE) return CACHE_NONE;
+    cache_block_t *block = &cache.blocks[i];
+    if (block->data == NULL && (block->data = malloc(CACHE_BLOCK)) == NULL) return CACHE_NONE;
+
+    cache_lru_unlink(i);
+    if (block->key.hash != 0) {
+        uint32_t *link = &cache.buckets[cache_bucket(&block->key, block->number)];
+        while (*link != i) link = &cache.blocks[*link].hash_next;
+        *link = block->hash_next;
+        cache.used -= block->len;
+        block->key.hash = 0;
+    }
+    return i;
+}
+
+/**
+ * Gives back a block taken with cache_take(), holding `len` bytes of the given block of an archive.
+ * The block stays free if it is empty or if another thread read the same block meanwhile.
+ */
+static void cache_put(uint32_t i, const tar_cache_key_t *key, uint64_t number, uint32_t len) {
+    cache_block_t *block = &cache.blocks[i];
+    if (len > 0 && cache_find(key, number) == CACHE_NONE) {
+        uint32_t bucket = cache_bucket(key, number);
+        block->key = *key;
+        block->number = number;
+        block->len = len;
+        block->hash_next = cache.buckets[bucket];
+        cache.buckets[bucket] = i;
+        cache.used += len;
+    }
+    cache_lru_push(i);
+}
+
+/**
+ * Sets the size of the block cache shared by all the functions reading an archive, and of the readahead.
+ *
+ * @param bytes The size of the cache, rounded up to a multiple of 64 KiB. Zero disables the cache.
+ * @param readahead How far to read ahead of a scan, rounded up to a multiple of 64 KiB, at most 2 MiB.
+ *
+ * @return zero on success, -1 if the cache could not be allocated, in which case it is disabled.
+ */
+int tar_set_cache_size(size_t bytes, size_t readahead) {
+    pthread_mutex_lock(&cache.lock);
+    for (uint32_t i = 0; i < cache.nb_blocks; ++i) {
+        free(cache.blocks[i].data);
+    }
+    free(cache.blocks);
+    free(cache.buckets);
+    cache.blocks = NULL;
+    cache.buckets = NULL;
+    __atomic_store_n(&cache.nb_blocks, 0, __ATOMIC_RELEASE);
+    cache.nb_buckets = 0;
+    cache.lru_head = cache.lru_tail = CACHE_NONE;
+    cache.last_id = cache.last_end = 0;
+    cache.used = 0;
+
+    size_t nb_blocks = (bytes + CACHE_BLOCK - 1) / CACHE_BLOCK;
+    size_t nb_readahead = (readahead + CACHE_BLOCK - 1) / CACHE_BLOCK;
+    cache.readahead = (uint32_t) (nb_readahead < CACHE_MAX_RUN ? nb_readahead : CACHE_MAX_RUN);
+
+    int result = 0;
+    if (nb_blocks > 0 && nb_blocks < CACHE_NONE) {
+        size_t nb_buckets = 16;
+        while (nb_buckets < nb_blocks) nb_buckets *= 2;
+        cache.blocks = calloc(nb_blocks, sizeof(cache_block_t));
+        cache.buckets = malloc(nb_buckets * sizeof(uint32_t));
+        if (cache.blocks == NULL || cache.buckets == NULL) {
+            free(cache.blocks);
+            free(cache.buckets);
+            cache.blocks = NULL;
+            cache.buckets = NULL;
+            result = -1;
+        } else {
+            memset(cache.buckets, 0xff, nb_buckets * sizeof(uint32_t));
+            cache.nb_buckets = (uint32_t) nb_buckets;
+            for (uint32_t i = 0; i < nb_blocks; ++i) {
+                cache.blocks[i].lru_prev = cache.blocks[i].lru_next = CACHE_NONE;
+                cache_lru_push(i);
+            }
+            __atomic_store_n(&cache.nb_blocks, (uint32_t) nb_blocks, __ATOMIC_RELEASE);
+        }
+    } else if (nb_blocks > 0) {
+        result = -1;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return result;
+}
+
+/**
+ * Tells whether the cache has blocks, without taking its lock: reads check it before anything else.
+ */
+static bool cache_enabled(void) {
+    return __atomic_load_n(&cache.nb_blocks, __ATOMIC_ACQUIRE) > 0;
+}
+
+/**
+ * Reads the counters of the block cache. They are kept when the cache is resized.
+ *
+ * @param stats Receives the counters.
+ */
+void tar_cache_stats(tar_cache_stats_t *stats) {
+    pthread_mutex_lock(&cache.lock);
+    stats->hits = cache.hits;
+    stats->misses = cache.misses;
+    stats->read_ahead = cache.read_ahead;
+    stats->capacity = (uint64_t) cache.nb_blocks * CACHE_BLOCK;
+    stats->used = cache.used;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Reads archive bytes without the cache.
+ *
+ * @return the number of bytes read, fewer than `len` only at the end of the archive or on error.
+ */
+static size_t archive_read_direct(int fd, off_t base, decoder_t *decoder, void *dest, size_t len, uint64_t offset) {
+    if (decoder != NULL) return decoder_read(decoder, dest, len, offset);
+    return pread_full(fd, dest, len, base + (off_t) offset);
+}
+
+/**
+ * Reads consecutive blocks of an archive into blocks taken from the cache.
+ *
+ * @return the number of bytes read.
+ */
+static size_t cache_load(int fd, off_t base, decoder_t *decoder, uint64_t number, const uint32_t *slots, uint32_t count) {
+    uint64_t offset = number * CACHE_BLOCK;
+    size_t done = 0;
+
+    if (decoder != NULL) {
+        for (uint32_t k = 0; k < count; ++k) {
+            size_t reading = decoder_read(decoder, cache.blocks[slots[k]].data, CACHE_BLOCK, offset + done);
+            done += reading;
+            if (reading < CACHE_BLOCK) break;
+        }
+        return done;
+    }
+
+    struct iovec iov[CACHE_MAX_RUN];
+    for (uint32_t k = 0; k < count; ++k) {
+        iov[k].iov_base = cache.blocks[slots[k]].data;
+        iov[k].iov_len = CACHE_BLOCK;
+    }
+    return preadv_full(fd, iov, (int) count, base + (off_t) offset);
+}
+
+/**
+ * Reads archive bytes through the cache, or directly if the cache is disabled.
+ *
+ * @param fd The file descriptor of the archive.
+ * @param base The offset of the archive in fd.
+ * @param decoder The decoder of a compressed archive, NULL otherwise.
+ * @param key The key of the archive in the cache, with a zero hash to bypass the cache.
+ * @param offset The archive offset of the first byte to read.
+ *
+ * @return the number of bytes read, fewer than `len` only at the end of the archive or on error.
+ */
+static size_t archive_read(int fd, off_t base, decoder_t *decoder, const tar_cache_key_t *key, void *dest, size_t len,
+                           uint64_t offset) {
+    if (key->hash == 0 || !cache_enabled()) return archive_read_direct(fd, base, decoder, dest, len, offset);
+
+    uint8_t *out = dest;
+    size_t done = 0;
+    while (done < len) {
+        uint64_t number = (offset + done) / CACHE_BLOCK;
+        size_t in_block = (size_t) ((offset + done) % CACHE_BLOCK);
+        size_t want = len - done;
+
+        pthread_mutex_lock(&cache.lock);
+        if (cache.nb_blocks == 0) {
+            // disabled since the check above
+            pthread_mutex_unlock(&cache.lock);
+            return done + archive_read_direct(fd, base, decoder, out + done, want, offset + done);
+        }
+        uint32_t i = cache_find(key, number);
+        if (i != CACHE_NONE) {
+            cache_block_t *block = &cache.blocks[i];
+            size_t n = block->len > in_block ? block->len - in_block : 0;
+            if (n > want) n = want;
+            memcpy(out + done, block->data + in_block, n);
+            bool last = block->len < CACHE_BLOCK;
+            cache.hits++;
+            STATS_ADD(cache_hits, 1);
+            cache_lru_unlink(i);
+            cache_lru_push(i);
+            pthread_mutex_unlock(&cache.lock);
+
+            done += n;
+            if (last) break;
+            continue;
+        }
+
+        // the missing blocks of the request, then the readahead if the request goes on from the last miss
+        uint32_t max_run = cache.nb_blocks / 2 < CACHE_MAX_RUN ? cache.nb_blocks / 2 : CACHE_MAX_RUN;
+        if (max_run == 0) max_run = 1;
+        uint64_t last = (offset + len - 1) / CACHE_BLOCK;
+        uint32_t run = 1;
+        while (number + run <= last && run < max_run && cache_find(key, number + run) == CACHE_NONE) run++;
+        uint32_t wanted = run;
+        if (number + run > last && key->hash == cache.last_id && number == cache.last_end) {
+            while (wanted < run + cache.readahead && wanted < max_run
+                   && cache_find(key, number + wanted) == CACHE_NONE) {
+                wanted++;
+            }
+        }
+
+        uint32_t slots[CACHE_MAX_RUN];
+        uint32_t count = 0;
+        while (count < wanted && (slots[count] = cache_take()) != CACHE_NONE) count++;
+        cache.misses += count < run ? count : run;
+        STATS_ADD(cache_misses, count < run ? count : run);
+        cache.read_ahead += count > run ? count - run : 0;
+        cache.last_id = key->hash;
+        cache.last_end = number + count;
+        pthread_mutex_unlock(&cache.lock);
+
+        if (count == 0) {
+            // every block is being read by other threads
+            return done + archive_read_direct(fd, base, decoder, out + done, want, offset + done);
+        }
+
+        size_t got = cache_load(fd, base, decoder, number, slots, count);
+        size_t available = got > in_block ? got - in_block : 0;
+        size_t n = want < available ? want : available;
+        for (size_t copied = 0, k = 0; copied < n; ++k) {
+            size_t from = k == 0 ? in_block : 0;
+            size_t part = CACHE_BLOCK - from < n - copied ? CACHE_BLOCK - from : n - copied;
+            memcpy(out + done + copied, cache.blocks[slots[k]].data + from, part);
+            copied += part;
+        }
+
+        pthread_mutex_lock(&cache.lock);
+        for (uint32_t k = 0; k < count; ++k) {
+            size_t start = (size_t) k * CACHE_BLOCK;
+            size_t block_len = got > start ? got - start : 0;
+            cache_put(slots[k], key, number + k, (uint32_t) (block_len < CACHE_BLOCK ? block_len : CACHE_BLOCK));
+        }
+        pthread_mutex_unlock(&cache.lock);
+
+        done += n;
+        if (n < want && got < (size_t) count * CACHE_BLOCK) break;
+    }
+    return done;
+}
+
+/*
+ * Header scanning.
+ *
+ * The archive is pulled into a buffer in large chunks and headers are handed out from that buffer,
+ * so the payloads of small entries are skipped without any system call. A payload larger than what
+ * is left in the buffer is simply not read: the next chunk is read from the following header on.
+ *
+ * All reads are positional (pread), the file offset of tar_fd is only queried to find where the
+ * archive starts and is never moved, so several threads can use the same file descriptor at once.
+ */
+
+#define DEFAULT_SCAN_CHUNK (1024 * 1024)
+
+static size_t scan_chunk = DEFAULT_SCAN_CHUNK;
+
+/**
+ * Sets the size of the chunks read at once when scanning an archive.
+ *
+ * @param bytes The chunk size, rounded up to a multiple of 512 bytes.
+ *              Zero restores the default of 1 MiB.
+ */
+void tar_set_scan_chunk_size(size_t bytes) {
+    if (bytes == 0) bytes = DEFAULT_SCAN_CHUNK;
+    scan_chunk = (size_t) padded_size(bytes);
+}
+
+/**
+ * Prepares an iteration over the headers of an archive.
+ * The buffer is no larger than the archive itself so that small archives stay cheap to scan,
+ * and it is the only allocation made until tar_iter_release().
+ *
+ * @param iter The iterator to initialize.
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file.
+ *
+ * @return zero on success, -1 on failure.
+ */
+int tar_iter_init(tar_iter_t *iter, int tar_fd) {
+    memset(iter, 0, sizeof(tar_iter_t));
+    iter->tar_fd = tar_fd;
+    iter->base = archive_start(tar_fd);
+    if (iter->base < 0) return -1;
+    if (decoder_open(tar_fd, iter->base, &iter->decoder) < 0) return -1;
+
+    size_t cap = scan_chunk;
+    struct stat st;
+    if (fstat(tar_fd, &st) < 0) {
+        tar_iter_release(iter);
+        return -1;
+    }
+    cache_archive_key(&st, iter->base, &iter->cache_key);
+    iter->archive_len = UINT64_MAX;
+    if (iter->decoder == NULL && S_ISREG(st.st_mode) && st.st_size >= iter->base) {
+        iter->archive_len = (uint64_t) (st.st_size - iter->base);
+        uint64_t needed = padded_size(iter->archive_len);
+        if (needed < block_size) needed = block_size;
+        if (needed < cap) cap = (size_t) needed;
+    }
+
+    iter->buf = malloc(cap);
+    iter->ext = calloc(1, sizeof(tar_extensions_t));
+    if (iter->buf == NULL || iter->ext == NULL) {
+        tar_iter_release(iter);
+        return -1;
+    }
+    iter->buf_cap = cap;
+    return 0;
+}
+
+/**
+ * Releases the buffer of an iterator, and its decoder if the archive is compressed.
+ *
+ * @param iter An iterator initialized by tar_iter_init().
+ */
+void tar_iter_release(tar_iter_t *iter) {
+    free(iter->buf);
+    iter->buf = NULL;
+    decoder_close(iter->decoder);
+    iter->decoder = NULL;
+    if (iter->ext != NULL) free(iter->ext->payload);
+    free(iter->ext);
+    iter->ext = NULL;
+}
+
+/**
+ * Makes the `need` bytes at archive offset `offset` available in the buffer, reading a new chunk
+ * if they are not already there. Bytes of the current buffer at or after `offset` are kept.
+ *
+ * @return a pointer to the bytes, or NULL on failure or if the archive ends before `need` bytes.
+ */
+static const uint8_t *scan_window(tar_iter_t *scan, uint64_t offset, size_t need) {
+    if (offset >= scan->buf_start && offset + need <= scan->buf_start + scan->buf_len) {
+        return scan->buf + (offset - scan->buf_start);
+    }
+
+    size_t keep = 0;
+    if (offset >= scan->buf_start && offset < scan->buf_start + scan->buf_len) {
+        keep = (size_t) (scan->buf_start + scan->buf_len - offset);
+        memmove(scan->buf, scan->buf + (offset - scan->buf_start), keep);
+    }
+    scan->buf_start = offset;
+    scan->buf_len = keep;
+
+    if (scan->buf_len < need) {
+        scan->buf_len += archive_read(scan->tar_fd, scan->base, scan->decoder, &scan->cache_key, scan->buf + scan->buf_len,
+                                      scan->buf_cap - scan->buf_len, scan->buf_start + scan->buf_len);
+        if (scan->buf_len < need) return NULL;
+    }
+    return scan->buf;
+}
+
+/**
+ * Reads the payload of an extension header, through the scan buffer when it fits.
+ *
+ * @return a pointer to the payload, or NULL if it could not be read or is too large to be used.
+ */
+static const uint8_t *scan_payload(tar_iter_t *scan, uint64_t offset, uint64_t size) {
+    if (size > EXTENSION_MAX) return NULL;
+    if (size <= scan->buf_cap) return scan_window(scan, offset, (size_t) size);
+
+    if (scan->ext->payload == NULL && (scan->ext->payload = malloc(EXTENSION_MAX)) == NULL) return NULL;
+    size_t reading = archive_read(scan->tar_fd, scan->base, scan->decoder, &scan->cache_key, scan->ext->payload,
+                                  (size_t) size, offset);
+    return reading == size ? scan->ext->payload : NULL;
+}
+
+/**
+ * Moves to the next header of the archive.
+ *
+ * @param iter An iterator initialized by tar_iter_init().
+ *
+ * @return the decoded entry, which is overwritten by the next call,
+ *         or NULL at the end of the archive, if it could not be read or if the size of an entry is invalid
+ *         (then iter->corrupt is set and iter->next is the offset of its header).
+ */
+const tar_iter_entry_t *tar_iter_next(tar_iter_t *iter) {
+    if (iter->corrupt) return NULL;
+    const uint8_t *block = scan_window(iter, iter->next, sizeof(tar_header_t));
+    if (block == NULL || block_is_zero(block)) return NULL;
+
+    tar_iter_entry_t *entry = &iter->entry;
+    const tar_header_t *header = (const tar_header_t *) block;
+    if (TAR_IS_EXTENSION(header->typeflag)) {
+        memcpy(&iter->ext->header, header, sizeof(tar_header_t));
+        header = &iter->ext->header;
+    }
+    entry->offset = iter->next;
+    ext_entry(iter->ext, header, entry);
+
+    if (TAR_IS_EXTENSION(entry->typeflag)) {
+        const uint8_t *payload = scan_payload(iter, entry->offset + sizeof(tar_header_t), entry->size);
+        if (payload != NULL) ext_read(iter->ext, entry->typeflag, payload, (size_t) entry->size);
+    }
+
+    // a corrupt entry ends the iteration, next is left on its header
+    if (!entry_next(iter->ext, entry, iter->archive_len, &iter->next)) {
+        iter->corrupt = 1;
+        return NULL;
+    }
+    STATS_ADD(headers, 1);
+    STATS_ADD(bytes_skipped, TAR_IS_EXTENSION(entry->typeflag) ? 0 : padded_size(entry->size));
+    return entry;
+}
+
+/**
+ * An entry found by scanning the archive, copied out of the iterator.
+ */
+typedef struct scan_entry {
+    uint64_t offset;
+    uint64_t size;
+    int64_t mtime;
+    mode_t mode;
+    char typeflag;
+    char name[PATH_MAX_INDEX];
+    char linkname[PATH_MAX_INDEX];
+} scan_entry_t;
+
+/**
+ * Scans the archive for an entry. The key of each name is compared to the key of the path by length
+ * first, so that most entries are rejected without comparing their names. The whole archive is
+ * scanned: when a path appears several times (members appended with `tar -r`), the last one wins as
+ * with tar(1) and the index.
+ *
+ * @param found Receives the entry.
+ *
+ * @return 1 if the entry was found, 0 otherwise.
+ */
+static int scan_find(int tar_fd, const char *path, scan_entry_t *found) {
+    char key[PATH_MAX_INDEX];
+    long key_len = path_normalize(path, key);
+    if (key_len < 0) return 0;
+
+    tar_iter_t iter;
+    if (tar_iter_init(&iter, tar_fd) < 0) return 0;
+
+    int found_it = 0;
+    const tar_iter_entry_t *entry;
+    while ((entry = tar_iter_next(&iter)) != NULL) {
+        if (TAR_IS_EXTENSION(entry->typeflag)) continue;
+        size_t len;
+        const char *name_key = path_key(entry->name, entry->name_len, &len);
+        if (len == (size_t) key_len && memcmp(name_key, key, len) == 0) {
+            found->offset = entry->offset;
+            found->size = entry->size;
+            found->mtime = entry->mtime;
+            found->mode = entry->mode;
+            found->typeflag = entry->typeflag;
+            memcpy(found->name, entry->name, entry->name_len + 1);
+            memcpy(found->linkname, entry->linkname, entry->link_len + 1);
+            found_it = 1;
+        }
+    }
+
+    tar_iter_release(&iter);
+    return found_it;
+}
+
+/**
+ * Scans the archive for an entry, following links.
+ *
+ * @return 1 if the path leads to an entry, 0 otherwise.
+ */
+static int scan_resolve(int tar_fd, const char *path, scan_entry_t *found) {
+    if (!scan_find(tar_fd, path, found)) return 0;
+
+    char target[PATH_MAX_INDEX];
+    for (int hops = 0; found->typeflag == SYMTYPE || found->typeflag == LNKTYPE; ++hops) {
+        if (hops == MAX_LINK_HOPS) return 0;
+
+        // hard link targets are relative to the root of the archive
+        if (join_link_path(found->typeflag == LNKTYPE ? "" : found->name, found->linkname, target) < 0) return 0;
+        if (!scan_find(tar_fd, target, found)) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Checks whether the archive is valid.
+ *
+ * Each non-null header of a valid archive has:
+ *  - a magic value of "ustar" and a null,
+ *  - a version value of "00" and no null,
+ *  - a correct checksum
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ *
+ * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
+ *         -1 if the archive contains a header with an invalid magic value,
+ *         -2 if the archive contains a header with an invalid version value,
+ *         -3 if the archive contains a header with an invalid checksum value,
+ *         -4 if the size of an entry is invalid (a PAX size which is not a length or does not fit in the archive)
+ */
+int check_archive(int tar_fd) {
+    STATS_SCOPE(NULL, TAR_STATS_CHECK_ARCHIVE);
+    tar_iter_t iter;
+    if (tar_iter_init(&iter, tar_fd) < 0) return -1;
+
+    int nb_of_headers = 0;
+    const tar_iter_entry_t *entry;
+
+    while ((entry = tar_iter_next(&iter)) != NULL) {
+        int valid = tar_check_header(entry->header);
+        if (valid < 0) {
+            nb_of_headers = valid;
+            break;
+        }
+
+        nb_of_headers++;
+    }
+    if (iter.corrupt && nb_of_headers >= 0) nb_of_headers = -4;
+
+    tar_iter_release(&iter);
+    return nb_of_headers;
+}
+
+/*
+ * Parallel validation.
+ *
+ * A first pass only follows the size fields to find where every header is. The headers are then
+ * checked by a pool of threads which take batches of consecutive entries from a shared counter.
+ * A worker reads the headers of its batch that lie within CHECK_SPAN bytes of each other with a single
+ * pread, the content of small entries in between coming along, instead of one system call per header.
+ * The smallest failing entry number is kept so that the result is the one check_archive() gives.
+ */
+
+#define CHECK_BATCH 256
+#define CHECK_SPAN (256 * 1024)
+
+typedef struct check_job {
+    int tar_fd;
+    off_t base;
+    int flags;
+    uint64_t archive_len;
+
+    const uint64_t *offsets;
+    const uint64_t *sizes;
+    size_t nb_headers;
+
+    size_t next_batch;          /* taken with __atomic_fetch_add */
+    size_t first_bad;           /* lowered under the lock, read without it, nb_headers if none */
+    int first_error;
+    pthread_mutex_t lock;
+} check_job_t;
+
+static void check_job_fail(check_job_t *job, size_t n, int error) {
+    pthread_mutex_lock(&job->lock);
+    if (n < job->first_bad) {
+        // workers read it without the lock to stop early
+        __atomic_store_n(&job->first_bad, n, __ATOMIC_RELAXED);
+        job->first_error = error;
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void *check_worker(void *arg) {
+    check_job_t *job = arg;
+    tar_header_t single;
+    // without a buffer, every header is read on its own
+    uint8_t *buf = malloc(CHECK_SPAN);
+    size_t span_max = buf != NULL ? CHECK_SPAN : sizeof(tar_header_t);
+    if (buf == NULL) buf = (uint8_t *) &single;
+
+    while (true) {
+        size_t start = __atomic_fetch_add(&job->next_batch, CHECK_BATCH, __ATOMIC_RELAXED);
+        if (start >= job->nb_headers) break;
+        // a failure was already found before this batch, nothing here can change the result
+        if (start > __atomic_load_n(&job->first_bad, __ATOMIC_RELAXED)) break;
+
+        size_t end = start + CHECK_BATCH < job->nb_headers ? start + CHECK_BATCH : job->nb_headers;
+        bool failed = false;
+        for (size_t n = start; n < end && !failed;) {
+            uint64_t first = job->offsets[n];
+            size_t last = n + 1;
+            while (last < end && job->offsets[last] + sizeof(tar_header_t) - first <= span_max) last++;
+            size_t span = (size_t) (job->offsets[last - 1] + sizeof(tar_header_t) - first);
+
+            ssize_t reading = pread(job->tar_fd, buf, span, job->base + (off_t) first);
+            STATS_ADD(syscalls, 1);
+            STATS_ADD(bytes_read, reading > 0 ? reading : 0);
+            for (; n < last; ++n) {
+                uint64_t at = job->offsets[n] - first;
+                int error = reading >= 0 && at + sizeof(tar_header_t) <= (uint64_t) reading
+                            ? tar_check_header((const tar_header_t *) (buf + at)) : -3;
+                if (error == 0 && (job->flags & TAR_CHECK_BOUNDS)
+                    && job->offsets[n] + sizeof(tar_header_t) + job->sizes[n] > job->archive_len) {
+                    error = -4;
+                }
+                if (error < 0) {
+                    check_job_fail(job, n, error);
+                    failed = true;
+                    break;
+                }
+            }
+        }
+    }
+    if (buf != (uint8_t *) &single) free(buf);
+    return NULL;
+}
+
+/**
+ * Checks a compressed archive as it is decompressed, since its headers cannot be read out of order cheaply.
+ * Only the last entry can extend past the end of the archive, the header after any other one was read.
+ */
+static int check_decoded(tar_iter_t *iter, int flags, uint64_t *bad_offset) {
+    int nb_headers = 0;
+    int result = 0;
+    uint64_t last = 0;
+    uint64_t end = 0;
+    const tar_iter_entry_t *entry;
+
+    while ((entry = tar_iter_next(iter)) != NULL) {
+        last = entry->offset;
+        end = entry->offset + sizeof(tar_header_t) + entry->size;
+        if ((result = tar_check_header(entry->header)) < 0) break;
+        nb_headers++;
+    }
+    if (result == 0 && iter->corrupt) {
+        result = -4;
+        last = iter->next;
+    } else if (result == 0 && (flags & TAR_CHECK_BOUNDS) && end > last + sizeof(tar_header_t)) {
+        uint8_t byte;
+        if (decoder_read(iter->decoder, &byte, 1, end - 1) != 1) result = -4;
+    }
+
+    tar_iter_release(iter);
+    if (result < 0 && bad_offset != NULL) *bad_offset = last;
+    return result < 0 ? result : nb_headers;
+}
+
+/**
+ * Checks whether the archive is valid like check_archive(), with the headers verified by several threads.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param nb_threads The number of threads checking headers, zero or less to use one per online CPU.
+ * @param flags Zero or TAR_CHECK_BOUNDS.
+ * @param bad_offset If not NULL and the archive is invalid, set to the offset of the first invalid header
+ *                   from the start of the archive.
+ *
+ * @return the same values as check_archive(), where -4 is also returned if TAR_CHECK_BOUNDS is set and
+ *         the content of an entry extends past the end of the archive.
+ */
+int check_archive_parallel(int tar_fd, int nb_threads, int flags, uint64_t *bad_offset) {
+    STATS_SCOPE(NULL, TAR_STATS_CHECK_ARCHIVE_PARALLEL);
+    check_job_t job;
+    memset(&job, 0, sizeof(check_job_t));
+    job.tar_fd = tar_fd;
+    job.flags = flags;
+
+    struct stat st;
+    if (fstat(tar_fd, &st) < 0) return -1;
+
+    // Discovery pass: header offsets only
+    tar_iter_t iter;
+    if (tar_iter_init(&iter, tar_fd) < 0) return -1;
+    if (iter.decoder != NULL) return check_decoded(&iter, flags, bad_offset);
+    job.base = iter.base;
+    job.archive_len = (uint64_t) (st.st_size - iter.base);
+
+    uint64_t *offsets = NULL;
+    uint64_t *sizes = NULL;
+    size_t cap = 0;
+    const tar_iter_entry_t *entry;
+
+    while ((entry = tar_iter_next(&iter)) != NULL) {
+        if (job.nb_headers == cap) {
+            cap = cap ? cap * 2 : 1024;
+            uint64_t *more_offsets = realloc(offsets, cap * sizeof(uint64_t));
+            if (more_offsets != NULL) offsets = more_offsets;
+            uint64_t *more_sizes = realloc(sizes, cap * sizeof(uint64_t));
+            if (more_sizes != NULL) sizes = more_sizes;
+            if (more_offsets == NULL || more_sizes == NULL) {
+                tar_iter_release(&iter);
+                free(offsets);
+                free(sizes);
+                return -1;
+            }
+        }
+        offsets[job.nb_headers] = entry->offset;
+        sizes[job.nb_headers] = entry->size;
+        job.nb_headers++;
+    }
+    // the headers before a corrupt entry are checked all the same, an invalid one among them comes first
+    bool corrupt = iter.corrupt;
+    uint64_t corrupt_offset = iter.next;
+    tar_iter_release(&iter);
+
+    job.offsets = offsets;
+    job.sizes = sizes;
+    job.first_bad = job.nb_headers;
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (nb_threads <= 0) nb_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_threads <= 0) nb_threads = 1;
+    size_t needed = (job.nb_headers + CHECK_BATCH - 1) / CHECK_BATCH;
+    if ((size_t) nb_threads > needed) nb_threads = needed > 0 ? (int) needed : 1;
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * (size_t) nb_threads);
+    int started = 0;
+    if (threads != NULL) {
+        for (; started < nb_threads - 1; ++started) {
+            if (pthread_create(&threads[started], NULL, check_worker, &job) != 0) break;
+        }
+    }
+    // the calling thread works too, so the check completes even if no thread could be started
+    check_worker(&job);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+
+    int result = (int) job.nb_headers;
+    if (job.first_bad < job.nb_headers) {
+        result = job.first_error;
+        if (bad_offset != NULL) *bad_offset = offsets[job.first_bad];
+    } else if (corrupt) {
+        result = -4;
+        if (bad_offset != NULL) *bad_offset = corrupt_offset;
+    }
+    free(offsets);
+    free(sizes);
+    return result;
+}
+
+/**
+ * Checks whether an entry exists in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int exists(int tar_fd, char *path) {
+    STATS_SCOPE(NULL, TAR_STATS_EXISTS);
+    scan_entry_t found;
+    return scan_find(tar_fd, path, &found);
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a directory.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int is_dir(int tar_fd, char *path) {
+    STATS_SCOPE(NULL, TAR_STATS_IS_DIR);
+    scan_entry_t found;
+    return scan_find(tar_fd, path, &found) && found.typeflag == DIRTYPE;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a file.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int is_file(int tar_fd, char *path) {
+    STATS_SCOPE(NULL, TAR_STATS_IS_FILE);
+    scan_entry_t found;
+    return scan_find(tar_fd, path, &found) && (found.typeflag == REGTYPE || found.typeflag == AREGTYPE);
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a symlink.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int is_symlink(int tar_fd, char *path) {
+    STATS_SCOPE(NULL, TAR_STATS_IS_SYMLINK);
+    scan_entry_t found;
+    return scan_find(tar_fd, path, &found) && found.typeflag == SYMTYPE;
+}
+
+/**
+ * tar_lookup() without counting a call, for the public functions built on it.
+ */
+static int scan_lookup(int tar_fd, const char *path, int flags, tar_stat_t *st) {
+    scan_entry_t found;
+    if (path == NULL) return 0;
+    if (!((flags & TAR_LOOKUP_FOLLOW) ? scan_resolve(tar_fd, path, &found) : scan_find(tar_fd, path, &found))) return 0;
+
+    st->typeflag = found.typeflag;
+    st->mode = found.mode;
+    st->size = found.size;
+    st->mtime = found.mtime;
+    st->offset = found.offset;
+    return 1;
+}
+
+/**
+ * Looks up an entry and decodes its metadata with a single scan of the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ * @param flags Zero or TAR_LOOKUP_FOLLOW.
+ * @param st Receives the metadata of the entry.
+ *
+ * @return zero if no entry at the given path exists in the archive or a link does not lead to one,
+ *         any other value otherwise.
+ */
+int tar_lookup(int tar_fd, const char *path, int flags, tar_stat_t *st) {
+    STATS_SCOPE(NULL, TAR_STATS_LOOKUP);
+    return scan_lookup(tar_fd, path, flags, st);
+}
+
+/**
+ * A path of tar_lookup_many(), in the hash table of the keys looked up by a scan.
+ */
+typedef struct lookup_query {
+    uint32_t hash;
+    size_t key_len;
+    size_t next;                /* next query with the same key, SIZE_MAX if none */
+    bool matched;               /* fields below are those of the last match, first query of a key only */
+    bool follow;                /* a link to follow */
+    tar_stat_t st;
+    char *target;               /* key of the link target, NULL if the link leads out of the archive */
+} lookup_query_t;
+
+/**
+ * Looks up all the keys left in `keys` with a single scan of the archive. A key is freed and set to
+ * NULL once answered. With TAR_LOOKUP_FOLLOW, the key of a link is replaced by the key of its target
+ * for the next scan. The whole archive is scanned, so that the last of duplicate members wins as in
+ * scan_find().
+ *
+ * @return the number of keys left to look up, or -1 on failure.
+ */
+static long lookup_pass(int tar_fd, char **keys, size_t count, int flags, tar_stat_t *stats, int *found) {
+    size_t nb_keys = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (keys[i] != NULL) nb_keys++;
+    }
+    if (nb_keys == 0) return 0;
+
+    size_t nb_slots = 16;
+    while (nb_slots < nb_keys * 2) nb_slots *= 2;
+    size_t mask = nb_slots - 1;
+    size_t *slots = calloc(nb_slots, sizeof(size_t));           /* first query with a key + 1, zero if empty */
+    lookup_query_t *queries = malloc(count * sizeof(lookup_query_t));
+    char **targets = calloc(count, sizeof(char *));
+    tar_iter_t iter;
+    if (slots == NULL || queries == NULL || targets == NULL || tar_iter_init(&iter, tar_fd) < 0) {
+        free(slots);
+        free(queries);
+        free(targets);
+        return -1;
+    }
+
+    // queries with the same key are chained behind the first one, which alone is in the table
+    for (size_t i = 0; i < count; ++i) {
+        if (keys[i] == NULL) continue;
+        lookup_query_t *query = &queries[i];
+        query->key_len = strlen(keys[i]);
+        query->hash = hash_name(keys[i], query->key_len);
+        query->next = SIZE_MAX;
+        query->matched = false;
+        query->target = NULL;
+        found[i] = 0;
+
+        size_t slot = query->hash & mask;
+        while (slots[slot] != 0) {
+            size_t first = slots[slot] - 1;
+            if (queries[first].hash == query->hash && queries[first].key_len == query->key_len
+                && memcmp(keys[first], keys[i], query->key_len) == 0) {
+                query->next = queries[first].next;
+                queries[first].next = i;
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+        if (slots[slot] == 0) slots[slot] = i + 1;
+    }
+
+    long result = 0;
+    bool failed = false;
+    const tar_iter_entry_t *entry;
+    while ((entry = tar_iter_next(&iter)) != NULL) {
+        if (TAR_IS_EXTENSION(entry->typeflag)) continue;
+        size_t len;
+        const char *key = path_key(entry->name, entry->name_len, &len);
+        uint32_t h = hash_name(key, len);
+
+        size_t slot = h & mask;
+        while (slots[slot] != 0) {
+            size_t first = slots[slot] - 1;
+            if (queries[first].hash == h && queries[first].key_len == len && memcmp(keys[first], key, len) == 0) break;
+            slot = (slot + 1) & mask;
+        }
+        if (slots[slot] == 0) continue;
+
+        lookup_query_t *query = &queries[slots[slot] - 1];
+        query->matched = true;
+        query->follow = (flags & TAR_LOOKUP_FOLLOW) && (entry->typeflag == SYMTYPE || entry->typeflag == LNKTYPE);
+        query->st.typeflag = entry->typeflag;
+        query->st.mode = entry->mode;
+        query->st.size = entry->size;
+        query->st.mtime = entry->mtime;
+        query->st.offset = entry->offset;
+        free(query->target);
+        query->target = NULL;
+
+        char target[PATH_MAX_INDEX];
+        // hard link targets are relative to the root of the archive, a link leading out of it is not found
+        if (query->follow && join_link_path(entry->typeflag == LNKTYPE ? "" : entry->name, entry->linkname, target) >= 0
+            && (query->target = strdup(target)) == NULL) {
+            failed = true;
+        }
+    }
+    if (iter.corrupt) failed = true;
+    tar_iter_release(&iter);
+
+    for (size_t slot = 0; slot < nb_slots; ++slot) {
+        if (slots[slot] == 0) continue;
+        lookup_query_t *query = &queries[slots[slot] - 1];
+        for (size_t i = slots[slot] - 1; query->matched && i != SIZE_MAX; i = queries[i].next) {
+            stats[i] = query->st;
+            found[i] = !query->follow;
+            if (query->follow && query->target != NULL) {
+                if ((targets[i] = strdup(query->target)) == NULL) failed = true;
+                result++;
+            }
+        }
+        free(query->target);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        free(keys[i]);
+        keys[i] = targets[i];
+    }
+    free(slots);
+    free(queries);
+    free(targets);
+    return failed ? -1 : result;
+}
+
+/**
+ * tar_lookup_many() without counting a call, for the public functions built on it.
+ */
+static long lookup_many(int tar_fd, const char *const *paths, size_t count, int flags, tar_stat_t *stats, int *found) {
+    char **keys = calloc(count > 0 ? count : 1, sizeof(char *));
+    if (keys == NULL) return -1;
+
+    bool failed = false;
+    for (size_t i = 0; i < count && !failed; ++i) {
+        char key[PATH_MAX_INDEX];
+        found[i] = 0;
+        if (paths[i] == NULL || path_normalize(paths[i], key) < 0) continue;
+        if ((keys[i] = strdup(key)) == NULL) failed = true;
+    }
+
+    // each scan answers the paths, then the links they lead to
+    for (int hops = 0; hops <= MAX_LINK_HOPS && !failed; ++hops) {
+        long left = lookup_pass(tar_fd, keys, count, flags, stats, found);
+        if (left < 0) failed = true;
+        if (left <= 0) break;
+    }
+
+    long nb_found = 0;
+    for (size_t i = 0; i < count; ++i) {
+        free(keys[i]);
+        if (found[i]) nb_found++;
+    }
+    free(keys);
+    return failed ? -1 : nb_found;
+}
+
+/**
+ * Looks up many paths with a single scan of the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param paths The paths to look up.
+ * @param count The number of paths.
+ * @param flags Zero or TAR_LOOKUP_FOLLOW.
+ * @param stats Receives the metadata of the entry of paths[i] in stats[i].
+ * @param found found[i] is set to a non-zero value if paths[i] leads to an entry, zero otherwise.
+ *
+ * @return the number of paths found, or -1 if the archive could not be read or memory could not be allocated.
+ */
+long tar_lookup_many(int tar_fd, const char *const *paths, size_t count, int flags, tar_stat_t *stats, int *found) {
+    STATS_SCOPE(NULL, TAR_STATS_LOOKUP_MANY);
+    return lookup_many(tar_fd, paths, count, flags, stats, found);
+}
+
+/**
+ * Lists the entries at a given path in the archive.
+ * list() does not recurse into the directories listed at the given path.
+ * A member appended several times to the archive is listed once, under the name of its last copy.
+ *
+ * Example:
+ *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
+ *   ├── a
+ *   ├── b
+ *   ├── c/
+ *   │   └── d
+ *   └── e/
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
+ *             ".", "./" and "" are the root of the archive, whose top-level entries are listed.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
+    STATS_SCOPE(NULL, TAR_STATS_LIST);
+    char root[PATH_MAX_INDEX];
+    long root_len = path != NULL ? path_normalize(path, root) : -1;
+    scan_entry_t dir;
+    // an empty key, as in ".", "./" or "", is the root of the archive, which has no entry of its own
+    if (root_len < 0 || (root_len > 0 && (!scan_resolve(tar_fd, path, &dir) || dir.typeflag != DIRTYPE))) {
+        *no_entries = 0;
+        return 0;
+    }
+
+    // the keys listed so far, so that a member appended again is found without going through them all
+    size_t nb_slots = 16;
+    while (nb_slots < *no_entries * 2) nb_slots *= 2;
+    size_t mask = nb_slots - 1;
+    size_t *slots = calloc(nb_slots, sizeof(size_t));           /* listed entry + 1, zero if empty */
+    uint32_t *hashes = malloc((*no_entries + 1) * sizeof(uint32_t));
+    tar_iter_t iter;
+    if (slots == NULL || hashes == NULL || tar_iter_init(&iter, tar_fd) < 0) {
+        free(slots);
+        free(hashes);
+        *no_entries = 0;
+        return 0;
+    }
+
+    size_t dir_len = 0;
+    const char *dir_key = root_len > 0 ? path_key(dir.name, strlen(dir.name), &dir_len) : "";
+    // the children of the root have no slash in their key, the others start with the key of the directory and one
+    size_t prefix_len = dir_len > 0 ? dir_len + 1 : 0;
+    size_t listed = 0;
+    const tar_iter_entry_t *entry;
+
+    // the scan goes on once the entries are full, as a later copy of a member listed can still replace it
+    while ((entry = tar_iter_next(&iter)) != NULL) {
+        size_t len;
+        const char *key = path_key(entry->name, entry->name_len, &len);
+
+        if (TAR_IS_EXTENSION(entry->typeflag) || len <= prefix_len) continue;
+        if (dir_len > 0 && (key[dir_len] != '/' || memcmp(key, dir_key, dir_len) != 0)) continue;
+        // skip anything deeper than a direct child
+        if (memchr(key + prefix_len, '/', len - prefix_len) != NULL) continue;
+
+        // a member appended again keeps the place of the first copy, under the name of the last one
+        uint32_t h = hash_name(key, len);
+        size_t slot = h & mask;
+        while (slots[slot] != 0) {
+            size_t first = slots[slot] - 1;
+            size_t listed_len = 0;
+            const char *listed_key = hashes[first] == h ? path_key(entries[first], strlen(entries[first]), &listed_len) : NULL;
+            if (listed_key != NULL && listed_len == len && memcmp(listed_key, key, len) == 0) break;
+            slot = (slot + 1) & mask;
+        }
+        if (slots[slot] == 0) {
+            if (listed == *no_entries) continue;
+            hashes[listed] = h;
+            slots[slot] = ++listed;
+        }
+        memcpy(entries[slots[slot] - 1], entry->name, entry->name_len + 1);
+    }
+
+    tar_iter_release(&iter);
+    free(slots);
+    free(hashes);
+    *no_entries = listed;
+    return 1;
+}
+
+/**
+ * Reads a file at a given path in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ *
+ */
+ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    STATS_SCOPE(NULL, TAR_STATS_READ_FILE);
+    if(path == NULL || strlen(path) == 0) return -1;
+    if(dest == NULL || len == NULL) return -1;
+
+    scan_entry_t found;
+    if (!scan_resolve(tar_fd, path, &found)) return -1;
+    if (found.typeflag != REGTYPE && found.typeflag != AREGTYPE) return -1;
+
+    uint64_t size = found.size;
+    uint64_t header_offset = found.offset;
+    if (offset > size) return -2;
+
+    size_t to_read = size - offset;
+    if (to_read > *len) to_read = *len;
+
+    off_t base = archive_start(tar_fd);
+    struct stat st;
+    decoder_t *decoder;
+    if (base < 0 || fstat(tar_fd, &st) < 0 || decoder_open(tar_fd, base, &decoder) < 0) return -1;
+
+    tar_cache_key_t key;
+    cache_archive_key(&st, base, &key);
+    size_t done = archive_read(tar_fd, base, decoder, &key, dest, to_read, header_offset + sizeof(tar_header_t) + offset);
+    decoder_close(decoder);
+    *len = done;
+    return (ssize_t) (size - offset - done);
+}
+
+/*
+ * Batched reads.
+ *
+ * read_files() finds all the entries with one scan, then reads the requested ranges in archive order.
+ * Ranges separated by less than READ_GAP_MAX bytes (typically the padding and header between two small
+ * files) are read by the same vectored read, the bytes in between going to a scratch buffer, so that a
+ * bundle of small files costs a few large sequential reads.
+ */
+
+#define READ_GAP_MAX (16 * 1024)
+#define READ_MAX_IOV 1024
+
+typedef struct read_range {
+    uint64_t start;             /* archive offset */
+    size_t len;
+    size_t request;
+} read_range_t;
+
+static int read_range_compare(const void *a, const void *b) {
+    const read_range_t *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/**
+ * Reads the ranges, sorted by offset, with as few vectored reads as possible.
+ */
+static void read_ranges(int tar_fd, off_t base, tar_read_request_t *requests, const read_range_t *ranges,
+                        size_t nb_ranges, struct iovec *iov, uint8_t *gap) {
+    size_t r = 0;
+    while (r < nb_ranges) {
+        size_t first = r;
+        uint64_t start = ranges[r].start;
+        uint64_t end = start;
+        int nb_iov = 0;
+
+        // overlapping ranges are left to the next read
+        while (r < nb_ranges && nb_iov + 2 <= READ_MAX_IOV && ranges[r].start >= end
+               && ranges[r].start - end <= READ_GAP_MAX) {
+            if (ranges[r].start > end) {
+                iov[nb_iov].iov_base = gap;
+                iov[nb_iov++].iov_len = (size_t) (ranges[r].start - end);
+            }
+            iov[nb_iov].iov_base = requests[ranges[r].request].dest;
+            iov[nb_iov++].iov_len = ranges[r].len;
+            end = ranges[r].start + ranges[r].len;
+            r++;
+        }
+
+        size_t got = preadv_full(tar_fd, iov, nb_iov, base + (off_t) start);
+        for (size_t k = first; k < r; ++k) {
+            uint64_t from = ranges[k].start - start;
+            size_t done = got > from ? (got - from < ranges[k].len ? (size_t) (got - from) : ranges[k].len) : 0;
+            requests[ranges[k].request].len = done;
+            requests[ranges[k].request].result -= (ssize_t) done;
+        }
+    }
+}
+
+/**
+ * Reads several files of the archive, scanning it once and reading the files in archive order.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param requests The reads to make. The result and len of each request are set as read_file() does.
+ * @param count The number of requests.
+ *
+ * @return zero if the requests were processed, -1 if the archive could not be read or memory could
+ *         not be allocated.
+ */
+int read_files(int tar_fd, tar_read_request_t *requests, size_t count) {
+    STATS_SCOPE(NULL, TAR_STATS_READ_FILES);
+    if (count == 0) return 0;
+
+    const char **paths = malloc(count * sizeof(char *));
+    tar_stat_t *stats = malloc(count * sizeof(tar_stat_t));
+    int *found = malloc(count * sizeof(int));
+    read_range_t *ranges = malloc(count * sizeof(read_range_t));
+    struct iovec *iov = malloc(READ_MAX_IOV * sizeof(struct iovec));
+    uint8_t *gap = malloc(READ_GAP_MAX);
+    decoder_t *decoder = NULL;
+    int result = -1;
+
+    off_t base = archive_start(tar_fd);
+    struct stat st;
+    if (paths == NULL || stats == NULL || found == NULL || ranges == NULL || iov == NULL || gap == NULL
+        || base < 0 || fstat(tar_fd, &st) < 0 || decoder_open(tar_fd, base, &decoder) < 0) {
+        goto done;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        paths[i] = requests[i].path;
+    }
+    if (lookup_many(tar_fd, paths, count, TAR_LOOKUP_FOLLOW, stats, found) < 0) goto done;
+
+    size_t nb_ranges = 0;
+    for (size_t i = 0; i < count; ++i) {
+        tar_read_request_t *request = &requests[i];
+        if (!found[i] || (stats[i].typeflag != REGTYPE && stats[i].typeflag != AREGTYPE) || request->dest == NULL) {
+            request->result = -1;
+            continue;
+        }
+        if (request->offset > stats[i].size) {
+            request->result = -2;
+            continue;
+        }
+
+        uint64_t left = stats[i].size - request->offset;
+        size_t to_read = left < request->len ? (size_t) left : request->len;
+        request->result = (ssize_t) left;
+        request->len = 0;
+        if (to_read == 0) continue;
+
+        ranges[nb_ranges].start = stats[i].offset + sizeof(tar_header_t) + request->offset;
+        ranges[nb_ranges].len = to_read;
+        ranges[nb_ranges].request = i;
+        nb_ranges++;
+    }
+    qsort(ranges, nb_ranges, sizeof(read_range_t), read_range_compare);
+
+    tar_cache_key_t key;
+    cache_archive_key(&st, base, &key);
+    if (decoder != NULL || cache_enabled()) {
+        // decompression only moves forward and the cache has its own reads, ranges are read one by one in order
+        for (size_t r = 0; r < nb_ranges; ++r) {
+            tar_read_request_t *request = &requests[ranges[r].request];
+            request->len = archive_read(tar_fd, base, decoder, &key, request->dest, ranges[r].len, ranges[r].start);
+            request->result -= (ssize_t) request->len;
+        }
+    } else {
+        read_ranges(tar_fd, base, requests, ranges, nb_ranges, iov, gap);
+    }
+    result = 0;
+
+done:
+    decoder_close(decoder);
+    free(paths);
+    free(stats);
+    free(found);
+    free(ranges);
+    free(iov);
+    free(gap);
+    return result;
+}
+
+/*
+ * Extraction.
+ *
+ * The archive is walked once with an iterator. Payloads already sitting in the iterator buffer are
+ * written from there, larger ones are copied by the kernel with copy_file_range() (or sendfile() when
+ * the file systems do not allow it), and only as a last resort through a fixed-size copy buffer.
+ * Memory use therefore does not depend on the size of the entries.
+ *
+ * Paths are opened one component at a time with O_NOFOLLOW below the target directory, so neither
+ * ".." nor a symlink extracted earlier can make an entry land outside of it. The directory of the
+ * previous entry is kept open since archives usually store the entries of a directory together.
+ * Directories that would not be writable with their final mode get it once everything is extracted.
+ */
+
+#define EXTRACT_BUFFER (256 * 1024)
+
+typedef struct deferred_mode {
+    char *path;
+    mode_t mode;
+} deferred_mode_t;
+
+typedef struct extract_ctx {
+    int tar_fd;
+    int root_fd;
+
+    int parent_fd;              /* directory of the previous entry, -1 if none */
+    char parent[PATH_MAX_INDEX];
+    size_t parent_len;
+
+    uint8_t *buf;               /* copy buffer, allocated on first use */
+    bool no_copy_range;
+    bool no_sendfile;
+
+    deferred_mode_t *deferred;
+    size_t nb_deferred;
+    size_t cap_deferred;
+} extract_ctx_t;
+
+/**
+ * Builds the relative path an entry is extracted to from its full name, dropping "." components,
+ * repeated and trailing slashes.
+ *
+ * @param out A buffer of PATH_MAX_INDEX bytes.
+ *
+ * @return the length of the path, or -1 if it is empty, absolute or contains a ".." component.
+ */
+static long extract_path(const char *full, char *out) {
+    if (full[0] == '/') return -1;
+
+    size_t out_len = 0;
+    const char *component = full;
+    while (*component != '\0') {
+        const char *end = strchr(component, '/');
+        size_t comp_len = end ? (size_t) (end - component) : strlen(component);
+
+        if (comp_len == 2 && component[0] == '.' && component[1] == '.') return -1;
+        if (comp_len > 0 && !(comp_len == 1 && component[0] == '.')) {
+            if (out_len > 0) out[out_len++] = '/';
+            memcpy(out + out_len, component, comp_len);
+            out_len += comp_len;
+        }
+        if (end == NULL) break;
+        component = end + 1;
+    }
+    out[out_len] = '\0';
+    return out_len > 0 ? (long) out_len : -1;
+}
+
+/**
+ * Opens the directory at `path` (`len` bytes, relative to root_fd) without following any symlink,
+ * creating the missing components if asked to.
+ *
+ * @return a file descriptor of the directory, or -1.
+ */
+static int open_beneath(int root_fd, const char *path, size_t len, bool create) {
+    int fd = dup(root_fd);
+    char component[PATH_MAX_INDEX];
+    size_t start = 0;
+
+    while (fd >= 0 && start < len) {
+        size_t end = start;
+        while (end < len && path[end] != '/') end++;
+        memcpy(component, path + start, end - start);
+        component[end - start] = '\0';
+
+        if (create) mkdirat(fd, component, 0755);
+        int next = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        close(fd);
+        fd = next;
+        start = end + 1;
+    }
+    return fd;
+}
+
+/**
+ * Opens the parent directory of an entry, reusing the one of the previous entry when it is the same.
+ *
+ * @return a file descriptor owned by the context, or -1.
+ */
+static int extract_parent(extract_ctx_t *ctx, const char *path, size_t dir_len) {
+    if (ctx->parent_fd >= 0 && ctx->parent_len == dir_len && memcmp(ctx->parent, path, dir_len) == 0) {
+        return ctx->parent_fd;
+    }
+    if (ctx->parent_fd >= 0) close(ctx->parent_fd);
+
+    ctx->parent_fd = open_beneath(ctx->root_fd, path, dir_len, true);
+    if (ctx->parent_fd >= 0) {
+        memcpy(ctx->parent, path, dir_len);
+        ctx->parent_len = dir_len;
+    }
+    return ctx->parent_fd;
+}
+
+/**
+ * Copies `size` bytes of the archive, starting at file offset `position`, to out_fd.
+ */
+static int extract_copy(extract_ctx_t *ctx, int out_fd, off_t position, uint64_t size) {
+    while (size > 0) {
+        size_t chunk = size > (1 << 30) ? (1 << 30) : (size_t) size;
+        ssize_t copied = -1;
+
+        if (!ctx->no_copy_range) {
+            off_t in = position;
+            copied = copy_file_range(ctx->tar_fd, &in, out_fd, NULL, chunk, 0);
+            STATS_ADD(syscalls, 1);
+            if (copied < 0 && errno != EINTR) ctx->no_copy_range = true;
+        }
+        if (copied < 0 && ctx->no_copy_range && !ctx->no_sendfile) {
+            off_t in = position;
+            copied = sendfile(out_fd, ctx->tar_fd, &in, chunk);
+            STATS_ADD(syscalls, 1);
+            if (copied < 0 && errno != EINTR) ctx->no_sendfile = true;
+        }
+        if (copied < 0 && ctx->no_copy_range && ctx->no_sendfile) {
+            if (ctx->buf == NULL && (ctx->buf = malloc(EXTRACT_BUFFER)) == NULL) return -1;
+            size_t reading = pread_full(ctx->tar_fd, ctx->buf, chunk < EXTRACT_BUFFER ? chunk : EXTRACT_BUFFER, position);
+            if (reading == 0 || write_full(out_fd, ctx->buf, reading) < 0) return -1;
+            copied = (ssize_t) reading;
+        }
+
+        if (copied == 0) return -1;     /* archive shorter than announced */
+        if (copied > 0 && !(ctx->no_copy_range && ctx->no_sendfile)) STATS_ADD(bytes_read, copied);
+        if (copied > 0) {
+            position += copied;
+            size -= (uint64_t) copied;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Copies `size` bytes of a compressed archive, starting at archive offset `offset`, to out_fd.
+ */
+static int extract_decoded(extract_ctx_t *ctx, decoder_t *decoder, int out_fd, uint64_t offset, uint64_t size) {
+    if (ctx->buf == NULL && (ctx->buf = malloc(EXTRACT_BUFFER)) == NULL) return -1;
+    while (size > 0) {
+        size_t reading = decoder_read(decoder, ctx->buf, size < EXTRACT_BUFFER ? (size_t) size : EXTRACT_BUFFER, offset);
+        if (reading == 0 || write_full(out_fd, ctx->buf, reading) < 0) return -1;
+        offset += reading;
+        size -= reading;
+    }
+    return 0;
+}
+
+static int extract_file(extract_ctx_t *ctx, tar_iter_t *iter, const tar_iter_entry_t *entry,
+                        int dir_fd, const char *base, mode_t mode) {
+    int out_fd = openat(dir_fd, base, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (out_fd < 0 && errno == ELOOP) {
+        unlinkat(dir_fd, base, 0);
+        out_fd = openat(dir_fd, base, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    }
+    if (out_fd < 0) return -1;
+
+    uint64_t payload = entry->offset + sizeof(tar_header_t);
+    uint64_t size = entry->size;
+    uint64_t buf_end = iter->buf_start + iter->buf_len;
+    int result = 0;
+    // the start of the payload already read with the header, the decoder has gone past it
+    if (payload >= iter->buf_start && payload < buf_end && size > 0) {
+        size_t in_buffer = (size_t) (size < buf_end - payload ? size : buf_end - payload);
+        result = write_full(out_fd, iter->buf + (payload - iter->buf_start), in_buffer);
+        payload += in_buffer;
+        size -= in_buffer;
+    }
+    if (result == 0 && size > 0) {
+        result = iter->decoder != NULL
+                 ? extract_decoded(ctx, iter->decoder, out_fd, payload, size)
+                 : extract_copy(ctx, out_fd, iter->base + (off_t) payload, size);
+    }
+
+    if (result == 0) {
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = (time_t) entry->mtime;
+        times[1].tv_nsec = 0;
+        fchmod(out_fd, mode);
+        futimens(out_fd, times);
+    }
+    close(out_fd);
+    return result;
+}
+
+/**
+ * Creates a directory, or changes the mode of an existing one.
+ *
+ * @return zero, 1 if the path exists but is not a directory (a symlink included), or -1 on failure.
+ */
+static int extract_dir(extract_ctx_t *ctx, int dir_fd, const char *path, const char *base, mode_t mode) {
+    if (mkdirat(dir_fd, base, mode | S_IRWXU) < 0 && errno != EEXIST) return -1;
+    // the mode is changed through a descriptor, fchmodat() would follow a symlink out of the destination
+    int fd = openat(dir_fd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return errno == ELOOP || errno == ENOTDIR ? 1 : -1;
+    if ((mode & S_IRWXU) == S_IRWXU) {
+        int result = fchmod(fd, mode);
+        close(fd);
+        return result;
+    }
+    close(fd);
+
+    if (ctx->nb_deferred == ctx->cap_deferred) {
+        size_t cap = ctx->cap_deferred ? ctx->cap_deferred * 2 : 16;
+        deferred_mode_t *deferred = realloc(ctx->deferred, cap * sizeof(deferred_mode_t));
+        if (deferred == NULL) return -1;
+        ctx->deferred = deferred;
+        ctx->cap_deferred = cap;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL) return -1;
+    ctx->deferred[ctx->nb_deferred].path = copy;
+    ctx->deferred[ctx->nb_deferred].mode = mode;
+    ctx->nb_deferred++;
+    return 0;
+}
+
+static int extract_hard_link(extract_ctx_t *ctx, const char *linkname, int dir_fd, const char *base) {
+    char target[PATH_MAX_INDEX];
+    long len = extract_path(linkname, target);
+    if (len < 0) return -1;
+
+    const char *slash = strrchr(target, '/');
+    size_t target_dir_len = slash ? (size_t) (slash - target) : 0;
+    int target_dir_fd = open_beneath(ctx->root_fd, target, target_dir_len, false);
+    if (target_dir_fd < 0) return -1;
+
+    unlinkat(dir_fd, base, 0);
+    int result = linkat(target_dir_fd, slash ? slash + 1 : target, dir_fd, base, 0);
+    close(target_dir_fd);
+    return result;
+}
+
+/**
+ * Extracts the archive into a directory.
+ *
+ * Regular files, directories, symlinks and hard links are created with the mode of their header,
+ * files also get their modification time. Other kinds of entries are skipped, as are entries whose
+ * path is absolute, contains ".." or goes through a symlink, and directories whose path already
+ * exists as something else than a directory, so that nothing is written outside of `dest_dir`.
+ * Existing files are overwritten.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param dest_dir The directory to extract to, created if it does not exist.
+ *
+ * @return the number of entries extracted, or -1 if the archive could not be read or an entry could
+ *         not be written.
+ */
+int tar_extract(int tar_fd, const char *dest_dir) {
+    STATS_SCOPE(NULL, TAR_STATS_EXTRACT);
+    mkdir(dest_dir, 0755);
+
+    extract_ctx_t ctx;
+    memset(&ctx, 0, sizeof(extract_ctx_t));
+    ctx.tar_fd = tar_fd;
+    ctx.parent_fd = -1;
+    ctx.root_fd = open(dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ctx.root_fd < 0) return -1;
+
+    tar_iter_t iter;
+    if (tar_iter_init(&iter, tar_fd) < 0) {
+        close(ctx.root_fd);
+        return -1;
+    }
+    // the archive is read once, caching it would only evict the blocks of other queries
+    iter.cache_key.hash = 0;
+
+    int extracted = 0;
+    char path[PATH_MAX_INDEX];
+    const tar_iter_entry_t *entry;
+
+    while ((entry = tar_iter_next(&iter)) != NULL) {
+        if (TAR_IS_EXTENSION(entry->typeflag)) continue;
+        long len = extract_path(entry->name, path);
+        if (len < 0) continue;
+
+        char *slash = strrchr(path, '/');
+        size_t dir_len = slash ? (size_t) (slash - path) : 0;
+        const char *base = slash ? slash + 1 : path;
+        mode_t mode = entry->mode & 07777;
+
+        int dir_fd = extract_parent(&ctx, path, dir_len);
+        if (dir_fd < 0) continue;       /* goes through a symlink or a file */
+
+        int result = 0;
+        switch (entry->typeflag) {
+            case REGTYPE:
+            case AREGTYPE:
+                result = extract_file(&ctx, &iter, entry, dir_fd, base, mode);
+                break;
+            case DIRTYPE:
+                result = extract_dir(&ctx, dir_fd, path, base, mode);
+                if (result > 0) continue;   /* not a directory, or a symlink */
+                break;
+            case SYMTYPE:
+                unlinkat(dir_fd, base, 0);
+                result = symlinkat(entry->linkname, dir_fd, base);
+                break;
+            case LNKTYPE:
+                result = extract_hard_link(&ctx, entry->linkname, dir_fd, base);
+                break;
+            default:
+                continue;
+        }
+        if (result < 0) {
+            extracted = -1;
+            break;
+        }
+        extracted++;
+    }
+    if (iter.corrupt) extracted = -1;
+    tar_iter_release(&iter);
+
+    // deepest directories first, so that a parent is still writable while its children are changed
+    for (size_t n = ctx.nb_deferred; n > 0; --n) {
+        deferred_mode_t *deferred = &ctx.deferred[n - 1];
+        int fd = open_beneath(ctx.root_fd, deferred->path, strlen(deferred->path), false);
+        if (fd >= 0) {
+            fchmod(fd, deferred->mode);
+            close(fd);
+        }
+        free(deferred->path);
+    }
+    free(ctx.deferred);
+    free(ctx.buf);
+    if (ctx.parent_fd >= 0) close(ctx.parent_fd);
+    close(ctx.root_fd);
+    return extracted;
+}
+
+/*
+ * Streaming.
+ *
+ * For inputs that cannot seek, like pipes and sockets, the archive goes through a buffer filled with
+ * read() and every byte is read exactly once. Headers are checked and handed to the visitor, and the
+ * payloads it asks for are handed to it in chunks straight from the buffer. The others are read and
+ * dropped, except those of extension headers which are gathered and decoded for the next entries.
+ * Nothing is read after the end-of-archive block.
+ */
+
+/**
+ * Reads more of the stream at the end of the buffer.
+ *
+ * @return the number of bytes read, zero at the end of the stream, -1 on failure.
+ */
+static ssize_t stream_fill(int fd, uint8_t *buf, size_t *len, size_t cap) {
+    while (true) {
+        ssize_t reading = read(fd, buf + *len, cap - *len);
+        STATS_ADD(syscalls, 1);
+        if (reading < 0 && errno == EINTR) continue;
+        if (reading > 0) STATS_ADD(bytes_read, reading);
+        if (reading > 0) *len += (size_t) reading;
+        return reading;
+    }
+}
+
+/**
+ * Reads an archive from its current position to its end without seeking, calling a visitor for each entry.
+ *
+ * @param fd A file descriptor on the archive, which does not need to be seekable.
+ * @param visitor The callbacks.
+ *
+ * @return the number of headers read if the archive is valid,
+ *         -1, -2 or -3 if a header is invalid, as check_archive(),
+ *         -4 if reading failed, the stream ended inside an entry or the size of an entry is invalid,
+ *         -5 if the visitor stopped the stream.
+ */
+int tar_stream(int fd, const tar_visitor_t *visitor) {
+    STATS_SCOPE(NULL, TAR_STATS_STREAM);
+    size_t cap = scan_chunk;
+    uint8_t *buf = malloc(cap);
+    tar_extensions_t *ext = calloc(1, sizeof(tar_extensions_t));
+    if (buf == NULL || ext == NULL) {
+        free(buf);
+        free(ext);
+        return -4;
+    }
+
+    size_t pos = 0;
+    size_t len = 0;
+    uint64_t offset = 0;
+    int result = 0;
+
+    while (result >= 0) {
+        // a header is always whole in the buffer
+        if (len - pos < sizeof(tar_header_t)) {
+            memmove(buf, buf + pos, len - pos);
+            len -= pos;
+            pos = 0;
+            ssize_t reading = 1;
+            while (len < sizeof(tar_header_t) && (reading = stream_fill(fd, buf, &len, cap)) > 0);
+            // an archive without end-of-archive block ends here, but not partway through a header
+            if (reading < 0 || (reading == 0 && len > 0)) result = -4;
+            if (reading <= 0) break;
+        }
+
+        const tar_header_t *header = (const tar_header_t *) (buf + pos);
+        if (block_is_zero(buf + pos)) break;
+        int error = tar_check_header(header);
+        if (error < 0) {
+            result = error;
+            break;
+        }
+
+        tar_iter_entry_t entry;
+        entry.offset = offset;
+        ext_entry(ext, header, &entry);
+        STATS_ADD(headers, 1);
+        uint64_t size = entry.size;
+        if (size > ENTRY_SIZE_MAX) {
+            result = -4;
+            break;
+        }
+
+        // extension payloads are kept, the visitor only sees the entries they describe
+        uint8_t *gather = NULL;
+        int wanted = 0;
+        if (TAR_IS_EXTENSION(entry.typeflag)) {
+            if (size <= EXTENSION_MAX && ext->payload == NULL) ext->payload = malloc(EXTENSION_MAX);
+            if (size <= EXTENSION_MAX) gather = ext->payload;
+        } else if (visitor->on_header != NULL) {
+            wanted = visitor->on_header(visitor->arg, &entry);
+        }
+        if (wanted < 0) {
+            result = -5;
+            break;
+        }
+        result++;
+        pos += sizeof(tar_header_t);
+        offset += sizeof(tar_header_t);
+
+        // the payload and its padding, delivered or dropped chunk by chunk
+        uint64_t data_left = size;
+        uint64_t left = padded_size(size);
+        while (left > 0) {
+            if (pos == len) {
+                pos = 0;
+                len = 0;
+                if (stream_fill(fd, buf, &len, cap) <= 0) {
+                    result = -4;
+                    break;
+                }
+            }
+            size_t chunk = len - pos < left ? len - pos : (size_t) left;
+            size_t data = data_left < chunk ? (size_t) data_left : chunk;
+            if (data > 0 && gather != NULL) memcpy(gather + (size - data_left), buf + pos, data);
+            if (data > 0 && wanted > 0 && visitor->on_data != NULL
+                && visitor->on_data(visitor->arg, buf + pos, data) < 0) {
+                result = -5;
+                break;
+            }
+            data_left -= data;
+            left -= chunk;
+            pos += chunk;
+            offset += chunk;
+        }
+        if (gather != NULL && left == 0) ext_read(ext, entry.typeflag, gather, (size_t) size);
+    }
+
+    free(ext->payload);
+    free(ext);
+    free(buf);
+    return result;
+}
+
+/*
+ * In-memory archive index.
+ *
+ * Entries are kept in a flat array in archive order, their names in a single string pool, and an
+ * open-addressing hash table (power-of-two slots holding entry number + 1, zero meaning empty)
+ * maps the key of a name to its entry. Each entry records the hash and length of its key, so that a
+ * probe only compares names once both match. When the same key appears twice, the last one wins as
+ * with tar(1).
+ *
+ * The directory tree is stored as adjacency lists: the children of each directory are contiguous in
+ * the children array, so listing a directory only touches its direct children. Entries whose parent
+ * directory has no entry of its own in the archive are not part of the tree.
+ *
+ * Symlinks and hard links are resolved when the index is built: each entry records the entry that
+ * following its links leads to, so lookups never walk a chain of links themselves.
+ */
+
+#define INDEX_ROOT UINT32_MAX
+#define INDEX_ORPHAN (UINT32_MAX - 1)
+
+#define INDEX_DANGLING UINT32_MAX
+#define INDEX_RESOLVING (UINT32_MAX - 1)
+#define INDEX_UNRESOLVED (UINT32_MAX - 2)
+
+typedef struct tar_index_entry {
+    uint64_t header_offset;     /* from the start of the archive */
+    uint64_t size;
+    int64_t mtime;
+    uint32_t name_offset;       /* in the names pool */
+    uint32_t name_len;
+    uint32_t link_offset;       /* in the names pool, symlinks and hard links only */
+    uint32_t link_len;
+    uint32_t key_offset;        /* in the names pool, inside the name */
+    uint32_t key_len;
+    uint32_t hash;              /* of the key */
+    uint32_t mode;
+    uint32_t parent;            /* entry number of the parent directory, INDEX_ROOT or INDEX_ORPHAN */
+    uint32_t child_start;       /* first child in the children array, directories only */
+    uint32_t child_count;
+    uint32_t target;            /* final entry reached by following links, itself for other entries */
+    char typeflag;
+} tar_index_entry_t;
+
+struct tar_index {
+    int tar_fd;
+    off_t base;                 /* offset of the archive in tar_fd */
+
+    tar_index_entry_t *entries;
+    size_t nb_entries;
+    size_t cap_entries;
+
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+
+    uint32_t *slots;
+    size_t nb_slots;
+
+    uint32_t *children;         /* entry numbers grouped by parent, in archive order */
+    uint32_t root_start;        /* children of the archive root */
+    uint32_t root_count;
+
+    const uint8_t *map;         /* whole file when opened with tar_open_mmap(), NULL otherwise */
+    size_t map_len;
+
+    void *sidecar;              /* mapping the arrays point into when loaded with tar_index_load() */
+    size_t sidecar_len;
+
+    decoder_t *decoder;         /* decompression cursor and checkpoints of a compressed archive, NULL otherwise */
+    tar_cache_key_t cache_key;  /* identifies the archive, as it was when indexed, in the block cache */
+
+#ifdef LIB_TAR_STATS
+    tar_stats_t stats;
+#endif
+};
+
+/* Counters of what is done through an index, NULL (those of the file descriptor functions) without one */
+#define INDEX_STATS(idx) ((idx) != NULL ? &(idx)->stats : NULL)
+
+static const char *index_name(const tar_index_t *idx, const tar_index_entry_t *entry) {
+    return idx->names + entry->name_offset;
+}
+
+static const char *index_key(const tar_index_t *idx, const tar_index_entry_t *entry) {
+    return idx->names + entry->key_offset;
+}
+
+/**
+ * Appends a string to the names pool of the index and returns its offset, or -1 on allocation failure.
+ */
+static long index_add_string(tar_index_t *idx, const char *str, size_t len) {
+    if (idx->names_len + len + 1 > idx->names_cap) {
+        size_t cap = idx->names_cap ? idx->names_cap : 4096;
+        while (idx->names_len + len + 1 > cap) cap *= 2;
+        char *names = realloc(idx->names, cap);
+        if (names == NULL) return -1;
+        idx->names = names;
+        idx->names_cap = cap;
+    }
+    long offset = (long) idx->names_len;
+    memcpy(idx->names + idx->names_len, str, len);
+    idx->names[idx->names_len + len] = '\0';
+    idx->names_len += len + 1;
+    return offset;
+}
+
+/**
+ * Places entry number `n` in the hash table, replacing an older entry with the same key.
+ */
+static void index_insert_slot(tar_index_t *idx, uint32_t n) {
+    tar_index_entry_t *entry = &idx->entries[n];
+    size_t mask = idx->nb_slots - 1;
+    size_t i = entry->hash & mask;
+
+    while (idx->slots[i] != 0) {
+        tar_index_entry_t *other = &idx->entries[idx->slots[i] - 1];
+        if (other->hash == entry->hash && other->key_len == entry->key_len
+            && memcmp(index_key(idx, other), index_key(idx, entry), entry->key_len) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    idx->slots[i] = n + 1;
+}
+
+/**
+ * Sizes the hash table for the current number of entries (load factor at most 1/2) and fills it.
+ */
+static int index_build_slots(tar_index_t *idx) {
+    size_t nb_slots = 16;
+    while (nb_slots < idx->nb_entries * 2) nb_slots *= 2;
+
+    idx->slots = calloc(nb_slots, sizeof(uint32_t));
+    if (idx->slots == NULL) return -1;
+    idx->nb_slots = nb_slots;
+
+    for (size_t n = 0; n < idx->nb_entries; ++n) {
+        index_insert_slot(idx, (uint32_t) n);
+    }
+    return 0;
+}
+
+/**
+ * Looks a key up in the index.
+ *
+ * @return the entry with the given key, or NULL if there is none.
+ */
+static tar_index_entry_t *index_find(const tar_index_t *idx, const char *key, size_t len) {
+    uint32_t h = hash_name(key, len);
+    size_t mask = idx->nb_slots - 1;
+    size_t i = h & mask;
+
+    while (idx->slots[i] != 0) {
+        tar_index_entry_t *entry = &idx->entries[idx->slots[i] - 1];
+        if (entry->hash == h && entry->key_len == len && memcmp(index_key(idx, entry), key, len) == 0) {
+            return entry;
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/**
+ * Finds the parent directory of an entry: the entry whose key is the key of the entry up to its last
+ * slash. An entry for the root itself ("./") has no parent.
+ */
+static uint32_t index_parent(const tar_index_t *idx, const tar_index_entry_t *entry) {
+    const char *key = index_key(idx, entry);
+    size_t len = entry->key_len;
+
+    if (len == 0) return INDEX_ORPHAN;
+    while (len > 0 && key[len - 1] != '/') len--;
+    if (len == 0) return INDEX_ROOT;
+
+    tar_index_entry_t *parent = index_find(idx, key, len - 1);
+    if (parent == NULL || parent->typeflag != DIRTYPE) return INDEX_ORPHAN;
+    return (uint32_t) (parent - idx->entries);
+}
+
+/**
+ * Builds the adjacency lists of the directory tree, counting the children of each directory first
+ * and then placing them. Overwritten duplicates are left out.
+ */
+static int index_build_tree(tar_index_t *idx) {
+    // zeroed as entries left out of the tree leave the end unused, and the array is saved in sidecars
+    idx->children = calloc(idx->nb_entries + 1, sizeof(uint32_t));
+    if (idx->children == NULL) return -1;
+    idx->root_count = 0;
+
+    for (size_t n = 0; n < idx->nb_entries; ++n) {
+        tar_index_entry_t *entry = &idx->entries[n];
+        entry->child_start = 0;
+        entry->child_count = 0;
+        if (index_find(idx, index_key(idx, entry), entry->key_len) != entry) {
+            entry->parent = INDEX_ORPHAN;
+            continue;
+        }
+        entry->parent = index_parent(idx, entry);
+    }
+
+    for (size_t n = 0; n < idx->nb_entries; ++n) {
+        uint32_t parent = idx->entries[n].parent;
+        if (parent == INDEX_ROOT) idx->root_count++;
+        else if (parent != INDEX_ORPHAN) idx->entries[parent].child_count++;
+    }
+
+    uint32_t start = 0;
+    idx->root_start = start;
+    start += idx->root_count;
+    for (size_t n = 0; n < idx->nb_entries; ++n) {
+        idx->entries[n].child_start = start;
+        start += idx->entries[n].child_count;
+    }
+
+    // child_count is rebuilt while placing the children
+    uint32_t root_placed = 0;
+    for (size_t n = 0; n < idx->nb_entries; ++n) idx->entries[n].child_count = 0;
+    for (size_t n = 0; n < idx->nb_entries; ++n) {
+        uint32_t parent = idx->entries[n].parent;
+        if (parent == INDEX_ROOT) {
+            idx->children[idx->root_start + root_placed++] = (uint32_t) n;
+        } else if (parent != INDEX_ORPHAN) {
+            tar_index_entry_t *dir = &idx->entries[parent];
+            idx->children[dir->child_start + dir->child_count++] = (uint32_t) n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Finds the entry a link points to. Symlink targets are relative to the directory of the link while
+ * hard link targets are relative to the root of the archive. The joined path is already a key.
+ *
+ * @return the entry number of the target, or INDEX_DANGLING if there is no such entry.
+ */
+static uint32_t index_link_target(const tar_index_t *idx, const tar_index_entry_t *entry) {
+    char path[PATH_MAX_INDEX];
+    const char *from = entry->typeflag == LNKTYPE ? "" : index_name(idx, entry);
+
+    long len = join_link_path(from, idx->names + entry->link_offset, path);
+    if (len < 0) return INDEX_DANGLING;
+
+    tar_index_entry_t *target = index_find(idx, path, (size_t) len);
+    return target != NULL ? (uint32_t) (target - idx->entries) : INDEX_DANGLING;
+}
+
+static bool is_link(const tar_index_entry_t *entry) {
+    return entry->typeflag == SYMTYPE || entry->typeflag == LNKTYPE;
+}
+
+/**
+ * Resolves every link of the index to its final target once, so that following a link later is a
+ * single array access. A chain is walked until it reaches an entry that is not a link or a link that
+ * is already resolved, then every link of the chain gets the same target. Reaching a link of the chain
+ * being walked means there is a loop, and the whole chain is left dangling.
+ */
+static void index_build_links(tar_index_t *idx) {
+    for (size_t n = 0; n < idx->nb_entries; ++n) {
+        tar_index_entry_t *entry = &idx->entries[n];
+        entry->target = is_link(entry) ? INDEX_UNRESOLVED : (uint32_t) n;
+    }
+
+    for (size_t n = 0; n < idx->nb_entries; ++n) {
+        if (idx->entries[n].target != INDEX_UNRESOLVED) continue;
+
+        // the chain is threaded through the target fields, marked as being resolved
+        uint32_t first = (uint32_t) n;
+        uint32_t current = first;
+        uint32_t previous = INDEX_DANGLING;
+        uint32_t result;
+
+        while (true) {
+            tar_index_entry_t *entry = &idx->entries[current];
+            if (!is_link(entry)) {
+                result = current;
+                break;
+            }
+            if (entry->target == INDEX_RESOLVING || entry->target == INDEX_DANGLING) {
+                result = INDEX_DANGLING;
+                break;
+            }
+            if (entry->target != INDEX_UNRESOLVED) {
+                result = entry->target;
+                break;
+            }
+            uint32_t next = index_link_target(idx, entry);
+            entry->target = INDEX_RESOLVING;
+            entry->child_start = previous;      /* only directories use it, links borrow it here */
+            previous = current;
+            if (next == INDEX_DANGLING) {
+                result = INDEX_DANGLING;
+                break;
+            }
+            current = next;
+        }
+
+        while (previous != INDEX_DANGLING) {
+            tar_index_entry_t *entry = &idx->entries[previous];
+            previous = entry->child_start;
+            entry->child_start = 0;
+            entry->target = result;
+        }
+    }
+}
+
+/**
+ * Builds the lookup structures of an index once all its entries are known.
+ */
+static int index_build(tar_index_t *idx) {
+    if (index_build_slots(idx) < 0) return -1;
+    if (index_build_tree(idx) < 0) return -1;
+    index_build_links(idx);
+    return 0;
+}
+
+/**
+ * Finds the entry a path refers to, following links through the resolution table.
+ *
+ * @return the resolved entry, or NULL if the path or one of the links does not lead to an entry.
+ */
+static tar_index_entry_t *index_resolve(const tar_index_t *idx, tar_index_entry_t *entry) {
+    if (entry == NULL || entry->target == INDEX_DANGLING) return NULL;
+    return &idx->entries[entry->target];
+}
+
+/**
+ * Finds the entry at a path, which is normalized into a key first.
+ */
+static tar_index_entry_t *index_lookup(const tar_index_t *idx, const char *path) {
+    if (idx == NULL || path == NULL) return NULL;
+
+    char key[PATH_MAX_INDEX];
+    long len = path_normalize(path, key);
+    if (len < 0) return NULL;
+    return index_find(idx, key, (size_t) len);
+}
+
+/**
+ * Appends an entry decoded from the archive, extension headers excluded.
+ *
+ * @return zero, or -1 on allocation failure.
+ */
+static int index_add_entry(tar_index_t *idx, const tar_iter_entry_t *decoded) {
+    if (idx->nb_entries == idx->cap_entries) {
+        size_t cap = idx->cap_entries ? idx->cap_entries * 2 : 64;
+        tar_index_entry_t *entries = realloc(idx->entries, cap * sizeof(tar_index_entry_t));
+        if (entries == NULL) return -1;
+        idx->entries = entries;
+        idx->cap_entries = cap;
+    }
+
+    tar_index_entry_t *entry = &idx->entries[idx->nb_entries];
+    memset(entry, 0, sizeof(tar_index_entry_t));
+
+    long name_offset = index_add_string(idx, decoded->name, decoded->name_len);
+    if (name_offset < 0) return -1;
+    entry->name_offset = (uint32_t) name_offset;
+    entry->name_len = (uint32_t) decoded->name_len;
+
+    size_t key_len;
+    const char *key = path_key(decoded->name, decoded->name_len, &key_len);
+    entry->key_offset = entry->name_offset + (uint32_t) (key - decoded->name);
+    entry->key_len = (uint32_t) key_len;
+    entry->hash = hash_name(key, key_len);
+
+    if (decoded->typeflag == SYMTYPE || decoded->typeflag == LNKTYPE) {
+        long link_offset = index_add_string(idx, decoded->linkname, decoded->link_len);
+        if (link_offset < 0) return -1;
+        entry->link_offset = (uint32_t) link_offset;
+        entry->link_len = (uint32_t) decoded->link_len;
+    }
+
+    entry->header_offset = decoded->offset;
+    entry->size = decoded->size;
+    entry->mtime = decoded->mtime;
+    entry->mode = (uint32_t) decoded->mode;
+    entry->typeflag = decoded->typeflag;
+    idx->nb_entries++;
+    return 0;
+}
+
+/**
+ * Builds an index over the archive, in the statistics scope of the caller.
+ */
+static tar_index_t *index_open(int tar_fd) {
+    tar_index_t *idx = calloc(1, sizeof(tar_index_t));
+    if (idx == NULL) return NULL;
+    // the call is counted with the file descriptor functions, what it reads with the index
+    STATS_ATTACH(INDEX_STATS(idx));
+
+    tar_iter_t iter;
+    if (tar_iter_init(&iter, tar_fd) < 0) {
+        free(idx);
+        return NULL;
+    }
+    idx->tar_fd = tar_fd;
+    idx->base = iter.base;
+
+    const tar_iter_entry_t *entry;
+    while ((entry = tar_iter_next(&iter)) != NULL) {
+        if (!TAR_IS_EXTENSION(entry->typeflag) && index_add_entry(idx, entry) < 0) {
+            tar_iter_release(&iter);
+            goto fail;
+        }
+    }
+    if (iter.corrupt) {
+        tar_iter_release(&iter);
+        goto fail;
+    }
+    // the checkpoints recorded during the scan serve the reads
+    idx->decoder = iter.decoder;
+    idx->cache_key = iter.cache_key;
+    iter.decoder = NULL;
+    tar_iter_release(&iter);
+
+    if (index_build(idx) < 0) goto fail;
+    return idx;
+
+fail:
+    tar_index_close(idx);
+    return NULL;
+}
+
+/**
+ * Builds an index over the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *               It must stay open until tar_index_close() is called.
+ *
+ * @return a new index, or NULL if the archive could not be read or memory could not be allocated.
+ */
+tar_index_t *tar_index_open(int tar_fd) {
+    STATS_SCOPE(NULL, TAR_STATS_INDEX_OPEN);
+    return index_open(tar_fd);
+}
+
+/**
+ * Builds an index over a memory mapping of the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *               The archive must not be truncated while the index is open.
+ *
+ * @return a new index, or NULL if the file is empty, the archive could not be mapped or memory could not be allocated.
+ */
+tar_index_t *tar_open_mmap(int tar_fd) {
+    STATS_SCOPE(NULL, TAR_STATS_INDEX_OPEN);
+    struct stat st;
+    // an empty file cannot be mapped
+    if (fstat(tar_fd, &st) < 0 || st.st_size == 0) return NULL;
+
+    tar_index_t *idx = calloc(1, sizeof(tar_index_t));
+    if (idx == NULL) return NULL;
+
+    idx->tar_fd = tar_fd;
+    idx->base = archive_start(tar_fd);
+    if (idx->base < 0 || idx->base > st.st_size || decoder_open(tar_fd, idx->base, &idx->decoder) < 0) {
+        free(idx);
+        return NULL;
+    }
+    if (idx->decoder != NULL) {
+        // a compressed archive cannot be mapped as it is, it is read through its decoder instead
+        tar_index_close(idx);
+        return index_open(tar_fd);
+    }
+    STATS_ATTACH(INDEX_STATS(idx));
+
+    // the whole file is mapped since the archive start is not necessarily page-aligned
+    void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, tar_fd, 0);
+    if (map == MAP_FAILED) {
+        free(idx);
+        return NULL;
+    }
+    idx->map = map;
+    idx->map_len = (size_t) st.st_size;
+
+    const uint8_t *archive = idx->map + idx->base;
+    uint64_t archive_len = idx->map_len - (uint64_t) idx->base;
+    uint64_t offset = 0;
+    tar_extensions_t *ext = calloc(1, sizeof(tar_extensions_t));
+    if (ext == NULL) goto fail;
+
+    madvise((void *) idx->map, idx->map_len, MADV_SEQUENTIAL);
+    while (offset + sizeof(tar_header_t) <= archive_len) {
+        const tar_header_t *header = (const tar_header_t *) (archive + offset);
+        if (block_is_zero((const uint8_t *) header)) break;
+
+        tar_iter_entry_t entry;
+        entry.offset = offset;
+        ext_entry(ext, header, &entry);
+        STATS_ADD(headers, 1);
+        STATS_ADD(bytes_skipped, TAR_IS_EXTENSION(entry.typeflag) ? 0 : padded_size(entry.size));
+        if (TAR_IS_EXTENSION(entry.typeflag)) {
+            uint64_t payload = offset + sizeof(tar_header_t);
+            if (entry.size <= EXTENSION_MAX && payload + entry.size <= archive_len) {
+                ext_read(ext, entry.typeflag, archive + payload, (size_t) entry.size);
+            }
+        }
+        if (!entry_next(ext, &entry, archive_len, &offset)
+            || (!TAR_IS_EXTENSION(entry.typeflag) && index_add_entry(idx, &entry) < 0)) {
+            free(ext);
+            goto fail;
+        }
+    }
+    madvise((void *) idx->map, idx->map_len, MADV_NORMAL);
+    free(ext);
+
+    if (index_build(idx) < 0) goto fail;
+    return idx;
+
+fail:
+    tar_index_close(idx);
+    return NULL;
+}
+
+/**
+ * Gives direct access to the content of a file in an archive opened with tar_open_mmap().
+ *
+ * @param idx An index built by tar_open_mmap().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param data Set to the first byte of the file content, inside the mapping.
+ * @param len Set to the length of the file content.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the index is not memory-mapped or the file content lies beyond the end of the archive.
+ */
+int tar_file_view(tar_index_t *idx, char *path, const uint8_t **data, size_t *len) {
+    STATS_SCOPE(INDEX_STATS(idx), TAR_STATS_INDEX_READ_FILE);
+    tar_index_entry_t *entry = index_resolve(idx, index_lookup(idx, path));
+    if (entry == NULL || (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE)) return -1;
+    if (idx->map == NULL && entry->size > 0) return -2;
+
+    uint64_t start = (uint64_t) idx->base + entry->header_offset + sizeof(tar_header_t);
+    if (entry->size > 0 && start + entry->size > idx->map_len) return -2;
+
+    *data = entry->size > 0 ? idx->map + start : (const uint8_t *) "";
+    *len = (size_t) entry->size;
+    return 0;
+}
+
+/**
+ * Releases an index built by tar_index_open(). The file descriptor is not closed.
+ *
+ * @param idx An index, NULL is allowed.
+ */
+void tar_index_close(tar_index_t *idx) {
+    if (idx == NULL) return;
+    decoder_close(idx->decoder);
+    if (idx->map != NULL) munmap((void *) idx->map, idx->map_len);
+    if (idx->sidecar != NULL) {
+        munmap(idx->sidecar, idx->sidecar_len);
+        free(idx);
+        return;
+    }
+    free(idx->entries);
+    free(idx->names);
+    free(idx->slots);
+    free(idx->children);
+    free(idx);
+}
+
+/**
+ * Takes a snapshot of the statistics of the library.
+ *
+ * @param idx An index, or NULL for everything not done through an index.
+ * @param stats Receives the counters, all zero if the statistics are not built in.
+ *
+ * @return zero on success, -1 if the library is built without LIB_TAR_STATS.
+ */
+int tar_stats_snapshot(tar_index_t *idx, tar_stats_t *stats) {
+    memset(stats, 0, sizeof(tar_stats_t));
+#ifdef LIB_TAR_STATS
+    // each counter is read atomically, the snapshot as a whole is not
+    const uint64_t *from = (const uint64_t *) (idx != NULL ? &idx->stats : &stats_fd);
+    uint64_t *to = (uint64_t *) stats;
+    for (size_t i = 0; i < sizeof(tar_stats_t) / sizeof(uint64_t); ++i) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+    return 0;
+#else
+    (void) idx;
+    return -1;
+#endif
+}
+
+/**
+ * Sets the statistics of an index, or of everything not done through an index, back to zero.
+ *
+ * @param idx An index, or NULL.
+ */
+void tar_stats_reset(tar_index_t *idx) {
+#ifdef LIB_TAR_STATS
+    uint64_t *counters = (uint64_t *) (idx != NULL ? &idx->stats : &stats_fd);
+    for (size_t i = 0; i < sizeof(tar_stats_t) / sizeof(uint64_t); ++i) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+#else
+    (void) idx;
+#endif
+}
+
+/**
+ * Gives the name of a public function counted by the statistics.
+ *
+ * @param function A value of enum tar_stats_function.
+ *
+ * @return the name, or NULL if the value is out of range.
+ */
+const char *tar_stats_function_name(int function) {
+    static const char *const names[TAR_STATS_FUNCTIONS] = {
+        [TAR_STATS_CHECK_ARCHIVE] = "check_archive",
+        [TAR_STATS_CHECK_ARCHIVE_PARALLEL] = "check_archive_parallel",
+        [TAR_STATS_EXISTS] = "exists",
+        [TAR_STATS_IS_DIR] = "is_dir",
+        [TAR_STATS_IS_FILE] = "is_file",
+        [TAR_STATS_IS_SYMLINK] = "is_symlink",
+        [TAR_STATS_LIST] = "list",
+        [TAR_STATS_READ_FILE] = "read_file",
+        [TAR_STATS_READ_FILES] = "read_files",
+        [TAR_STATS_LOOKUP] = "tar_lookup",
+        [TAR_STATS_LOOKUP_MANY] = "tar_lookup_many",
+        [TAR_STATS_EXTRACT] = "tar_extract",
+        [TAR_STATS_STREAM] = "tar_stream",
+        [TAR_STATS_INDEX_OPEN] = "tar_index_open",
+        [TAR_STATS_INDEX_LOOKUP] = "tar_index_lookup",
+        [TAR_STATS_INDEX_LIST] = "tar_index_list",
+        [TAR_STATS_INDEX_READ_FILE] = "tar_index_read_file",
+        [TAR_STATS_ASYNC] = "tar_async",
+        [TAR_STATS_ENTRY_OPEN] = "tar_entry_open",
+        [TAR_STATS_ENTRY_PREAD] = "tar_entry_pread",
+    };
+    return function >= 0 && function < TAR_STATS_FUNCTIONS ? names[function] : NULL;
+}
+
+/*
+ * Sidecar index files.
+ *
+ * The lookup structures of an index are flat arrays, so they are saved as they are in memory after a
+ * fixed header, each one aligned on 8 bytes. Loading maps the file and points the index into the
+ * mapping, without parsing the archive. The header records the size, modification time, device and
+ * inode of the archive to detect a sidecar that no longer matches it, and the layout of the entries to
+ * reject a file written by an incompatible build. Every offset and entry number read from the file is
+ * checked against the tables before the index is used, so that a truncated or corrupted sidecar is
+ * rejected rather than read out of bounds.
+ */
+
+#define SIDECAR_MAGIC "TARIDX2"
+#define SIDECAR_ENDIAN 0x01020304u
+
+typedef struct sidecar_header {
+    char magic[8];
+    uint32_t endian;
+    uint32_t entry_size;
+    uint64_t archive_size;
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    uint64_t archive_dev;
+    uint64_t archive_ino;
+    uint64_t archive_base;
+    uint64_t nb_entries;
+    uint64_t names_len;
+    uint64_t nb_slots;
+    uint64_t nb_children;
+    uint32_t root_start;
+    uint32_t root_count;
+    uint64_t entries_offset;
+    uint64_t names_offset;
+    uint64_t slots_offset;
+    uint64_t children_offset;
+} sidecar_header_t;
+
+static uint64_t align8(uint64_t n) {
+    return (n + 7) & ~(uint64_t) 7;
+}
+
+static void sidecar_fingerprint(sidecar_header_t *header, const struct stat *st, off_t base) {
+    header->archive_size = (uint64_t) st->st_size;
+    header->archive_mtime_sec = (int64_t) st->st_mtim.tv_sec;
+    header->archive_mtime_nsec = (int64_t) st->st_mtim.tv_nsec;
+    header->archive_dev = (uint64_t) st->st_dev;
+    header->archive_ino = (uint64_t) st->st_ino;
+    header->archive_base = (uint64_t) base;
+}
+
+/**
+ * Checks that a table of `count` elements of `size` bytes at `offset` is aligned and lies within a
+ * sidecar of `len` bytes.
+ */
+static bool sidecar_table_fits(uint64_t offset, uint64_t count, size_t size, size_t len) {
+    return offset % 8 == 0 && offset <= len && count <= (len - offset) / size;
+}
+
+/**
+ * Checks that a string of the names pool lies within the pool and is null-terminated.
+ */
+static bool sidecar_string_fits(const char *names, uint64_t names_len, uint32_t offset, uint32_t len) {
+    return (uint64_t) offset + len < names_len && names[(uint64_t) offset + len] == '\0';
+}
+
+/**
+ * Checks every entry number and offset of the tables of a mapped sidecar whose header has been
+ * checked, so that lookups never leave the mapping.
+ */
+static bool sidecar_tables_valid(const sidecar_header_t *header, const uint8_t *bytes) {
+    const tar_index_entry_t *entries = (const tar_index_entry_t *) (bytes + header->entries_offset);
+    const char *names = (const char *) (bytes + header->names_offset);
+    const uint32_t *slots = (const uint32_t *) (bytes + header->slots_offset);
+    const uint32_t *children = (const uint32_t *) (bytes + header->children_offset);
+    uint64_t nb_entries = header->nb_entries;
+
+    if (nb_entries >= INDEX_UNRESOLVED || header->root_start > header->nb_children
+        || header->root_count > header->nb_children - header->root_start) {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < nb_entries; ++i) {
+        const tar_index_entry_t *entry = &entries[i];
+        if (!sidecar_string_fits(names, header->names_len, entry->name_offset, entry->name_len)
+            || entry->key_offset < entry->name_offset
+            || (uint64_t) entry->key_offset + entry->key_len > (uint64_t) entry->name_offset + entry->name_len) {
+            return false;
+        }
+        if ((entry->typeflag == SYMTYPE || entry->typeflag == LNKTYPE)
+            && !sidecar_string_fits(names, header->names_len, entry->link_offset, entry->link_len)) {
+            return false;
+        }
+        if ((entry->parent >= nb_entries && entry->parent != INDEX_ROOT && entry->parent != INDEX_ORPHAN)
+            || (entry->target >= nb_entries && entry->target != INDEX_DANGLING)
+            || entry->child_start > header->nb_children
+            || entry->child_count > header->nb_children - entry->child_start) {
+            return false;
+        }
+    }
+
+    // a probe stops at an empty slot, there must be one
+    bool has_empty = false;
+    for (uint64_t i = 0; i < header->nb_slots; ++i) {
+        if (slots[i] > nb_entries) return false;
+        if (slots[i] == 0) has_empty = true;
+    }
+    if (!has_empty) return false;
+
+    for (uint64_t i = 0; i < header->nb_children; ++i) {
+        if (children[i] >= nb_entries) return false;
+    }
+    return true;
+}
+
+/**
+ * Writes an index to a sidecar file, to be loaded back with tar_index_load().
+ *
+ * @param idx An index.
+ * @param index_fd A file descriptor open for writing, positioned where the sidecar starts (usually an empty file).
+ *
+ * @return zero on success, -1 on failure.
+ */
+int tar_index_save(tar_index_t *idx, int index_fd) {
+    struct stat st;
+    if (idx == NULL || fstat(idx->tar_fd, &st) < 0) return -1;
+
+    sidecar_header_t header;
+    memset(&header, 0, sizeof(sidecar_header_t));
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC));
+    header.endian = SIDECAR_ENDIAN;
+    header.entry_size = sizeof(tar_index_entry_t);
+    sidecar_fingerprint(&header, &st, idx->base);
+
+    header.nb_entries = idx->nb_entries;
+    header.names_len = idx->names_len;
+    header.nb_slots = idx->nb_slots;
+    header.nb_children = idx->nb_entries;
+    header.root_start = idx->root_start;
+    header.root_count = idx->root_count;
+
+    const void *parts[4] = { idx->entries, idx->names, idx->slots, idx->children };
+    size_t lens[4] = {
+        idx->nb_entries * sizeof(tar_index_entry_t),
+        idx->names_len,
+        idx->nb_slots * sizeof(uint32_t),
+        idx->nb_entries * sizeof(uint32_t),
+    };
+    uint64_t *offsets[4] = { &header.entries_offset, &header.names_offset, &header.slots_offset, &header.children_offset };
+
+    uint64_t position = align8(sizeof(sidecar_header_t));
+    for (int i = 0; i < 4; ++i) {
+        *offsets[i] = position;
+        position = align8(position + lens[i]);
+    }
+
+    static const uint8_t padding[8];
+    if (write_full(index_fd, &header, sizeof(sidecar_header_t)) < 0) return -1;
+    position = sizeof(sidecar_header_t);
+    for (int i = 0; i < 4; ++i) {
+        if (write_full(index_fd, padding, *offsets[i] - position) < 0) return -1;
+        if (lens[i] > 0 && write_full(index_fd, parts[i], lens[i]) < 0) return -1;
+        position = *offsets[i] + lens[i];
+    }
+    return write_full(index_fd, padding, align8(position) - position);
+}
+
+/**
+ * Loads an index saved by tar_index_save() by mapping it. Every entry of the tables is checked once
+ * (linear in the number of entries), so that lookups need no bounds checks.
+ *
+ * @param tar_fd A file descriptor pointing to the start of the archive the index was built for.
+ * @param index_fd A file descriptor of the sidecar file, open for reading. It can be closed once loaded.
+ *
+ * @return the index, or NULL if the sidecar is invalid, does not match the archive (which was modified
+ *         since it was saved) or could not be mapped.
+ */
+tar_index_t *tar_index_load(int tar_fd, int index_fd) {
+    STATS_SCOPE(NULL, TAR_STATS_INDEX_OPEN);
+    struct stat archive_st, sidecar_st;
+    if (fstat(tar_fd, &archive_st) < 0 || fstat(index_fd, &sidecar_st) < 0) return NULL;
+    if ((size_t) sidecar_st.st_size < sizeof(sidecar_header_t)) return NULL;
+
+    off_t base = archive_start(tar_fd);
+    if (base < 0) return NULL;
+
+    size_t len = (size_t) sidecar_st.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, index_fd, 0);
+    if (map == MAP_FAILED) return NULL;
+
+    const sidecar_header_t *header = map;
+    sidecar_header_t expected;
+    sidecar_fingerprint(&expected, &archive_st, base);
+
+    bool valid = memcmp(header->magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC)) == 0
+                 && header->endian == SIDECAR_ENDIAN
+                 && header->entry_size == sizeof(tar_index_entry_t)
+                 && header->archive_size == expected.archive_size
+                 && header->archive_mtime_sec == expected.archive_mtime_sec
+                 && header->archive_mtime_nsec == expected.archive_mtime_nsec
+                 && header->archive_dev == expected.archive_dev
+                 && header->archive_ino == expected.archive_ino
+                 && header->archive_base == expected.archive_base
+                 && header->nb_slots > 0 && (header->nb_slots & (header->nb_slots - 1)) == 0
+                 && header->nb_children == header->nb_entries
+                 && sidecar_table_fits(header->entries_offset, header->nb_entries, sizeof(tar_index_entry_t), len)
+                 && sidecar_table_fits(header->names_offset, header->names_len, 1, len)
+                 && sidecar_table_fits(header->slots_offset, header->nb_slots, sizeof(uint32_t), len)
+                 && sidecar_table_fits(header->children_offset, header->nb_children, sizeof(uint32_t), len)
+                 && sidecar_tables_valid(header, map);
+
+    tar_index_t *idx = valid ? calloc(1, sizeof(tar_index_t)) : NULL;
+    if (idx == NULL || decoder_open(tar_fd, base, &idx->decoder) < 0) {
+        free(idx);
+        munmap(map, len);
+        return NULL;
+    }
+
+    uint8_t *bytes = map;
+    idx->tar_fd = tar_fd;
+    idx->base = base;
+    cache_archive_key(&archive_st, base, &idx->cache_key);
+    idx->entries = (tar_index_entry_t *) (bytes + header->entries_offset);
+    idx->nb_entries = header->nb_entries;
+    idx->names = (char *) (bytes + header->names_offset);
+    idx->names_len = header->names_len;
+    idx->slots = (uint32_t *) (bytes + header->slots_offset);
+    idx->nb_slots = header->nb_slots;
+    idx->children = (uint32_t *) (bytes + header->children_offset);
+    idx->root_start = header->root_start;
+    idx->root_count = header->root_count;
+    idx->sidecar = map;
+    idx->sidecar_len = len;
+    return idx;
+}
+
+int tar_index_exists(tar_index_t *idx, char *path) {
+    STATS_SCOPE(INDEX_STATS(idx), TAR_STATS_INDEX_LOOKUP);
+    return index_lookup(idx, path) != NULL;
+}
+
+int tar_index_is_dir(tar_index_t *idx, char *path) {
+    STATS_SCOPE(INDEX_STATS(idx), TAR_STATS_INDEX_LOOKUP);
+    tar_index_entry_t *entry = index_lookup(idx, path);
+    return entry != NULL && entry->typeflag == DIRTYPE;
+}
+
+int tar_index_is_file(tar_index_t *idx, char *path) {
+    STATS_SCOPE(INDEX_STATS(idx), TAR_STATS_INDEX_LOOKUP);
+    tar_index_entry_t *entry = index_lookup(idx, path);
+    return entry != NULL && (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE);
+}
+
+int tar_index_is_symlink(tar_index_t *idx, char *path) {
+    STATS_SCOPE(INDEX_STATS(idx), TAR_STATS_INDEX_LOOKUP);
+    tar_index_entry_t *entry = index_lookup(idx, path);
+    return entry != NULL && entry->typeflag == SYMTYPE;
+}
+
+/**
+ * tar_index_lookup() without counting a call, for the public functions built on it.
+ */
+static int index_stat(tar_index_t *idx, const char *path, int flags, tar_stat_t *st) {
+    tar_index_entry_t *entry = index_lookup(idx, path);
+    if (flags & TAR_LOOKUP_FOLLOW) entry = index_resolve(idx, entry);
+    if (entry == NULL) return 0;
+
+    st->typeflag = entry->typeflag;
+    st->mode = (mode_t) entry->mode;
+    st->size = entry->size;
+    st->mtime = entry->mtime;
+    st->offset = entry->header_offset;
+    return 1;
+}
+
+int tar_index_lookup(tar_index_t *idx, const char *path, int flags, tar_stat_t *st) {
+    STATS_SCOPE(INDEX_STATS(idx), TAR_STATS_INDEX_LOOKUP);
+    return index_stat(idx, path, flags, st);
+}
+
+int tar_index_list(tar_index_t *idx, char *path, char **entries, size_t *no_entries) {
+    size_t cursor = 0;
+    return tar_index_list_page(idx, path, entries, no_entries, &cursor);
+}
+
+/**
+ * Lists the entries at a given path in the archive, a page at a time.
+ *
+ * @param idx An index.
+ * @param path A path to a directory in the archive, or an empty string (or ".") for the root of the archive.
+ *             If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ * @param cursor An in-out argument.
+ *               The caller set it to zero for the first page, then passes back the value set by the callee.
+ *               The callee set it to zero once the last entry has been listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_index_list_page(tar_index_t *idx, char *path, char **entries, size_t *no_entries, size_t *cursor) {
+    STATS_SCOPE(INDEX_STATS(idx), TAR_STATS_INDEX_LIST);
+    uint32_t start, count;
+    char key[PATH_MAX_INDEX];
+
+    if (idx != NULL && path != NULL && path_normalize(path, key) == 0) {
+        start = idx->root_start;
+        count = idx->root_count;
+    } else {
+        tar_index_entry_t *dir = index_resolve(idx, index_lookup(idx, path));
+        if (dir == NULL || dir->typeflag != DIRTYPE) {
+            *no_entries = 0;
+            *cursor = 0;
+            return 0;
+        }
+        start = dir->child_start;
+        count = dir->child_count;
+    }
+
+    size_t listed = 0;
+    size_t position = *cursor;
+    while (position < count && listed < *no_entries) {
+        tar_index_entry_t *entry = &idx->entries[idx->children[start + position]];
+        memcpy(entries[listed], index_name(idx, entry), entry->name_len + 1);
+        listed++;
+        position++;
+    }
+
+    *no_entries = listed;
+    *cursor = position < count ? position : 0;
+    return 1;
+}
+
+/**
+ * Reads archive bytes at a file position, through the block cache and the decoder of a compressed archive.
+ */
+static size_t index_pread(const tar_index_t *idx, void *dest, size_t len, off_t position) {
+    return archive_read(idx->tar_fd, idx->base, idx->decoder, &idx->cache_key, dest, len, (uint64_t) (position - idx->base));
+}
+
+ssize_t tar_index_read_file(tar_index_t *idx, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    STATS_SCOPE(INDEX_STATS(idx), TAR_STATS_INDEX_READ_FILE);
+    if (dest == NULL || len == NULL) return -1;
+
+    tar_index_entry_t *entry = index_resolve(idx, index_lookup(idx, path));
+    if (entry == NULL || (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE)) return -1;
+    if (offset > entry->size) return -2;
+
+    size_t to_read = entry->size - offset;
+    if (to_read > *len) to_read = *len;
+
+    off_t position = idx->base + (off_t) (entry->header_offset + sizeof(tar_header_t) + offset);
+    if (idx->map != NULL) {
+        if ((uint64_t) position >= idx->map_len) to_read = 0;
+        else if (to_read > idx->map_len - (uint64_t) position) to_read = idx->map_len - (size_t) position;
+        memcpy(dest, idx->map + position, to_read);
+        *len = to_read;
+        return (ssize_t) (entry->size - offset - to_read);
+    }
+    size_t done = index_pread(idx, dest, to_read, position);
+    *len = done;
+    return (ssize_t) (entry->size - offset - done);
+}
+
+
+/*
+ * Entry handles.
+ *
+ * A handle keeps where the content of a file lies in the archive, found once when it is opened with
+ * its links followed, so that reads at any offset go straight to the archive. Handles opened from an
+ * index share its decoder and mapping, those opened from a file descriptor have their own decoder,
+ * which records checkpoints as the content is read.
+ */
+
+struct tar_entry {
+    int tar_fd;
+    off_t base;                 /* offset of the archive in tar_fd */
+    uint64_t start;             /* archive offset of the content */
+    tar_stat_t stat;
+    decoder_t *decoder;         /* NULL if the archive is not compressed */
+    tar_cache_key_t cache_key;  /* identifies the archive, as it was when opened, in the block cache */
+    tar_index_t *idx;           /* the index the handle was opened from, NULL otherwise */
+};
+
+/**
+ * Opens a file of the archive for reads at any offset, looking it up with a single scan.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *               It must stay open until tar_entry_close() is called.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ *
+ * @return a new handle, or NULL if no file exists at the given path or memory could not be allocated.
+ */
+tar_entry_t *tar_entry_open(int tar_fd, const char *path) {
+    STATS_SCOPE(NULL, TAR_STATS_ENTRY_OPEN);
+    tar_stat_t st;
+    if (!scan_lookup(tar_fd, path, TAR_LOOKUP_FOLLOW, &st) || (st.typeflag != REGTYPE && st.typeflag != AREGTYPE)) {
+        return NULL;
+    }
+
+    struct stat file_st;
+    tar_entry_t *entry = calloc(1, sizeof(tar_entry_t));
+    if (entry == NULL) return NULL;
+    entry->tar_fd = tar_fd;
+    entry->base = archive_start(tar_fd);
+    if (entry->base < 0 || fstat(tar_fd, &file_st) < 0 || decoder_open(tar_fd, entry->base, &entry->decoder) < 0) {
+        free(entry);
+        return NULL;
+    }
+    cache_archive_key(&file_st, entry->base, &entry->cache_key);
+    entry->start = st.offset + sizeof(tar_header_t);
+    entry->stat = st;
+    return entry;
+}
+
+/**
+ * Opens a file of the archive for reads at any offset, looking it up in an index.
+ *
+ * @param idx An index, which must outlive the handle.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ *
+ * @return a new handle, or NULL if no file exists at the given path or memory could not be allocated.
+ */
+tar_entry_t *tar_index_entry_open(tar_index_t *idx, const char *path) {
+    STATS_SCOPE(INDEX_STATS(idx), TAR_STATS_ENTRY_OPEN);
+    tar_stat_t st;
+    if (!index_stat(idx, path, TAR_LOOKUP_FOLLOW, &st) || (st.typeflag != REGTYPE && st.typeflag != AREGTYPE)) {
+        return NULL;
+    }
+
+    tar_entry_t *entry = calloc(1, sizeof(tar_entry_t));
+    if (entry == NULL) return NULL;
+    entry->tar_fd = idx->tar_fd;
+    entry->base = idx->base;
+    entry->decoder = idx->decoder;
+    entry->cache_key = idx->cache_key;
+    entry->idx = idx;
+    entry->start = st.offset + sizeof(tar_header_t);
+    entry->stat = st;
+    return entry;
+}
+
+/**
+ * Gives the metadata of an open file.
+ *
+ * @param entry A handle.
+ * @param st Receives the metadata of the file, links followed.
+ */
+void tar_entry_stat(const tar_entry_t *entry, tar_stat_t *st) {
+    *st = entry->stat;
+}
+
+/**
+ * Reads the content of an open file at an offset, like pread().
+ *
+ * @param entry A handle.
+ * @param offset An offset in the file.
+ * @param dest A destination buffer.
+ * @param len The number of bytes to read.
+ *
+ * @return the number of bytes read, zero at or after the end of the file, fewer than `len` only at the end
+ *         of the file or if the archive is shorter than its headers announce.
+ */
+ssize_t tar_entry_pread(tar_entry_t *entry, uint64_t offset, uint8_t *dest, size_t len) {
+    STATS_SCOPE(entry->idx != NULL ? INDEX_STATS(entry->idx) : NULL, TAR_STATS_ENTRY_PREAD);
+    if (offset >= entry->stat.size) return 0;
+    if (len > entry->stat.size - offset) len = (size_t) (entry->stat.size - offset);
+    if (len > SSIZE_MAX) len = SSIZE_MAX;
+
+    const tar_index_t *idx = entry->idx;
+    if (idx != NULL && idx->map != NULL) {
+        uint64_t position = (uint64_t) idx->base + entry->start + offset;
+        if (position >= idx->map_len) return 0;
+        if (len > idx->map_len - position) len = (size_t) (idx->map_len - position);
+        memcpy(dest, idx->map + position, len);
+        return (ssize_t) len;
+    }
+    return (ssize_t) archive_read(entry->tar_fd, entry->base, entry->decoder, &entry->cache_key, dest, len,
+                                  entry->start + offset);
+}
+
+/**
+ * Releases a handle. The file descriptor is not closed.
+ *
+ * @param entry A handle, NULL is allowed.
+ */
+void tar_entry_close(tar_entry_t *entry) {
+    if (entry == NULL) return;
+    if (entry->idx == NULL) decoder_close(entry->decoder);
+    free(entry);
+}
+
+/*
+ * Asynchronous reads.
+ *
+ * Requests are located through an index when they are submitted, which leaves a single positional
+ * read per request. Those reads are queued on an io_uring and handed to the kernel in one system call
+ * when the caller polls, so hundreds of them can be in flight from a single thread. Where io_uring or
+ * its read operation (Linux 5.6) is not available (old kernel, seccomp filter), a small pool of threads
+ * performs the reads instead. A single read covers at most ASYNC_MAX_READ bytes, larger requests are
+ * continued like short reads.
+ * Requests that fail to resolve, or that are served from a memory-mapped index, complete at once.
+ *
+ * Every request lives in a slot of a fixed array for its whole life. Finished slots are put on the
+ * ready queue, a ring of `depth` slot numbers, from which tar_async_poll() returns them.
+ */
+
+#define ASYNC_MAX_THREADS 8
+#define ASYNC_NONE UINT32_MAX
+#define ASYNC_MAX_READ UINT32_MAX       /* the length of a submission is 32 bits */
+
+typedef struct async_request {
+    void *user_data;
+    uint8_t *dest;
+    size_t len;                 /* bytes to read */
+    size_t done;                /* bytes read so far */
+    off_t position;             /* file offset of the first byte to read */
+    uint64_t remaining;         /* bytes of the file after the requested range */
+    ssize_t error;              /* -1 or -2 when resolving failed, 0 otherwise */
+    int read_errno;             /* errno of a failed read, 0 otherwise */
+    uint32_t next;              /* free list link */
+} async_request_t;
+
+typedef struct async_ring {
+    int fd;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+} async_ring_t;
+
+struct tar_async {
+    tar_index_t *idx;
+    unsigned depth;
+
+    async_request_t *requests;
+    uint32_t free_head;
+    unsigned in_flight;         /* submitted, not returned by tar_async_poll() yet */
+
+    uint32_t *ready;            /* ring of finished slots */
+    unsigned ready_head;
+    unsigned ready_count;
+
+    bool use_ring;
+    async_ring_t ring;
+
+    pthread_t threads[ASYNC_MAX_THREADS];
+    unsigned nb_threads;
+    uint32_t *work;             /* ring of slots waiting for a thread */
+    unsigned work_head;
+    unsigned work_count;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t ready_cond;
+};
+
 /**
- * A function which returns true if we are at the end of the tar archive and false otherwise
+ * Appends a finished slot to the ready queue. Called with the lock held in thread pool mode.
  */
-bool first_empty_block(int tar_fd){
-    tar_header_t data;
+static void async_ready(tar_async_t *ctx, uint32_t slot) {
+    ctx->ready[(ctx->ready_head + ctx->ready_count) % ctx->depth] = slot;
+    ctx->ready_count++;
+}
 
-    if(read(tar_fd, &data, sizeof(tar_header_t)) < sizeof(tar_header_t)) return true;
+/**
+ * Checks that the kernel supports the read operation, which came after io_uring itself.
+ */
+static bool ring_supports_read(int ring_fd) {
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (probe == NULL) return false;
 
-    if(data.typeflag == 0) return true;
-    lseek(tar_fd, 0, SEEK_SET);
-    return false;
+    bool supported = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0
+                     && IORING_OP_READ <= probe->last_op
+                     && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
 }
 
-bool is_it_the_end(int tar_fd){
+static int ring_setup(async_ring_t *ring, unsigned depth) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(async_ring_t));
 
-    off_t to_go = lseek(tar_fd, 0, SEEK_CUR);
+    ring->fd = (int) syscall(__NR_io_uring_setup, depth, &params);
+    if (ring->fd < 0) return -1;
+    if (!ring_supports_read(ring->fd)) {
+        close(ring->fd);
+        return -1;
+    }
 
-    char first_block[block_size];
-    char second_block[block_size];
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+    }
 
-    ssize_t reading = read(tar_fd, first_block, block_size);
-    if(reading < 0) return false;
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) goto fail;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail;
 
-    reading = read(tar_fd, second_block, block_size);
-    if(reading < 0) return false;
+    uint8_t *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    uint8_t *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 0;
 
-    for (int i = 0; i < block_size; ++i) {
-        if(first_block[i] != 0 || second_block[i] != 0){
-            lseek(tar_fd, to_go, SEEK_SET);
-            return false;
-        }
-    }
-    lseek(tar_fd, to_go, SEEK_SET);
-    return true;
+fail:
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+    return -1;
+}
+
+static void ring_release(async_ring_t *ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
 }
 
 /**
- * Checks whether the archive is valid.
- *
- * Each non-null header of a valid archive has:
- *  - a magic value of "ustar" and a null,
- *  - a version value of "00" and no null,
- *  - a correct checksum
- *
- * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
- *
- * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
- *         -1 if the archive contains a header with an invalid magic value,
- *         -2 if the archive contains a header with an invalid version value,
- *         -3 if the archive contains a header with an invalid checksum value
+ * Queues the read of what is left of a request on the submission ring. The ring has as many
+ * entries as there are slots, so there is always room.
  */
-int check_archive(int tar_fd) {
-
-    int nb_of_headers = 0;
-    long to_go_cumulate = 0;
-
-    while(true) {
+static void ring_queue(tar_async_t *ctx, uint32_t slot) {
+    async_ring_t *ring = &ctx->ring;
+    async_request_t *request = &ctx->requests[slot];
 
-        tar_header_t * data = malloc(sizeof(tar_header_t));
-        if(data == NULL) return 0;
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
 
-        if(read(tar_fd, data, sizeof(tar_header_t)) == -1){
-            printf("an error occurred while reading");
-            return -1;
-        }
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ctx->idx->tar_fd;
+    sqe->off = (uint64_t) (request->position + (off_t) request->done);
+    sqe->addr = (uint64_t) (uintptr_t) (request->dest + request->done);
+    size_t left = request->len - request->done;
+    sqe->len = (uint32_t) (left < ASYNC_MAX_READ ? left : ASYNC_MAX_READ);
+    sqe->user_data = slot;
 
-        // Check end-of-file
-        if (*(uint8_t *) data == 0) break;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
 
-        if(strncmp(data->magic, TMAGIC, TMAGLEN-1) != 0) return -1;
-        if(strncmp(data->version, TVERSION, TVERSLEN-1) != 0) return -2;
+/**
+ * Submits the queued reads and moves the completed ones to the ready queue.
+ */
+static int ring_reap(tar_async_t *ctx, bool wait) {
+    async_ring_t *ring = &ctx->ring;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
 
-        long int chksum = TAR_INT(data->chksum);
-        memset(data->chksum, 32, 8);
+    if (ring->to_submit > 0 || wait) {
+        long entered = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait ? 1 : 0, flags, NULL, 0);
+        STATS_ADD(syscalls, 1);
+        if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) return -1;
+        if (entered > 0) ring->to_submit -= (unsigned) entered;
+    }
 
-        uint8_t  *ptr = (uint8_t *) data;
-        uint tot = 0;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        uint32_t slot = (uint32_t) cqe->user_data;
+        async_request_t *request = &ctx->requests[slot];
+        int res = cqe->res;
+        head++;
 
-        for (int i = 0; i < sizeof(tar_header_t); ++i) {
-            tot += *ptr;
-            ptr++;
+        if (res == -EINTR || res == -EAGAIN) {
+            ring_queue(ctx, slot);
+            continue;
+        }
+        if (res < 0) request->read_errno = -res;
+        if (res > 0) request->done += (size_t) res;
+        if (res > 0) STATS_ADD(bytes_read, res);
+        // a short read before the end of the range is continued
+        if (res > 0 && request->done < request->len) {
+            ring_queue(ctx, slot);
+            continue;
         }
+        async_ready(ctx, slot);
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
 
-        if(chksum != tot) return -3;
+static void *async_worker(void *arg) {
+    tar_async_t *ctx = arg;
+    STATS_ATTACH(INDEX_STATS(ctx->idx));
 
-        // Compute nb of bytes until next header or end of file
-        long to_go = ((TAR_INT(data->size) / 512) * 512);
-        if ((TAR_INT(data->size)%512) != 0) {
-            to_go+=512;
-        }
+    pthread_mutex_lock(&ctx->lock);
+    while (true) {
+        while (ctx->work_count == 0 && !ctx->stopping) pthread_cond_wait(&ctx->work_cond, &ctx->lock);
+        if (ctx->work_count == 0) break;
 
-        nb_of_headers++;
+        uint32_t slot = ctx->work[ctx->work_head];
+        ctx->work_head = (ctx->work_head + 1) % ctx->depth;
+        ctx->work_count--;
+        pthread_mutex_unlock(&ctx->lock);
 
-        // Add jump size to to_go_cumulate and move file offset
-        to_go_cumulate += to_go;
-        lseek(tar_fd, to_go, SEEK_CUR);
-        free(data);
+        async_request_t *request = &ctx->requests[slot];
+        errno = 0;
+        request->done = index_pread(ctx->idx, request->dest, request->len, request->position);
+        // a short read is either the end of the file, errno untouched, or a failure
+        if (request->done < request->len) request->read_errno = errno;
+
+        pthread_mutex_lock(&ctx->lock);
+        async_ready(ctx, slot);
+        pthread_cond_signal(&ctx->ready_cond);
     }
-    return nb_of_headers;
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
 }
 
-
 /**
- * Checks whether an entry exists in the archive.
+ * Creates a context for asynchronous reads of files through an index.
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
+ * @param idx An index, which must outlive the context.
+ * @param depth The maximum number of requests submitted and not yet returned by tar_async_poll().
+ * @param flags Zero or TAR_ASYNC_THREADS.
  *
- * @return zero if no entry at the given path exists in the archive,
- *         any other value otherwise.
+ * @return a new context, or NULL on failure.
  */
-int exists(int tar_fd, char *path) {
+tar_async_t *tar_async_create(tar_index_t *idx, unsigned depth, int flags) {
+    if (idx == NULL || depth == 0) return NULL;
 
-    long to_go_cumulate = 0;
+    tar_async_t *ctx = calloc(1, sizeof(tar_async_t));
+    if (ctx == NULL) return NULL;
+    ctx->idx = idx;
+    ctx->depth = depth;
+    ctx->requests = calloc(depth, sizeof(async_request_t));
+    ctx->ready = calloc(depth, sizeof(uint32_t));
+    ctx->work = calloc(depth, sizeof(uint32_t));
+    if (ctx->requests == NULL || ctx->ready == NULL || ctx->work == NULL) goto fail;
 
-    while(true) {
+    for (uint32_t slot = 0; slot < depth; ++slot) {
+        ctx->requests[slot].next = slot + 1 < depth ? slot + 1 : ASYNC_NONE;
+    }
+    ctx->free_head = 0;
 
-        tar_header_t * data = malloc(sizeof(tar_header_t));
-        if(data == NULL) return 0;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->work_cond, NULL);
+    pthread_cond_init(&ctx->ready_cond, NULL);
 
-        if(read(tar_fd, data, sizeof(tar_header_t)) == -1){
-            printf("an error occurred while reading");
-            return 0;
+    // io_uring reads the file as it is, a compressed archive is left to the threads
+    if (idx->map == NULL && idx->decoder == NULL && !(flags & TAR_ASYNC_THREADS) && ring_setup(&ctx->ring, depth) == 0) {
+        ctx->use_ring = true;
+    } else if (idx->map == NULL) {
+        unsigned nb_threads = depth < ASYNC_MAX_THREADS ? depth : ASYNC_MAX_THREADS;
+        for (; ctx->nb_threads < nb_threads; ctx->nb_threads++) {
+            if (pthread_create(&ctx->threads[ctx->nb_threads], NULL, async_worker, ctx) != 0) break;
         }
-
-        if(strcmp(data->name, path) == 0) return 1;
-
-        long to_go = ((TAR_INT(data->size) / 512) * 512);
-        if(to_go % 512 > 0){
-            to_go += 512;
+        if (ctx->nb_threads == 0) {
+            tar_async_destroy(ctx);
+            return NULL;
         }
-
-        to_go_cumulate += to_go;
-        lseek(tar_fd, to_go_cumulate, SEEK_CUR);
-        free(data);
-        if(is_it_the_end(tar_fd)) break;
     }
-    return 0;
+    return ctx;
+
+fail:
+    free(ctx->requests);
+    free(ctx->ready);
+    free(ctx->work);
+    free(ctx);
+    return NULL;
 }
 
 /**
- * Checks whether an entry exists in the archive and is a directory.
+ * Submits the read of a file in the archive.
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
+ * @param ctx A context created by tar_async_create().
+ * @param path A path to an entry in the archive to read from. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from.
+ * @param dest A destination buffer, which must stay valid until the request is returned by tar_async_poll().
+ * @param len The size of dest.
+ * @param user_data A value given back with the completion.
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
- *         any other value otherwise.
+ * @return zero if the request was accepted, -1 if `depth` requests are already pending.
  */
-int is_dir(int tar_fd, char *path) {
+int tar_async_submit(tar_async_t *ctx, char *path, size_t offset, uint8_t *dest, size_t len, void *user_data) {
+    STATS_SCOPE(INDEX_STATS(ctx->idx), TAR_STATS_ASYNC);
+    if (ctx->free_head == ASYNC_NONE) return -1;
 
-    long to_go_cumulate = 0;
+    uint32_t slot = ctx->free_head;
+    async_request_t *request = &ctx->requests[slot];
+    ctx->free_head = request->next;
+    ctx->in_flight++;
 
-    while(true) {
+    request->user_data = user_data;
+    request->dest = dest;
+    request->done = 0;
+    request->len = 0;
+    request->error = 0;
+    request->read_errno = 0;
 
-        tar_header_t * data = malloc(sizeof(tar_header_t));
-        if(data == NULL) return 0;
+    tar_index_entry_t *entry = index_resolve(ctx->idx, index_lookup(ctx->idx, path));
+    if (entry == NULL || (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE) || dest == NULL) {
+        request->error = -1;
+    } else if (offset > entry->size) {
+        request->error = -2;
+    } else {
+        request->len = entry->size - offset < len ? (size_t) (entry->size - offset) : len;
+        request->remaining = entry->size - offset - request->len;
+        request->position = ctx->idx->base + (off_t) (entry->header_offset + sizeof(tar_header_t) + offset);
+    }
 
-        if(read(tar_fd, data, sizeof(tar_header_t)) == -1){
-            printf("an error occurred while reading");
-            return 0;
+    if (request->error != 0 || request->len == 0 || ctx->idx->map != NULL) {
+        if (request->error == 0 && request->len > 0) {
+            // memory-mapped index, the content is already at hand
+            const tar_index_t *idx = ctx->idx;
+            size_t available = (uint64_t) request->position < idx->map_len ? idx->map_len - (size_t) request->position : 0;
+            request->done = request->len < available ? request->len : available;
+            memcpy(dest, idx->map + request->position, request->done);
         }
+        pthread_mutex_lock(&ctx->lock);
+        async_ready(ctx, slot);
+        pthread_mutex_unlock(&ctx->lock);
+    } else if (ctx->use_ring) {
+        ring_queue(ctx, slot);
+    } else {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->work[(ctx->work_head + ctx->work_count) % ctx->depth] = slot;
+        ctx->work_count++;
+        pthread_cond_signal(&ctx->work_cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    return 0;
+}
+
+/**
+ * Collects finished requests.
+ *
+ * @param ctx A context created by tar_async_create().
+ * @param completions An array receiving the finished requests.
+ * @param max The size of completions.
+ * @param wait If non-zero and requests are pending, block until at least one of them is finished.
+ *
+ * @return the number of completions written, or -1 on failure.
+ */
+int tar_async_poll(tar_async_t *ctx, tar_async_completion_t *completions, int max, int wait) {
+    STATS_SCOPE(INDEX_STATS(ctx->idx), TAR_STATS_ASYNC);
+    if (ctx->use_ring) {
+        bool block = wait && ctx->ready_count == 0 && ctx->in_flight > 0;
+        if (ring_reap(ctx, block) < 0) return -1;
+    }
 
-        if(strcmp(data->name, path) == 0 && data->typeflag == DIRTYPE) return 1;
+    pthread_mutex_lock(&ctx->lock);
+    while (wait && ctx->ready_count == 0 && ctx->in_flight > 0 && !ctx->use_ring) {
+        pthread_cond_wait(&ctx->ready_cond, &ctx->lock);
+    }
+
+    int nb = 0;
+    while (nb < max && ctx->ready_count > 0) {
+        uint32_t slot = ctx->ready[ctx->ready_head];
+        ctx->ready_head = (ctx->ready_head + 1) % ctx->depth;
+        ctx->ready_count--;
 
-        long to_go = ((TAR_INT(data->size) / 512) * 512);
-        if(to_go % 512 > 0){
-            to_go += 512;
+        async_request_t *request = &ctx->requests[slot];
+        completions[nb].user_data = request->user_data;
+        completions[nb].len = request->done;
+        completions[nb].error = request->read_errno;
+        if (request->error != 0) {
+            completions[nb].result = request->error;
+        } else if (request->read_errno != 0) {
+            completions[nb].result = -3;
+        } else {
+            completions[nb].result = (ssize_t) (request->remaining + request->len - request->done);
         }
+        nb++;
 
-        to_go_cumulate += to_go;
-        lseek(tar_fd, to_go_cumulate, SEEK_CUR);
-        if(is_it_the_end(tar_fd) == true) break;
+        request->next = ctx->free_head;
+        ctx->free_head = slot;
+        ctx->in_flight--;
     }
-    return 0;
+    pthread_mutex_unlock(&ctx->lock);
+    return nb;
 }
 
 /**
- * Checks whether an entry exists in the archive and is a file.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
+ * Releases a context, waiting for the reads still in progress.
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not a file,
- *         any other value otherwise.
+ * @param ctx A context created by tar_async_create(), NULL is allowed.
  */
-int is_file(int tar_fd, char *path) {
+void tar_async_destroy(tar_async_t *ctx) {
+    if (ctx == NULL) return;
+
+    if (ctx->use_ring) {
+        // the kernel may still write to the buffers of pending requests
+        while (ctx->in_flight > ctx->ready_count) {
+            if (ring_reap(ctx, true) < 0) break;
+        }
+        ring_release(&ctx->ring);
+    }
 
-    long to_go_cumulate = 0;
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stopping = true;
+    pthread_cond_broadcast(&ctx->work_cond);
+    pthread_mutex_unlock(&ctx->lock);
+    for (unsigned i = 0; i < ctx->nb_threads; ++i) {
+        pthread_join(ctx->threads[i], NULL);
+    }
 
-    while(true) {
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->work_cond);
+    pthread_cond_destroy(&ctx->ready_cond);
+    free(ctx->requests);
+    free(ctx->ready);
+    free(ctx->work);
+    free(ctx);
+}
 
-        tar_header_t * data = malloc(sizeof(tar_header_t));
-        if(data == NULL) return 0;
 
-        if(read(tar_fd, data, sizeof(tar_header_t)) == -1){
-            printf("an error occurred while reading");
-            return 0;
-        }
+/*
+ * Archive writer.
+ *
+ * Headers, small payloads and their padding are gathered in a buffer which is written when full.
+ * A payload too large to be worth copying is written straight from the caller memory together with
+ * the buffer, in a single writev(). Files added from disk are read into the buffer, or copied by the
+ * kernel with copy_file_range() when they are large and the output allows it.
+ */
+
+#define WRITER_BUFFER (1024 * 1024)
 
-        if(strcmp(data->name, path) == 0 && data->typeflag == REGTYPE) return 1;
+struct tar_writer {
+    int out_fd;
+    uint8_t *buf;
+    size_t buf_len;
+    bool no_copy_range;
+    bool failed;                /* a write failed, everything after it is refused */
+};
 
-        long to_go = ((TAR_INT(data->size) / 512) * 512);
-        if(to_go % 512 > 0){
-            to_go += 512;
+static int writev_full(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t writing = writev(fd, iov, count);
+        if (writing < 0 && errno == EINTR) continue;
+        if (writing <= 0) return -1;
+
+        size_t written = (size_t) writing;
+        while (count > 0 && written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + written;
+            iov->iov_len -= written;
         }
+    }
+    return 0;
+}
 
-        to_go_cumulate += to_go;
-        lseek(tar_fd, to_go_cumulate, SEEK_CUR);
-        if(is_it_the_end(tar_fd) == true) break;
+static int writer_flush(tar_writer_t *writer) {
+    if (writer->buf_len > 0 && write_full(writer->out_fd, writer->buf, writer->buf_len) < 0) {
+        writer->failed = true;
+        return -1;
     }
+    writer->buf_len = 0;
     return 0;
 }
 
 /**
- * Checks whether an entry exists in the archive and is a symlink.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
- *         any other value otherwise.
+ * Appends bytes to the output, through the buffer unless they would fill more than half of it.
  */
-int is_symlink(int tar_fd, char *path) {
+static int writer_append(tar_writer_t *writer, const void *data, size_t len) {
+    if (writer->buf_len + len <= WRITER_BUFFER) {
+        memcpy(writer->buf + writer->buf_len, data, len);
+        writer->buf_len += len;
+        return 0;
+    }
+    if (len < WRITER_BUFFER / 2) {
+        if (writer_flush(writer) < 0) return -1;
+        memcpy(writer->buf, data, len);
+        writer->buf_len = len;
+        return 0;
+    }
 
-    long to_go_cumulate = 0;
+    struct iovec iov[2] = {
+        { writer->buf, writer->buf_len },
+        { (void *) data, len },
+    };
+    if (writev_full(writer->out_fd, iov, 2) < 0) {
+        writer->failed = true;
+        return -1;
+    }
+    writer->buf_len = 0;
+    return 0;
+}
 
-    while(true) {
+static int writer_pad(tar_writer_t *writer, uint64_t size) {
+    static const uint8_t zero[block_size];
+    size_t padding = (size_t) (padded_size(size) - size);
+    return padding > 0 ? writer_append(writer, zero, padding) : 0;
+}
 
-        tar_header_t * data = malloc(sizeof(tar_header_t));
-        if(data == NULL) return 0;
+/**
+ * Writes a number as a null-terminated octal string filling the field.
+ *
+ * @return zero, or -1 if it does not fit.
+ */
+static int set_octal(char *field, size_t len, uint64_t value) {
+    field[len - 1] = '\0';
+    for (size_t i = len - 1; i > 0; --i) {
+        field[i - 1] = (char) ('0' + (value & 7));
+        value >>= 3;
+    }
+    return value == 0 ? 0 : -1;
+}
 
-        if(read(tar_fd, data, sizeof(tar_header_t)) == -1){
-            printf("an error occurred while reading");
-            return 0;
-        }
+/**
+ * Writes a number that octal cannot hold, too large or negative, in base-256 (two's complement),
+ * which tar_number() and GNU tar read back.
+ */
+static void set_base256(char *field, size_t len, int64_t value) {
+    for (size_t i = len - 1; i > 0; --i) {
+        field[i] = (char) (value & 0xff);
+        value >>= 8;    // arithmetic, the sign fills the high bytes
+    }
+    field[0] = (char) (value < 0 ? 0xff : 0x80);
+}
 
-        if(strcmp(data->name, path) == 0 && data->typeflag == SYMTYPE) return 1;
+/**
+ * Fills a ustar header. Names longer than the name field are split on a slash between the prefix
+ * and the name fields.
+ *
+ * @return zero, or -1 if the name, the link target or the mode does not fit.
+ */
+static int writer_header(tar_header_t *header, const char *name, char typeflag, uint64_t size,
+                         mode_t mode, time_t mtime, const char *linkname) {
+    memset(header, 0, sizeof(tar_header_t));
 
-        long to_go = ((TAR_INT(data->size) / 512) * 512);
-        if(to_go % 512 > 0){
-            to_go += 512;
+    size_t name_len = strlen(name);
+    if (name_len <= sizeof(header->name)) {
+        memcpy(header->name, name, name_len);
+    } else {
+        // the last slash that leaves a name part short enough, with a prefix short enough
+        const char *split = NULL;
+        for (size_t i = name_len - sizeof(header->name) - 1; i + 1 < name_len; ++i) {
+            if (name[i] == '/') {
+                split = name + i;
+                break;
+            }
         }
+        if (split == NULL || (size_t) (split - name) > sizeof(header->prefix)) return -1;
+        memcpy(header->prefix, name, (size_t) (split - name));
+        memcpy(header->name, split + 1, name_len - (size_t) (split - name) - 1);
+    }
+
+    if (linkname != NULL) {
+        size_t link_len = strlen(linkname);
+        if (link_len > sizeof(header->linkname)) return -1;
+        memcpy(header->linkname, linkname, link_len);
+    }
 
-        to_go_cumulate += to_go;
-        lseek(tar_fd, to_go_cumulate, SEEK_CUR);
-        if(is_it_the_end(tar_fd) == true) break;
+    if (set_octal(header->mode, sizeof(header->mode), mode & 07777) < 0) return -1;
+    set_octal(header->uid, sizeof(header->uid), 0);
+    set_octal(header->gid, sizeof(header->gid), 0);
+    // sizes of 8 GiB and more do not fit in octal
+    if (set_octal(header->size, sizeof(header->size), size) < 0) {
+        set_base256(header->size, sizeof(header->size), (int64_t) size);
     }
+    // times before 1970 do not fit in octal either
+    if (mtime < 0 || set_octal(header->mtime, sizeof(header->mtime), (uint64_t) mtime) < 0) {
+        set_base256(header->mtime, sizeof(header->mtime), (int64_t) mtime);
+    }
+    header->typeflag = typeflag;
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    uint32_t sum = block_sum((const uint8_t *) header);
+    set_octal(header->chksum, sizeof(header->chksum) - 1, sum);
+    header->chksum[sizeof(header->chksum) - 1] = ' ';
     return 0;
 }
 
-/** ADDED BY STUDENT
- * Check if the file or folder in the given path is in a subdirectory
- *
- * Example:
- *  dir/          is_a_subdir("dir/d", 0) will return 1, is_a_subdir("a", 0) will return 0
- *   ├── a        is_a_subdir("c/", 1) will return 0
- *   ├── b
- *   ├── c/
- *   │   └── d
- *   └── e/
+static int writer_add(tar_writer_t *writer, const char *name, char typeflag, uint64_t size,
+                      mode_t mode, time_t mtime, const char *linkname) {
+    if (writer->failed) return -1;
+
+    tar_header_t header;
+    if (writer_header(&header, name, typeflag, size, mode, mtime, linkname) < 0) return -1;
+    return writer_append(writer, &header, sizeof(tar_header_t));
+}
+
+/**
+ * Starts writing an archive.
  *
- * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param dir A value equal to 1 if the path given points to a directory
+ * @param out_fd A file descriptor open for writing, where the archive is written from its current offset.
  *
- * @return zero if file/directory is inside a directory, 1 otherwise
+ * @return a new writer, or NULL on allocation failure.
  */
-int is_a_subdir(char *path,int dir){
-    int found = 0;
-    int len = strlen(path);
-    for(int i=0;i<len-dir;i++){
-        if(path[i]=='/') found = 1;
+tar_writer_t *tar_writer_open(int out_fd) {
+    tar_writer_t *writer = calloc(1, sizeof(tar_writer_t));
+    if (writer == NULL) return NULL;
+    writer->buf = malloc(WRITER_BUFFER);
+    if (writer->buf == NULL) {
+        free(writer);
+        return NULL;
     }
-    return (found);
+    writer->out_fd = out_fd;
+    return writer;
 }
 
 /**
- * Lists the entries at a given path in the archive.
- * list() does not recurse into the directories listed at the given path.
+ * Appends a regular file whose content is in memory.
  *
- * Example:
- *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
- *   ├── a
- *   ├── b
- *   ├── c/
- *   │   └── d
- *   └── e/
+ * @return zero on success, -1 if the name does not fit in a ustar header or writing failed.
+ */
+int tar_writer_add_file(tar_writer_t *writer, const char *name, const uint8_t *data, size_t len,
+                        mode_t mode, time_t mtime) {
+    if (writer_add(writer, name, REGTYPE, len, mode, mtime, NULL) < 0) return -1;
+    if (len > 0 && writer_append(writer, data, len) < 0) return -1;
+    return writer_pad(writer, len);
+}
+
+/**
+ * Appends a directory. A trailing slash is added to the name if it has none.
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
- * @param no_entries An in-out argument.
- *                   The caller set it to the number of entries in `entries`.
- *                   The callee set it to the number of entries listed.
+ * @return zero on success, -1 if the name does not fit in a ustar header or writing failed.
+ */
+int tar_writer_add_dir(tar_writer_t *writer, const char *name, mode_t mode, time_t mtime) {
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '/') return writer_add(writer, name, DIRTYPE, 0, mode, mtime, NULL);
+
+    char dir_name[PATH_MAX_INDEX];
+    if (len + 2 > sizeof(dir_name)) return -1;
+    memcpy(dir_name, name, len);
+    dir_name[len] = '/';
+    dir_name[len + 1] = '\0';
+    return writer_add(writer, dir_name, DIRTYPE, 0, mode, mtime, NULL);
+}
+
+/**
+ * Appends a symlink.
  *
- * @return zero if no directory at the given path exists in the archive,
- *         any other value otherwise.
+ * @return zero on success, -1 if the name or the target does not fit in a ustar header or writing failed.
  */
-/*
-int check_symlink_content(int tar_fd, long offset, int * dirptr, char * filename) {
-    tar_header_t * data = malloc(sizeof(tar_header_t));
-    if(data == NULL) return -1;
+int tar_writer_add_symlink(tar_writer_t *writer, const char *name, const char *target, time_t mtime) {
+    return writer_add(writer, name, SYMTYPE, 0, 0777, mtime, target);
+}
 
-    lseek(tar_fd, offset, SEEK_SET);
-    if(read(tar_fd, data, sizeof(tar_header_t)) == -1){
-        //printf("an error occurred while reading");
-        return 0;
+/**
+ * Copies `size` bytes of in_fd to the output after the buffered bytes.
+ */
+static int writer_copy_fd(tar_writer_t *writer, int in_fd, uint64_t size) {
+    // large files are handed to the kernel once the buffer is out
+    if (!writer->no_copy_range && size >= WRITER_BUFFER / 2) {
+        if (writer_flush(writer) < 0) return -1;
+        while (size > 0) {
+            ssize_t copied = copy_file_range(in_fd, NULL, writer->out_fd, NULL, size > (1 << 30) ? (1 << 30) : size, 0);
+            if (copied < 0 && errno == EINTR) continue;
+            if (copied < 0) {
+                writer->no_copy_range = true;
+                break;
+            }
+            if (copied == 0) return -1;       /* file shrank */
+            size -= (uint64_t) copied;
+        }
     }
 
-    char * path = data->linkname;
-    // first remove "." and "/"
-    if (path[strlen(path)-1] == '/') *dirptr=1;
-    int slashcnt = 0;
-    for (int i = 0; i < strlen(path)-1-(*dirptr); ++i) {
-        if (path[i] == '/') slashcnt++;
+    while (size > 0) {
+        if (writer->buf_len == WRITER_BUFFER && writer_flush(writer) < 0) return -1;
+        size_t room = WRITER_BUFFER - writer->buf_len;
+        ssize_t reading = read(in_fd, writer->buf + writer->buf_len, size < room ? (size_t) size : room);
+        if (reading < 0 && errno == EINTR) continue;
+        if (reading <= 0) return -1;
+        writer->buf_len += (size_t) reading;
+        size -= (uint64_t) reading;
     }
-    while (slashcnt != 0) {
-        char curr = *path;
-        if (curr == '/'){
-            slashcnt-=1;
-        }
-        path++;
+    return 0;
+}
+
+/**
+ * Appends a file, directory or symlink from the file system, with its mode and modification time.
+ * A directory is added alone, without its content.
+ *
+ * @param writer A writer.
+ * @param name The name of the entry in the archive.
+ * @param path The path of the file to add.
+ *
+ * @return zero on success, -1 if the file could not be read, is of another kind, its name does not
+ *         fit in a ustar header or writing failed.
+ */
+int tar_writer_add_path(tar_writer_t *writer, const char *name, const char *path) {
+    struct stat st;
+    if (writer->failed || lstat(path, &st) < 0) return -1;
+
+    if (S_ISDIR(st.st_mode)) return tar_writer_add_dir(writer, name, st.st_mode, st.st_mtime);
+    if (S_ISLNK(st.st_mode)) {
+        char target[sizeof(((tar_header_t *) NULL)->linkname) + 1];
+        ssize_t len = readlink(path, target, sizeof(target));
+        if (len < 0 || (size_t) len >= sizeof(target)) return -1;
+        target[len] = '\0';
+        return tar_writer_add_symlink(writer, name, target, st.st_mtime);
     }
-    strcpy(filename, path);
-    return 1;
+    if (!S_ISREG(st.st_mode)) return -1;
+
+    int in_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) return -1;
+    int result = writer_add(writer, name, REGTYPE, (uint64_t) st.st_size, st.st_mode, st.st_mtime, NULL);
+    if (result == 0) result = writer_copy_fd(writer, in_fd, (uint64_t) st.st_size);
+    if (result == 0) result = writer_pad(writer, (uint64_t) st.st_size);
+    else writer->failed = true;     /* the header announced a size that was not written */
+    close(in_fd);
+    return result;
 }
-*/
 
-int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
+/*
+ * Parallel packing.
+ *
+ * Worker threads lstat, open and read the input files into staged blocks: the header, the content
+ * and its padding. The calling thread is the sequencer, it appends the staged blocks to the archive
+ * in the order of the list and releases their slot. A window of slots bounds how far the workers
+ * may run ahead, and so the memory held by staged files. Files too large to be staged are added by
+ * the sequencer itself when their turn comes.
+ */
 
-    // Used to set offset
-    long to_go_cumulate = 0;
-    // used to set the in-out arg and compute the nb of directories
-    int entries_cumulator = 0;
-    int no_directories = 0;
+#define PACK_STAGE_MAX (256 * 1024)
+#define PACK_MAX_THREADS 16
 
+enum {
+    SLOT_EMPTY,
+    SLOT_STAGED,
+    SLOT_DIRECT,                /* too large, the sequencer adds it from the file */
+    SLOT_FAILED,
+};
 
-    // Loop until EOF
-    while (1) {
-        tar_header_t * data = malloc(sizeof(tar_header_t));
-        if(data == NULL) return 0;
+typedef struct pack_slot {
+    int state;
+    uint8_t *data;
+    size_t len;
+} pack_slot_t;
 
-        if(read(tar_fd, data, sizeof(tar_header_t)) == -1){
-            //printf("an error occurred while reading");
-            return 0;
-        }
+typedef struct pack_job {
+    const char *const *names;
+    const char *const *paths;
+    size_t count;
 
-        // check EOF
-        if (*(uint8_t *) data == 0) break;
+    pack_slot_t *slots;         /* item i is staged in slots[i % window] */
+    size_t window;
+    size_t next_item;           /* first item not taken by a worker */
+    size_t emitted;             /* items appended to the archive */
+    bool stop;
 
-        // here for debugging purpose
-        //printf("linkname : %s \n", data->linkname);
-        //printf("type : %c \n", data->typeflag);
-        // check if current file has symlink
-        if (data->typeflag == SYMTYPE) {
-            int * dir = malloc(sizeof (int ));
-            *dir = 0;
-            if (data->typeflag == DIRTYPE) {
-                no_directories++;
-                *dir =1;
-            }
-            if (!(is_a_subdir(data->name, *dir))) {
-                int dir = 0;
-                int *dirptr = &dir;
-                // 6 cases for filename : 1. "../file(/)", "file(/)", "directory/file(/)",  (/) have been added because the filename can eventually be a directory
-                // This pointer will also be used to store the filename/directory name on the entry list
-                char *filename = data->linkname;
-                //check_symlink_content(tar_fd, to_go_cumulate, dirptr, filename);
-                char * path = data->linkname;
-                // first remove "." and "/"
-                if (path[strlen(path)-1] == '/') *dirptr=1;
-                int slashcnt = 0;
-                for (int i = 0; i < strlen(path)-1-(*dirptr); ++i) {
-                    if (path[i] == '/') slashcnt++;
-                }
-                while (slashcnt != 0) {
-                    char curr = *path;
-                    if (curr == '/'){
-                        slashcnt-=1;
-                    }
-                    path++;
-                }
-                strcpy(filename, path);
-                if (dir) {
-                    no_directories++;
-                }
-                if (entries_cumulator < *(int *) no_entries) strcpy(entries[entries_cumulator], filename);
-                entries_cumulator++;
-            }
-        }
-        else {
-        // Check if the current entry is a dir, update no_directories if so
-        // Also, update entries array and no_entries variable IF enough space is available in entries array
-        int dir =0;
-        if (data->typeflag == DIRTYPE) {
-            no_directories++;
-            dir =1;
-        }
-
-        // If current entry is in a listed directory, skip it (this function does not recurse in folders
-        if (!(is_a_subdir(data->name, dir))) {
-            char * filename = data->name;
-            int intnoentries = *(int *) no_entries;
-            if (entries_cumulator<intnoentries) {
-                strcpy(entries[entries_cumulator], filename);
-            }
-            //printf("filename %s\n", data->name);
-            entries_cumulator++;
-        }
-        }
+    pthread_mutex_t lock;
+    pthread_cond_t staged;
+    pthread_cond_t freed;
+} pack_job_t;
 
+/**
+ * Reads an entry of the file system into memory, as it is laid out in the archive.
+ */
+static void pack_stage(const pack_job_t *job, size_t item, pack_slot_t *slot) {
+    slot->state = SLOT_FAILED;
+    slot->data = NULL;
+    slot->len = 0;
 
-        // Compute nb of bytes until next header or end of file
-        long to_go = ((TAR_INT(data->size) / 512) * 512);
-        if ((TAR_INT(data->size)%512) != 0) {
-            to_go+=512;
-        }
+    struct stat st;
+    if (lstat(job->paths[item], &st) < 0) return;
+    if (S_ISREG(st.st_mode) && st.st_size > PACK_STAGE_MAX) {
+        slot->state = SLOT_DIRECT;
+        return;
+    }
+    if (S_ISLNK(st.st_mode) || (S_ISDIR(st.st_mode) && strlen(job->names[item]) + 2 > PATH_MAX_INDEX)) {
+        // left to tar_writer_add_path(), which reads the link or refuses the name
+        slot->state = SLOT_DIRECT;
+        return;
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) return;
+
+    uint64_t size = S_ISREG(st.st_mode) ? (uint64_t) st.st_size : 0;
+    uint8_t *data = calloc(1, sizeof(tar_header_t) + padded_size(size));
+    if (data == NULL) return;
 
-        // Add jump size to to_go_cumulate and move file offset
-        to_go_cumulate += to_go;
-        lseek(tar_fd, to_go, SEEK_CUR);
+    int result;
+    if (S_ISDIR(st.st_mode)) {
+        const char *name = job->names[item];
+        size_t len = strlen(name);
+        char dir_name[PATH_MAX_INDEX];
+        memcpy(dir_name, name, len);
+        if (len == 0 || dir_name[len - 1] != '/') dir_name[len++] = '/';
+        dir_name[len] = '\0';
+        result = writer_header((tar_header_t *) data, dir_name, DIRTYPE, 0, st.st_mode, st.st_mtime, NULL);
+    } else {
+        result = writer_header((tar_header_t *) data, job->names[item], REGTYPE, size, st.st_mode, st.st_mtime, NULL);
+        int in_fd = result == 0 ? open(job->paths[item], O_RDONLY | O_CLOEXEC) : -1;
+        if (in_fd < 0 || pread_full(in_fd, data + sizeof(tar_header_t), size, 0) != size) result = -1;
+        if (in_fd >= 0) close(in_fd);
+    }
+    if (result < 0) {
         free(data);
+        return;
     }
+    slot->state = SLOT_STAGED;
+    slot->data = data;
+    slot->len = sizeof(tar_header_t) + padded_size(size);
+}
 
-    // We set no_entries to the number of entries listed
-    * no_entries = (size_t) entries_cumulator;
-    if (no_directories > 0) return 1;
-    return 0;
+static void *pack_worker(void *arg) {
+    pack_job_t *job = arg;
+
+    pthread_mutex_lock(&job->lock);
+    while (true) {
+        while (!job->stop && job->next_item < job->count && job->next_item >= job->emitted + job->window) {
+            pthread_cond_wait(&job->freed, &job->lock);
+        }
+        if (job->stop || job->next_item >= job->count) break;
+        size_t item = job->next_item++;
+        pthread_mutex_unlock(&job->lock);
+
+        pack_slot_t staged;
+        pack_stage(job, item, &staged);
 
+        pthread_mutex_lock(&job->lock);
+        job->slots[item % job->window] = staged;
+        pthread_cond_broadcast(&job->staged);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
 }
 
 /**
- * Reads a file at a given path in the archive.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
- * @param dest A destination buffer to read the given file into.
- * @param len An in-out argument.
- *            The caller set it to the size of dest.
- *            The callee set it to the number of bytes written to dest.
+ * Appends files, directories and symlinks from the file system like tar_writer_add_path(), in the
+ * order of the lists, while several threads read the next files ahead.
  *
- * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
- *         -2 if the offset is outside the file total length,
- *         zero if the file was read in its entirety into the destination buffer,
- *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
- *         the end of the file.
+ * @param writer A writer.
+ * @param names The names of the entries in the archive.
+ * @param paths The paths of the files to add, paths[i] is added as names[i].
+ * @param count The number of entries to add.
+ * @param nb_threads The number of threads reading files, zero or less for a default suited to I/O.
  *
+ * @return zero on success, -1 if an entry could not be added. The entries before it are in the
+ *         archive and nothing after it was written.
  */
-ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
+int tar_writer_add_paths(tar_writer_t *writer, const char *const *names, const char *const *paths,
+                         size_t count, int nb_threads) {
+    if (writer->failed) return -1;
+    if (count == 0) return 0;
 
-    if(path == NULL || strlen(path) == 0) return -1;
-    if(dest == NULL) return -1;
-
-    tar_header_t * data = malloc(sizeof(tar_header_t));
-    if(data == NULL) return -1;
+    pack_job_t job;
+    memset(&job, 0, sizeof(pack_job_t));
+    job.names = names;
+    job.paths = paths;
+    job.count = count;
 
-    ssize_t reading = 0;
-    long to_go_cumulate = 0;
+    if (nb_threads <= 0) nb_threads = PACK_MAX_THREADS / 2;
+    if (nb_threads > PACK_MAX_THREADS) nb_threads = PACK_MAX_THREADS;
+    if ((size_t) nb_threads > count) nb_threads = (int) count;
+    job.window = 4 * (size_t) nb_threads;
+    job.slots = calloc(job.window, sizeof(pack_slot_t));
+    if (job.slots == NULL) return -1;
 
-    while(true) {
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.staged, NULL);
+    pthread_cond_init(&job.freed, NULL);
 
-        if(read(tar_fd, data, sizeof(tar_header_t)) == -1){
-            printf("an error occurred while reading");
-            return 0;
-        }
+    pthread_t threads[PACK_MAX_THREADS];
+    int started = 0;
+    for (; started < nb_threads; ++started) {
+        if (pthread_create(&threads[started], NULL, pack_worker, &job) != 0) break;
+    }
 
+    int result = 0;
+    for (size_t item = 0; item < count && result == 0; ++item) {
+        pack_slot_t *slot = &job.slots[item % job.window];
 
-        if (strcmp(data->name, path) == 0){
-            if(data->typeflag != REGTYPE && data->typeflag != AREGTYPE) return -1;
+        pthread_mutex_lock(&job.lock);
+        while (slot->state == SLOT_EMPTY) {
+            // nobody took it yet: the workers are behind, or none could be started
+            if (job.next_item == item) {
+                job.next_item++;
+                pthread_mutex_unlock(&job.lock);
+                pack_stage(&job, item, slot);
+                pthread_mutex_lock(&job.lock);
+                break;
+            }
+            pthread_cond_wait(&job.staged, &job.lock);
         }
+        pack_slot_t staged = *slot;
+        pthread_mutex_unlock(&job.lock);
 
+        if (staged.state == SLOT_STAGED) result = writer_append(writer, staged.data, staged.len);
+        else if (staged.state == SLOT_DIRECT) result = tar_writer_add_path(writer, names[item], paths[item]);
+        else result = -1;
+        free(staged.data);
 
-        long to_go = ((TAR_INT(data->size) / 512) * 512);
-        //if(to_go % 512 > 0){
-        //    to_go += 512;
-        //}
+        pthread_mutex_lock(&job.lock);
+        slot->state = SLOT_EMPTY;
+        slot->data = NULL;
+        job.emitted++;
+        if (result < 0) job.stop = true;
+        pthread_cond_broadcast(&job.freed);
+        pthread_mutex_unlock(&job.lock);
+    }
 
-        if(offset > to_go) return -2;
-        lseek(tar_fd, offset, SEEK_CUR);
-        reading = read(tar_fd, dest, *len);
-        *len = reading;
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    // files staged ahead of a failure
+    for (size_t i = 0; i < job.window; ++i) {
+        free(job.slots[i].data);
+    }
+    free(job.slots);
+    pthread_cond_destroy(&job.freed);
+    pthread_cond_destroy(&job.staged);
+    pthread_mutex_destroy(&job.lock);
+    return result;
+}
 
-        if(reading < to_go){
-            return to_go - reading;
-        } else if(reading == to_go){
-            return 0;
-        } else {
-            to_go_cumulate += to_go;
-            lseek(tar_fd, to_go_cumulate, SEEK_CUR);
-            if(is_it_the_end(tar_fd) == true) break;
-        }
+/**
+ * Ends the archive with two zero blocks, writes what is buffered and releases the writer.
+ * The file descriptor is not closed.
+ *
+ * @param writer A writer, NULL is allowed.
+ *
+ * @return zero on success, -1 if a write failed at any point.
+ */
+int tar_writer_close(tar_writer_t *writer) {
+    if (writer == NULL) return 0;
 
-    }
+    static const uint8_t trailer[2 * block_size];
+    int result = writer->failed ? -1 : 0;
+    if (result == 0) result = writer_append(writer, trailer, sizeof(trailer));
+    if (result == 0) result = writer_flush(writer);
 
-    return -1;
-}
\ No newline at end of file
+    free(writer->buf);
+    free(writer);
+    return result;
+}
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
 
 typedef struct posix_header
 {                              /* byte offset */
@@ -38,9 +40,190 @@ typedef struct posix_header
 #define LNKTYPE  '1'            /* link */
 #define SYMTYPE  '2'            /* reserved */
 #define DIRTYPE  '5'            /* directory */
+#define XHDTYPE  'x'            /* PAX extended header of the next entry */
+#define XGLTYPE  'g'            /* PAX global extended header */
+#define GNU_LONGNAME 'L'        /* GNU long name of the next entry */
+#define GNU_LONGLINK 'K'        /* GNU long link target of the next entry */
 
-/* Converts an ASCII-encoded octal-based number into a regular integer */
-#define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
+/* Whether a header only carries metadata for the entries after it */
+#define TAR_IS_EXTENSION(typeflag) ((typeflag) == XHDTYPE || (typeflag) == XGLTYPE \
+                                    || (typeflag) == GNU_LONGNAME || (typeflag) == GNU_LONGLINK)
+
+/* Longest path the library handles, terminating null included */
+#define TAR_PATH_MAX 4096
+
+/**
+ * Decodes a numeric header field, in octal or base-256, reading no further than its width, without strtol().
+ * Up to 7 bytes after the field may be read, which is always safe for a field of a tar_header_t.
+ *
+ * @param field A field of a header.
+ * @param len The width of the field.
+ *
+ * @return the value of the field.
+ */
+int64_t tar_number(const char *field, size_t len);
+
+/* Decodes a numeric field of a tar_header_t, like TAR_NUMBER(header->size) */
+#define TAR_NUMBER(field) tar_number((field), sizeof(field))
+
+/*
+ * The archive is always read with positional reads (pread): the file offset of tar_fd tells where the
+ * archive starts but is never moved. All functions below can therefore be called by several threads at
+ * once on the same file descriptor or on the same index, as long as nobody else moves the file offset.
+ *
+ * An archive compressed with gzip (or zstd, when built with LIB_TAR_ZSTD) is recognized from its first
+ * bytes and decompressed on the fly. Decompression moves forward only, so each function working on a
+ * file descriptor decompresses the archive from its start. An index keeps checkpoints recorded while
+ * it was built, from which random reads restart, and serializes the reads of a compressed archive.
+ *
+ * Paths given to the functions below are normalized before being compared to the names in the archive:
+ * a leading "./" or slash, empty and "." components and the trailing slash of directories are ignored,
+ * so "dir", "dir/" and "./dir/" all name the entry "dir/" (or "./dir/").
+ */
+
+/**
+ * An entry decoded by tar_iter_next().
+ *
+ * The fields are decoded once here. The name, link target, size and modification time are those of
+ * the header, overridden by the PAX extended headers (x and g) and GNU long names (L and K) before it.
+ * The name includes the ustar prefix and numbers may be in base-256. Extension headers are returned as
+ * entries too, so that they can be counted and checked, but what they describe only shows in the entry
+ * after them.
+ */
+typedef struct tar_iter_entry {
+    const tar_header_t *header;   /* the raw header, valid until the next call to tar_iter_next() */
+    uint64_t offset;              /* offset of the header from the start of the archive */
+    uint64_t size;                /* size of the entry content */
+    char typeflag;
+
+    const char *name;             /* full path, null-terminated, valid until the next call */
+    size_t name_len;
+    const char *linkname;         /* full link target, null-terminated, valid until the next call */
+    size_t link_len;
+    int64_t mtime;
+    mode_t mode;
+} tar_iter_entry_t;
+
+/**
+ * Identifies an archive in the block cache: the file holding it, as it was when the archive was
+ * opened, and where the archive starts in it. Private to the library, like the fields of tar_iter_t.
+ */
+typedef struct tar_cache_key {
+    uint64_t hash;                /* of the fields below, zero to bypass the cache */
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+    uint64_t base;
+} tar_cache_key_t;
+
+/**
+ * An iterator over the headers of an archive. Its fields are private to the library, it is declared
+ * here only so that callers can keep it on the stack.
+ */
+typedef struct tar_iter {
+    int tar_fd;
+    off_t base;                   /* offset of the archive in tar_fd */
+    struct tar_decoder *decoder;  /* decompresses a gzip or zstd archive, NULL if it is not compressed */
+    struct tar_extensions *ext;   /* PAX and GNU values waiting for the entries they apply to */
+    tar_cache_key_t cache_key;    /* identifies the archive in the block cache */
+
+    uint8_t *buf;
+    size_t buf_cap;
+    uint64_t buf_start;           /* archive offset of buf[0] */
+    size_t buf_len;
+
+    uint64_t next;                /* archive offset of the next header */
+    uint64_t archive_len;         /* length of the archive, UINT64_MAX if not known (compressed or not a file) */
+    int corrupt;                  /* set when the size of an entry is invalid, which ends the iteration */
+    tar_iter_entry_t entry;
+} tar_iter_t;
+
+/**
+ * Prepares an iteration over the headers of an archive.
+ * The iterator reads the archive through buffers allocated here, no allocation is made per entry.
+ *
+ * Example:
+ *  tar_iter_t iter;
+ *  const tar_iter_entry_t *entry;
+ *  if (tar_iter_init(&iter, tar_fd) == 0) {
+ *      while ((entry = tar_iter_next(&iter)) != NULL) { ... }
+ *      tar_iter_release(&iter);
+ *  }
+ *
+ * @param iter The iterator to initialize.
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file.
+ *
+ * @return zero on success, -1 on failure.
+ */
+int tar_iter_init(tar_iter_t *iter, int tar_fd);
+
+/**
+ * Moves to the next header of the archive.
+ *
+ * @param iter An iterator initialized by tar_iter_init().
+ *
+ * @return the decoded entry, which is overwritten by the next call,
+ *         or NULL at the end of the archive, if it could not be read or if the size of an entry is invalid
+ *         (then iter->corrupt is set and iter->next is the offset of its header).
+ */
+const tar_iter_entry_t *tar_iter_next(tar_iter_t *iter);
+
+/**
+ * Releases the buffer of an iterator, and its decoder if the archive is compressed.
+ *
+ * @param iter An iterator initialized by tar_iter_init().
+ */
+void tar_iter_release(tar_iter_t *iter);
+
+/**
+ * Sets the size of the chunks read at once when scanning an archive (1 MiB by default).
+ * Headers and small payloads are then served from memory instead of one system call per block.
+ * It is not safe to call this while another thread is using the library.
+ *
+ * @param bytes The chunk size, rounded up to a multiple of 512 bytes.
+ *              Zero restores the default.
+ */
+void tar_set_scan_chunk_size(size_t bytes);
+
+/**
+ * Counters of the block cache.
+ */
+typedef struct tar_cache_stats {
+    uint64_t hits;                /* blocks served from the cache */
+    uint64_t misses;              /* blocks requested and read from the archive */
+    uint64_t read_ahead;          /* blocks read ahead of a scan */
+    uint64_t capacity;            /* size of the cache in bytes */
+    uint64_t used;                /* bytes held by the cache */
+} tar_cache_stats_t;
+
+/**
+ * Sets the size of the block cache shared by all the functions reading an archive, disabled by default.
+ *
+ * Archive bytes are then kept in 64 KiB blocks, evicted in least recently used order, so that
+ * repeated or overlapping queries on the same archive (through a file descriptor or an index) are
+ * served from memory. A scan also reads `readahead` bytes ahead in the same system call. The blocks
+ * of an archive whose file was modified are not used by the calls on a file descriptor, nor by the
+ * indexes and handles opened since. Those identify the archive as it was when they were opened and,
+ * like the offsets they keep, must be opened again once it changed. Memory-mapped indexes and
+ * io_uring reads do not go through the cache, nor does tar_extract(), which reads the archive once.
+ * It is not safe to call this while another thread is using the library.
+ *
+ * @param bytes The size of the cache, rounded up to a multiple of 64 KiB. Zero disables the cache
+ *              and releases its memory.
+ * @param readahead How far to read ahead of a scan, rounded up to a multiple of 64 KiB, at most 2 MiB.
+ *
+ * @return zero on success, -1 if the cache could not be allocated, in which case it is disabled.
+ */
+int tar_set_cache_size(size_t bytes, size_t readahead);
+
+/**
+ * Reads the counters of the block cache. They are kept when the cache is resized.
+ *
+ * @param stats Receives the counters.
+ */
+void tar_cache_stats(tar_cache_stats_t *stats);
 
 /**
  * Checks whether the archive is valid.
@@ -55,10 +238,42 @@ typedef struct posix_header
  * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
  *         -1 if the archive contains a header with an invalid magic value,
  *         -2 if the archive contains a header with an invalid version value,
- *         -3 if the archive contains a header with an invalid checksum value
+ *         -3 if the archive contains a header with an invalid checksum value,
+ *         -4 if the size of an entry is invalid (a PAX size which is not a length or does not fit in the archive)
  */
 int check_archive(int tar_fd);
 
+/* Flag of check_archive_parallel(): also check that the content of each entry fits in the archive */
+#define TAR_CHECK_BOUNDS 1
+
+/**
+ * Checks whether the archive is valid like check_archive(), with the headers verified by several threads.
+ * The offsets of all headers are found first, then the headers are checked in parallel.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param nb_threads The number of threads checking headers, zero or less to use one per online CPU.
+ * @param flags Zero or TAR_CHECK_BOUNDS.
+ * @param bad_offset If not NULL and the archive is invalid, set to the offset of the first invalid header
+ *                   from the start of the archive.
+ *
+ * @return the same values as check_archive(), where -4 is also returned if TAR_CHECK_BOUNDS is set and
+ *         the content of an entry extends past the end of the archive.
+ */
+int check_archive_parallel(int tar_fd, int nb_threads, int flags, uint64_t *bad_offset);
+
+/**
+ * Checks the magic value, the version and the checksum of a single header, the same way check_archive() does.
+ * The checksum is computed with SIMD instructions when the CPU supports them.
+ *
+ * @param header A non-null header.
+ *
+ * @return zero if the header is valid,
+ *         -1 if its magic value is invalid,
+ *         -2 if its version value is invalid,
+ *         -3 if its checksum value is invalid
+ */
+int tar_check_header(const tar_header_t *header);
+
 /**
  * Checks whether an entry exists in the archive.
  *
@@ -103,10 +318,60 @@ int is_file(int tar_fd, char *path);
  */
 int is_symlink(int tar_fd, char *path);
 
+/**
+ * The metadata of an entry, decoded by tar_lookup().
+ */
+typedef struct tar_stat {
+    char typeflag;                /* REGTYPE, DIRTYPE, SYMTYPE... */
+    mode_t mode;                  /* permission bits of the header */
+    uint64_t size;                /* size of the entry content */
+    int64_t mtime;
+    uint64_t offset;              /* offset of the header from the start of the archive */
+} tar_stat_t;
+
+/* Flag of tar_lookup(): describe the entry symlinks and hard links lead to instead of the link itself */
+#define TAR_LOOKUP_FOLLOW 1
+
+/**
+ * Looks up an entry and decodes its metadata with a single scan of the archive, where calling
+ * exists(), is_file() then read_file() scans it once for each.
+ *
+ * Example:
+ *  tar_stat_t st;
+ *  if (tar_lookup(tar_fd, "dir/a", TAR_LOOKUP_FOLLOW, &st) && st.typeflag == REGTYPE) { ... }
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ * @param flags Zero or TAR_LOOKUP_FOLLOW.
+ * @param st Receives the metadata of the entry.
+ *
+ * @return zero if no entry at the given path exists in the archive or a link does not lead to one,
+ *         any other value otherwise.
+ */
+int tar_lookup(int tar_fd, const char *path, int flags, tar_stat_t *st);
+
+/**
+ * Looks up many paths with a single scan of the archive, instead of one scan per path with
+ * tar_lookup() or exists(). With TAR_LOOKUP_FOLLOW, one more scan is made for each level of links
+ * followed, for the paths that led to a link only. The type checks of is_dir(), is_file() and
+ * is_symlink() are made on the typeflag of the results.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param paths The paths to look up.
+ * @param count The number of paths.
+ * @param flags Zero or TAR_LOOKUP_FOLLOW.
+ * @param stats Receives the metadata of the entry of paths[i] in stats[i].
+ * @param found found[i] is set to a non-zero value if paths[i] leads to an entry, zero otherwise.
+ *
+ * @return the number of paths found, or -1 if the archive could not be read or memory could not be allocated.
+ */
+long tar_lookup_many(int tar_fd, const char *const *paths, size_t count, int flags, tar_stat_t *stats, int *found);
+
 
 /**
  * Lists the entries at a given path in the archive.
  * list() does not recurse into the directories listed at the given path.
+ * A member appended several times to the archive is listed once, under the name of its last copy.
  *
  * Example:
  *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
@@ -118,6 +383,7 @@ int is_symlink(int tar_fd, char *path);
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
  * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
+ *             ".", "./" and "" are the root of the archive, whose top-level entries are listed.
  * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
  * @param no_entries An in-out argument.
  *                   The caller set it to the number of entries in `entries`.
@@ -148,4 +414,497 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/**
+ * A read made by read_files().
+ */
+typedef struct tar_read_request {
+    const char *path;             /* as given to read_file() */
+    size_t offset;
+    uint8_t *dest;
+    size_t len;                   /* the size of dest, then the number of bytes written to dest */
+    ssize_t result;               /* set to the value read_file() would return */
+} tar_read_request_t;
+
+/**
+ * Reads several files of the archive at once. All the entries are found with a single scan of the
+ * archive, then the reads are sorted by position in the archive and neighbouring ones are merged into
+ * vectored reads (preadv), instead of one scan and one random read per file with read_file().
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param requests The reads to make. The result and len of each request are set as read_file() does.
+ * @param count The number of requests.
+ *
+ * @return zero if the requests were processed, -1 if the archive could not be read or memory could
+ *         not be allocated.
+ */
+int read_files(int tar_fd, tar_read_request_t *requests, size_t count);
+
+/**
+ * Extracts the archive into a directory, reading it once and without holding whole files in memory.
+ *
+ * Regular files, directories, symlinks and hard links are created with the mode of their header,
+ * files also get their modification time. Other kinds of entries are skipped, as are entries whose
+ * path is absolute, contains ".." or goes through a symlink, and directories whose path already
+ * exists as something else than a directory, so that nothing is written outside of `dest_dir`.
+ * Existing files are overwritten.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param dest_dir The directory to extract to, created if it does not exist.
+ *
+ * @return the number of entries extracted, or -1 if the archive could not be read or an entry could
+ *         not be written.
+ */
+int tar_extract(int tar_fd, const char *dest_dir);
+
+/**
+ * Callbacks of tar_stream(), either of them can be NULL.
+ */
+typedef struct tar_visitor {
+    /* Called for each valid entry, which is only valid during the call. Extension headers are not
+     * visited, their values are in the entries after them.
+     * Returns 1 to receive the content of the entry through on_data, 0 to skip it, -1 to stop. */
+    int (*on_header)(void *arg, const tar_iter_entry_t *entry);
+    /* Called with the consecutive chunks of the content of an entry. Returns 0 to go on, -1 to stop. */
+    int (*on_data)(void *arg, const uint8_t *data, size_t len);
+    void *arg;                    /* passed to the callbacks */
+} tar_visitor_t;
+
+/**
+ * Reads an archive from its current position to its end without seeking, calling a visitor for each entry.
+ * Every byte is read once with read(), so the archive can come from a pipe or a socket while it is
+ * being produced. Headers are checked as check_archive() does before being visited.
+ *
+ * @param fd A file descriptor on the archive, which does not need to be seekable.
+ * @param visitor The callbacks.
+ *
+ * @return the number of headers read if the archive is valid,
+ *         -1, -2 or -3 if a header is invalid, as check_archive(),
+ *         -4 if reading failed, the stream ended inside an entry or the size of an entry is invalid,
+ *         -5 if the visitor stopped the stream.
+ */
+int tar_stream(int fd, const tar_visitor_t *visitor);
+
+/**
+ * An opaque handle on an archive whose headers have been indexed in memory.
+ *
+ * The index is built once with a single pass over the headers of the archive, after which every
+ * lookup is answered from a hash table mapping each entry name to its header offset, size and type,
+ * without touching the archive again. Only reading a file payload goes back to the file descriptor.
+ */
+typedef struct tar_index tar_index_t;
+
+/**
+ * Builds an index over the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *               It must stay open until tar_index_close() is called.
+ *
+ * @return a new index, or NULL if the archive could not be read or memory could not be allocated.
+ */
+tar_index_t *tar_index_open(int tar_fd);
+
+/**
+ * Releases an index built by tar_index_open(). The file descriptor is not closed.
+ *
+ * @param idx An index, NULL is allowed.
+ */
+void tar_index_close(tar_index_t *idx);
+
+/**
+ * Writes an index to a sidecar file, to be loaded back with tar_index_load().
+ * The sidecar records the size, modification time and inode of the archive so that it is not used
+ * once the archive has changed.
+ *
+ * @param idx An index.
+ * @param index_fd A file descriptor open for writing, positioned where the sidecar starts (usually an empty file).
+ *
+ * @return zero on success, -1 on failure.
+ */
+int tar_index_save(tar_index_t *idx, int index_fd);
+
+/**
+ * Loads an index saved by tar_index_save(). The sidecar is mapped in memory and used as it is,
+ * nothing is parsed nor rebuilt. Its tables are checked once, in time linear in the number of entries
+ * but without reading the archive, so that lookups on a corrupted sidecar cannot leave the mapping
+ * and need no bounds checks of their own. The index is released with tar_index_close().
+ *
+ * @param tar_fd A file descriptor pointing to the start of the archive the index was built for.
+ * @param index_fd A file descriptor of the sidecar file, open for reading. It can be closed once loaded.
+ *
+ * @return the index, or NULL if the sidecar is invalid, does not match the archive (which was modified
+ *         since it was saved) or could not be mapped. The caller then builds the index again.
+ */
+tar_index_t *tar_index_load(int tar_fd, int index_fd);
+
+/**
+ * Same as exists(), answered from an index.
+ */
+int tar_index_exists(tar_index_t *idx, char *path);
+
+/**
+ * Same as is_dir(), answered from an index.
+ */
+int tar_index_is_dir(tar_index_t *idx, char *path);
+
+/**
+ * Same as is_file(), answered from an index.
+ */
+int tar_index_is_file(tar_index_t *idx, char *path);
+
+/**
+ * Same as is_symlink(), answered from an index.
+ */
+int tar_index_is_symlink(tar_index_t *idx, char *path);
+
+/**
+ * Same as tar_lookup(), answered from an index.
+ */
+int tar_index_lookup(tar_index_t *idx, const char *path, int flags, tar_stat_t *st);
+
+/**
+ * Same as list(), answered from an index.
+ */
+int tar_index_list(tar_index_t *idx, char *path, char **entries, size_t *no_entries);
+
+/**
+ * Lists the entries at a given path in the archive, a page at a time.
+ * Only the direct children of the directory are visited, whatever the size of the archive.
+ *
+ * Example:
+ *  size_t cursor = 0;
+ *  do {
+ *      size_t no_entries = PAGE_SIZE;
+ *      if (!tar_index_list_page(idx, "dir/", entries, &no_entries, &cursor)) break;
+ *      ...
+ *  } while (cursor != 0);
+ *
+ * @param idx An index.
+ * @param path A path to a directory in the archive, or an empty string (or ".") for the root of the archive.
+ *             If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ * @param cursor An in-out argument.
+ *               The caller set it to zero for the first page, then passes back the value set by the callee.
+ *               The callee set it to zero once the last entry has been listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_index_list_page(tar_index_t *idx, char *path, char **entries, size_t *no_entries, size_t *cursor);
+
+/**
+ * Same as read_file(), the entry is located through an index.
+ */
+ssize_t tar_index_read_file(tar_index_t *idx, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Builds an index like tar_index_open(), over a read-only memory mapping of the archive.
+ * Headers are parsed in place from the mapping and file contents can be accessed without copy
+ * through tar_file_view(). The index is released with tar_index_close().
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *               The archive must not be truncated while the index is open.
+ *
+ * @return a new index, or NULL if the file is empty, the archive could not be mapped or memory could not be allocated.
+ */
+tar_index_t *tar_open_mmap(int tar_fd);
+
+/**
+ * Gives direct access to the content of a file in an archive opened with tar_open_mmap().
+ * The returned pointer stays valid until tar_index_close() is called.
+ *
+ * @param idx An index built by tar_open_mmap().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param data Set to the first byte of the file content, inside the mapping.
+ * @param len Set to the length of the file content.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the index is not memory-mapped or the file content lies beyond the end of the archive.
+ */
+int tar_file_view(tar_index_t *idx, char *path, const uint8_t **data, size_t *len);
+
+/**
+ * A handle on a file of an archive, for reads at any offset without looking the file up again.
+ * A handle can be used by several threads at once.
+ *
+ * Example:
+ *  tar_entry_t *entry = tar_entry_open(tar_fd, "dir/video");
+ *  ssize_t n = tar_entry_pread(entry, range_start, buf, sizeof(buf));
+ *  tar_entry_close(entry);
+ */
+typedef struct tar_entry tar_entry_t;
+
+/**
+ * Opens a file of the archive for reads at any offset. It is looked up, and its links followed, with a
+ * single scan of the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *               It must stay open until tar_entry_close() is called.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ *
+ * @return a new handle, or NULL if no file exists at the given path or memory could not be allocated.
+ */
+tar_entry_t *tar_entry_open(int tar_fd, const char *path);
+
+/**
+ * Same as tar_entry_open(), the file is looked up in an index. The index must outlive the handle.
+ */
+tar_entry_t *tar_index_entry_open(tar_index_t *idx, const char *path);
+
+/**
+ * Gives the metadata of an open file.
+ *
+ * @param entry A handle.
+ * @param st Receives the metadata of the file, links followed.
+ */
+void tar_entry_stat(const tar_entry_t *entry, tar_stat_t *st);
+
+/**
+ * Reads the content of an open file at an offset, like pread(). The content is read directly from
+ * the archive, through the block cache if it is enabled.
+ *
+ * @param entry A handle.
+ * @param offset An offset in the file.
+ * @param dest A destination buffer.
+ * @param len The number of bytes to read.
+ *
+ * @return the number of bytes read, zero at or after the end of the file, fewer than `len` only at the end
+ *         of the file or if the archive is shorter than its headers announce.
+ */
+ssize_t tar_entry_pread(tar_entry_t *entry, uint64_t offset, uint8_t *dest, size_t len);
+
+/**
+ * Releases a handle. The file descriptor is not closed.
+ *
+ * @param entry A handle, NULL is allowed.
+ */
+void tar_entry_close(tar_entry_t *entry);
+
+/* Public functions whose calls and time are counted by the statistics */
+enum tar_stats_function {
+    TAR_STATS_CHECK_ARCHIVE,
+    TAR_STATS_CHECK_ARCHIVE_PARALLEL,
+    TAR_STATS_EXISTS,
+    TAR_STATS_IS_DIR,
+    TAR_STATS_IS_FILE,
+    TAR_STATS_IS_SYMLINK,
+    TAR_STATS_LIST,
+    TAR_STATS_READ_FILE,
+    TAR_STATS_READ_FILES,
+    TAR_STATS_LOOKUP,
+    TAR_STATS_LOOKUP_MANY,
+    TAR_STATS_EXTRACT,
+    TAR_STATS_STREAM,
+    TAR_STATS_INDEX_OPEN,         /* tar_index_open(), tar_open_mmap() and tar_index_load() */
+    TAR_STATS_INDEX_LOOKUP,       /* tar_index_exists(), tar_index_is_*() and tar_index_lookup() */
+    TAR_STATS_INDEX_LIST,         /* tar_index_list() and tar_index_list_page() */
+    TAR_STATS_INDEX_READ_FILE,    /* tar_index_read_file() and tar_file_view() */
+    TAR_STATS_ASYNC,              /* tar_async_submit() and tar_async_poll() */
+    TAR_STATS_ENTRY_OPEN,         /* tar_entry_open() and tar_index_entry_open() */
+    TAR_STATS_ENTRY_PREAD,
+    TAR_STATS_FUNCTIONS
+};
+
+/**
+ * A snapshot of the statistics of an index, or of the functions working on file descriptors.
+ */
+typedef struct tar_stats {
+    uint64_t syscalls;            /* reads and seeks made on the archive */
+    uint64_t bytes_read;          /* bytes read from the archive file, compressed if it is */
+    uint64_t headers;             /* headers parsed */
+    uint64_t bytes_skipped;       /* entry contents passed over by the header scans */
+    uint64_t cache_hits;          /* blocks served by the block cache */
+    uint64_t cache_misses;        /* blocks the block cache had to read */
+    uint64_t calls[TAR_STATS_FUNCTIONS];       /* calls to each public function */
+    uint64_t nanoseconds[TAR_STATS_FUNCTIONS]; /* time spent in each of them */
+} tar_stats_t;
+
+/**
+ * Takes a snapshot of the statistics of the library. They are only kept when the library is built with
+ * LIB_TAR_STATS (`make STATS=1`), and cost nothing otherwise.
+ *
+ * Opening an index is counted with the functions working on file descriptors, what it reads with the index.
+ *
+ * @param idx An index, or NULL for everything not done through an index.
+ * @param stats Receives the counters, all zero if the statistics are not built in.
+ *
+ * @return zero on success, -1 if the library is built without LIB_TAR_STATS.
+ */
+int tar_stats_snapshot(tar_index_t *idx, tar_stats_t *stats);
+
+/**
+ * Sets the statistics of an index, or of everything not done through an index, back to zero.
+ *
+ * @param idx An index, or NULL.
+ */
+void tar_stats_reset(tar_index_t *idx);
+
+/**
+ * Gives the name of a public function counted by the statistics, such as "read_file".
+ *
+ * @param function A value of enum tar_stats_function.
+ *
+ * @return the name, or NULL if the value is out of range.
+ */
+const char *tar_stats_function_name(int function);
+
+/**
+ * A context for asynchronous reads of files through an index.
+ * A context is meant to be used by a single thread; use one context per thread otherwise.
+ */
+typedef struct tar_async tar_async_t;
+
+/**
+ * A finished asynchronous read.
+ */
+typedef struct tar_async_completion {
+    void *user_data;              /* as given to tar_async_submit() */
+    ssize_t result;               /* as returned by read_file(), or -3 if reading failed */
+    size_t len;                   /* number of bytes written to dest */
+    int error;                    /* errno of the failed read when result is -3, zero otherwise */
+} tar_async_completion_t;
+
+/* Flag of tar_async_create(): use a thread pool even when io_uring is available */
+#define TAR_ASYNC_THREADS 1
+
+/**
+ * Creates a context for asynchronous reads of files through an index.
+ * Reads are performed with io_uring when the kernel allows it, and by a pool of threads otherwise.
+ *
+ * Example:
+ *  tar_async_t *ctx = tar_async_create(idx, 256, 0);
+ *  tar_async_submit(ctx, "dir/a", 0, buf_a, sizeof(buf_a), &a);
+ *  tar_async_submit(ctx, "dir/b", 0, buf_b, sizeof(buf_b), &b);
+ *  while (pending > 0) pending -= tar_async_poll(ctx, completions, 16, 1);
+ *
+ * @param idx An index, which must outlive the context.
+ * @param depth The maximum number of requests submitted and not yet returned by tar_async_poll().
+ * @param flags Zero or TAR_ASYNC_THREADS.
+ *
+ * @return a new context, or NULL on failure.
+ */
+tar_async_t *tar_async_create(tar_index_t *idx, unsigned depth, int flags);
+
+/**
+ * Submits the read of a file in the archive. The entry is located right away, the read itself is
+ * started at the latest by the next call to tar_async_poll().
+ *
+ * @param ctx A context created by tar_async_create().
+ * @param path A path to an entry in the archive to read from. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from.
+ * @param dest A destination buffer, which must stay valid until the request is returned by tar_async_poll().
+ * @param len The size of dest.
+ * @param user_data A value given back with the completion.
+ *
+ * @return zero if the request was accepted, -1 if `depth` requests are already pending.
+ */
+int tar_async_submit(tar_async_t *ctx, char *path, size_t offset, uint8_t *dest, size_t len, void *user_data);
+
+/**
+ * Collects finished requests.
+ *
+ * @param ctx A context created by tar_async_create().
+ * @param completions An array receiving the finished requests.
+ * @param max The size of completions.
+ * @param wait If non-zero and requests are pending, block until at least one of them is finished.
+ *
+ * @return the number of completions written, or -1 on failure.
+ */
+int tar_async_poll(tar_async_t *ctx, tar_async_completion_t *completions, int max, int wait);
+
+/**
+ * Releases a context, waiting for the reads still in progress.
+ *
+ * @param ctx A context created by tar_async_create(), NULL is allowed.
+ */
+void tar_async_destroy(tar_async_t *ctx);
+
+/**
+ * A writer appending entries to a ustar archive.
+ * Headers and contents are gathered in a large buffer and written with few, large (vectored) writes.
+ *
+ * Example:
+ *  tar_writer_t *writer = tar_writer_open(out_fd);
+ *  tar_writer_add_dir(writer, "dir/", 0755, mtime);
+ *  tar_writer_add_file(writer, "dir/a", data, len, 0644, mtime);
+ *  tar_writer_add_path(writer, "dir/b", "/etc/hostname");
+ *  if (tar_writer_close(writer) < 0) ...
+ */
+typedef struct tar_writer tar_writer_t;
+
+/**
+ * Starts writing an archive.
+ *
+ * @param out_fd A file descriptor open for writing, where the archive is written from its current offset.
+ *
+ * @return a new writer, or NULL on allocation failure.
+ */
+tar_writer_t *tar_writer_open(int out_fd);
+
+/**
+ * Appends a regular file whose content is in memory. Names longer than 100 bytes are split between
+ * the prefix and the name fields of the header.
+ *
+ * @return zero on success, -1 if the name does not fit in a ustar header or writing failed.
+ */
+int tar_writer_add_file(tar_writer_t *writer, const char *name, const uint8_t *data, size_t len,
+                        mode_t mode, time_t mtime);
+
+/**
+ * Appends a directory. A trailing slash is added to the name if it has none.
+ *
+ * @return zero on success, -1 if the name does not fit in a ustar header or writing failed.
+ */
+int tar_writer_add_dir(tar_writer_t *writer, const char *name, mode_t mode, time_t mtime);
+
+/**
+ * Appends a symlink.
+ *
+ * @return zero on success, -1 if the name or the target does not fit in a ustar header or writing failed.
+ */
+int tar_writer_add_symlink(tar_writer_t *writer, const char *name, const char *target, time_t mtime);
+
+/**
+ * Appends a file, directory or symlink from the file system, with its mode and modification time.
+ * A directory is added alone, without its content.
+ *
+ * @param writer A writer.
+ * @param name The name of the entry in the archive.
+ * @param path The path of the file to add.
+ *
+ * @return zero on success, -1 if the file could not be read, is of another kind, its name does not
+ *         fit in a ustar header or writing failed.
+ */
+int tar_writer_add_path(tar_writer_t *writer, const char *name, const char *path);
+
+/**
+ * Appends files, directories and symlinks from the file system like tar_writer_add_path(), in the
+ * order of the lists, while several threads stat and read the next files ahead. This hides the
+ * latency of opening and reading many small files.
+ *
+ * @param writer A writer.
+ * @param names The names of the entries in the archive.
+ * @param paths The paths of the files to add, paths[i] is added as names[i].
+ * @param count The number of entries to add.
+ * @param nb_threads The number of threads reading files, zero or less for a default suited to I/O.
+ *
+ * @return zero on success, -1 if an entry could not be added. The entries before it are in the
+ *         archive and nothing after it was written.
+ */
+int tar_writer_add_paths(tar_writer_t *writer, const char *const *names, const char *const *paths,
+                         size_t count, int nb_threads);
+
+/**
+ * Ends the archive with two zero blocks, writes what is buffered and releases the writer.
+ * The file descriptor is not closed.
+ *
+ * @param writer A writer, NULL is allowed.
+ *
+ * @return zero on success, -1 if a write failed at any point.
+ */
+int tar_writer_close(tar_writer_t *writer);
+
 #endif
@@ -1,17 +1,40 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include "lib_tar.c"
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <zlib.h>
 #include "stddef.h"
-//#include "lib_tar.h"
+#include "lib_tar.h"
 
 #define ENTRY_PATH_LEN 256
 
 /**
  * You are free to use this file to write tests for your implementation
+ *
+ * Run without arguments, the tests below build their archives in a temporary directory and check the
+ * library against them. Run with an archive, the entries at its root are listed.
  */
 
+static int nb_checks;
+static int nb_failures;
+
+#define CHECK(cond) do { \
+        nb_checks++; \
+        if (!(cond)) { \
+            nb_failures++; \
+            printf("%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+        } \
+    } while (0)
+
+static char work_dir[] = "/tmp/lib_tar_tests.XXXXXX";
+
 void debug_dump(const uint8_t *bytes, size_t len) {
     for (int i = 0; i < len;) {
         printf("%04x:  ", (int) i);
@@ -27,40 +50,1799 @@ void debug_dump(const uint8_t *bytes, size_t len) {
     }
 }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        printf("Usage: %s tar_file\n", argv[0]);
-        return -1;
+/**
+ * Gives the path of a file in the work directory. The result stays valid for the next 3 calls.
+ */
+static const char *work_path(const char *name) {
+    static char paths[4][512];
+    static int next;
+    char *path = paths[next++ % 4];
+    snprintf(path, sizeof(paths[0]), "%s/%s", work_dir, name);
+    return path;
+}
+
+static int open_work(const char *name) {
+    return open(work_path(name), O_RDONLY);
+}
+
+/*
+ * Archives are built header by header, independently of the writer of the library, so that the
+ * readers are not tested against their own idea of the format.
+ */
+
+static void raw_header(tar_header_t *header, const char *name, char typeflag, const char *linkname, uint64_t size) {
+    memset(header, 0, sizeof(tar_header_t));
+    strncpy(header->name, name, sizeof(header->name));
+    snprintf(header->mode, sizeof(header->mode), "%07o", typeflag == DIRTYPE ? 0755 : 0644);
+    snprintf(header->uid, sizeof(header->uid), "%07o", 0);
+    snprintf(header->gid, sizeof(header->gid), "%07o", 0);
+    snprintf(header->size, sizeof(header->size), "%011llo", (unsigned long long) size);
+    snprintf(header->mtime, sizeof(header->mtime), "%011o", 1600000000);
+    header->typeflag = typeflag;
+    if (linkname != NULL) strncpy(header->linkname, linkname, sizeof(header->linkname));
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+}
+
+static void raw_checksum(tar_header_t *header) {
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(tar_header_t); ++i) sum += ((const uint8_t *) header)[i];
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", sum);
+    header->chksum[7] = ' ';
+}
+
+static void raw_write(int fd, const void *data, size_t len) {
+    if (write(fd, data, len) != (ssize_t) len) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Appends a header, then the content and its padding.
+ */
+static void raw_append_header(int fd, tar_header_t *header, const void *data, size_t size) {
+    static const uint8_t zeros[512];
+    raw_checksum(header);
+    raw_write(fd, header, sizeof(tar_header_t));
+    if (size > 0) raw_write(fd, data, size);
+    if (size % 512 != 0) raw_write(fd, zeros, 512 - size % 512);
+}
+
+static void raw_append(int fd, const char *name, char typeflag, const char *linkname, const void *data, size_t size) {
+    tar_header_t header;
+    raw_header(&header, name, typeflag, linkname, size);
+    raw_append_header(fd, &header, data, size);
+}
+
+static void raw_finish(int fd) {
+    static const uint8_t zeros[1024];
+    raw_write(fd, zeros, sizeof(zeros));
+    close(fd);
+}
+
+static int raw_create(const char *name) {
+    int fd = open(work_path(name), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/*
+ * The sample archive:
+ *  dir/            sub/ c          top             link -> dir/a       chain -> link
+ *  dir/a           hard => dir/a   dirlink -> dir  dangling -> nowhere loop1 <-> loop2
+ *  dir/b (large)
+ */
+
+static const char small_content[] = "hello, world\n";
+static uint8_t large_content[100000];
+
+typedef struct expected_entry {
+    char *path;
+    int dir;
+    int file;
+    int symlink;
+} expected_entry_t;
+
+static const expected_entry_t sample_entries[] = {
+    { "dir/", 1, 0, 0 },
+    { "dir/a", 0, 1, 0 },
+    { "dir/b", 0, 1, 0 },
+    { "dir/sub/", 1, 0, 0 },
+    { "dir/sub/c", 0, 1, 0 },
+    { "top", 0, 1, 0 },
+    { "hard", 0, 0, 0 },
+    { "link", 0, 0, 1 },
+    { "chain", 0, 0, 1 },
+    { "dirlink", 0, 0, 1 },
+    { "dangling", 0, 0, 1 },
+    { "loop1", 0, 0, 1 },
+    { "loop2", 0, 0, 1 },
+};
+
+#define NB_SAMPLE_ENTRIES (sizeof(sample_entries) / sizeof(sample_entries[0]))
+
+static void make_sample(void) {
+    for (size_t i = 0; i < sizeof(large_content); ++i) large_content[i] = (uint8_t) (i * 7 % 251);
+
+    int fd = raw_create("sample.tar");
+    raw_append(fd, "dir/", DIRTYPE, NULL, NULL, 0);
+    raw_append(fd, "dir/a", REGTYPE, NULL, small_content, strlen(small_content));
+    raw_append(fd, "dir/b", REGTYPE, NULL, large_content, sizeof(large_content));
+    raw_append(fd, "dir/sub/", DIRTYPE, NULL, NULL, 0);
+    raw_append(fd, "dir/sub/c", REGTYPE, NULL, "c", 1);
+    raw_append(fd, "top", REGTYPE, NULL, "top file", 8);
+    raw_append(fd, "hard", LNKTYPE, "dir/a", NULL, 0);
+    raw_append(fd, "link", SYMTYPE, "dir/a", NULL, 0);
+    raw_append(fd, "chain", SYMTYPE, "link", NULL, 0);
+    raw_append(fd, "dirlink", SYMTYPE, "dir", NULL, 0);
+    raw_append(fd, "dangling", SYMTYPE, "nowhere", NULL, 0);
+    raw_append(fd, "loop1", SYMTYPE, "loop2", NULL, 0);
+    raw_append(fd, "loop2", SYMTYPE, "loop1", NULL, 0);
+    raw_finish(fd);
+}
+
+/*
+ * In-memory index.
+ */
+
+static void test_index(void) {
+    int fd = open_work("sample.tar");
+    tar_index_t *idx = tar_index_open(fd);
+    CHECK(idx != NULL);
+    if (idx == NULL) return;
+
+    for (size_t i = 0; i < NB_SAMPLE_ENTRIES; ++i) {
+        const expected_entry_t *e = &sample_entries[i];
+        CHECK(exists(fd, e->path) && tar_index_exists(idx, e->path));
+        CHECK(!is_dir(fd, e->path) == !e->dir && !tar_index_is_dir(idx, e->path) == !e->dir);
+        CHECK(!is_symlink(fd, e->path) == !e->symlink && !tar_index_is_symlink(idx, e->path) == !e->symlink);
+        CHECK(!is_file(fd, e->path) == !e->file && !tar_index_is_file(idx, e->path) == !e->file);
+    }
+    CHECK(!exists(fd, "nope") && !tar_index_exists(idx, "nope"));
+
+    uint8_t buf[64];
+    size_t len = sizeof(buf);
+    CHECK(tar_index_read_file(idx, "dir/a", 0, buf, &len) == 0);
+    CHECK(len == strlen(small_content) && memcmp(buf, small_content, len) == 0);
+
+    // partial reads give what is left
+    len = 4;
+    CHECK(read_file(fd, "dir/a", 2, buf, &len) == (ssize_t) strlen(small_content) - 6);
+    CHECK(len == 4 && memcmp(buf, small_content + 2, 4) == 0);
+    len = 4;
+    CHECK(tar_index_read_file(idx, "dir/a", 2, buf, &len) == (ssize_t) strlen(small_content) - 6);
+    CHECK(len == 4 && memcmp(buf, small_content + 2, 4) == 0);
+
+    uint8_t large[sizeof(large_content)];
+    len = sizeof(large);
+    CHECK(tar_index_read_file(idx, "dir/b", 0, large, &len) == 0);
+    CHECK(len == sizeof(large_content) && memcmp(large, large_content, len) == 0);
+
+    len = sizeof(buf);
+    CHECK(tar_index_read_file(idx, "dir/a", 100, buf, &len) == -2 && read_file(fd, "dir/a", 100, buf, &len) == -2);
+    len = sizeof(buf);
+    CHECK(tar_index_read_file(idx, "dir/", 0, buf, &len) == -1 && read_file(fd, "dir/", 0, buf, &len) == -1);
+    len = sizeof(buf);
+    CHECK(tar_index_read_file(idx, "nope", 0, buf, &len) == -1 && read_file(fd, "nope", 0, buf, &len) == -1);
+
+    tar_index_close(idx);
+    close(fd);
+}
+
+/*
+ * Memory-mapped index.
+ */
+
+static void test_mmap(void) {
+    int fd = open_work("sample.tar");
+    tar_index_t *idx = tar_open_mmap(fd);
+    CHECK(idx != NULL);
+    if (idx == NULL) return;
+
+    const uint8_t *data;
+    size_t len;
+    CHECK(tar_file_view(idx, "dir/b", &data, &len) == 0);
+    CHECK(len == sizeof(large_content) && memcmp(data, large_content, len) == 0);
+    CHECK(tar_file_view(idx, "chain", &data, &len) == 0);
+    CHECK(len == strlen(small_content) && memcmp(data, small_content, len) == 0);
+    CHECK(tar_file_view(idx, "dir", &data, &len) == -1);
+    CHECK(tar_file_view(idx, "dangling", &data, &len) == -1);
+
+    uint8_t buf[64];
+    len = sizeof(buf);
+    CHECK(tar_index_read_file(idx, "top", 0, buf, &len) == 0 && len == 8 && memcmp(buf, "top file", 8) == 0);
+    CHECK(tar_index_is_dir(idx, "dir/sub") && tar_index_is_symlink(idx, "dirlink"));
+    tar_index_close(idx);
+
+    // only an index built over a mapping gives views
+    idx = tar_index_open(fd);
+    CHECK(idx != NULL && tar_file_view(idx, "dir/a", &data, &len) == -2);
+    tar_index_close(idx);
+    close(fd);
+
+    fd = raw_create("empty.tar");
+    close(fd);
+    fd = open_work("empty.tar");
+    CHECK(tar_open_mmap(fd) == NULL);
+    close(fd);
+}
+
+/*
+ * Listing.
+ */
+
+static char **alloc_entries(size_t count) {
+    char **entries = malloc(count * sizeof(char *));
+    for (size_t i = 0; i < count; ++i) entries[i] = calloc(TAR_PATH_MAX, 1);
+    return entries;
+}
+
+static void free_entries(char **entries, size_t count) {
+    for (size_t i = 0; i < count; ++i) free(entries[i]);
+    free(entries);
+}
+
+/**
+ * Checks that listing `path` gives `expected`, a null-terminated array, in this order.
+ */
+static int list_is(int fd, tar_index_t *idx, char *path, const char *const *expected) {
+    size_t count = 0;
+    while (expected[count] != NULL) count++;
+    char **entries = alloc_entries(16);
+    size_t no_entries = 16;
+    int ret = idx != NULL ? tar_index_list(idx, path, entries, &no_entries) : list(fd, path, entries, &no_entries);
+
+    int same = ret != 0 && no_entries == count;
+    for (size_t i = 0; same && i < count; ++i) same = strcmp(entries[i], expected[i]) == 0;
+    free_entries(entries, 16);
+    return same;
+}
+
+static void test_list(void) {
+    static const char *const root[] = { "dir/", "top", "hard", "link", "chain", "dirlink", "dangling", "loop1", "loop2", NULL };
+    static const char *const dir[] = { "dir/a", "dir/b", "dir/sub/", NULL };
+    static const char *const sub[] = { "dir/sub/c", NULL };
+
+    int fd = open_work("sample.tar");
+    tar_index_t *idx = tar_index_open(fd);
+    // small chunks make the scans cross chunk boundaries inside headers and contents
+    for (size_t chunk = 512; chunk <= 4096; chunk *= 8) {
+        tar_set_scan_chunk_size(chunk);
+        CHECK(list_is(fd, NULL, ".", root) && list_is(fd, NULL, "./", root) && list_is(fd, NULL, "", root));
+        CHECK(list_is(fd, NULL, "dir", dir) && list_is(fd, NULL, "dir/", dir) && list_is(fd, NULL, "dirlink", dir));
+        CHECK(list_is(fd, NULL, "dir/sub", sub));
+    }
+    tar_set_scan_chunk_size(0);
+    CHECK(list_is(fd, idx, ".", root) && list_is(fd, idx, "", root));
+    CHECK(list_is(fd, idx, "dir/", dir) && list_is(fd, idx, "dirlink", dir) && list_is(fd, idx, "dir/sub", sub));
+
+    char **entries = alloc_entries(2);
+    size_t no_entries = 2;
+    CHECK(list(fd, "top", entries, &no_entries) == 0 && no_entries == 0);
+    no_entries = 2;
+    CHECK(list(fd, "nope", entries, &no_entries) == 0 && no_entries == 0);
+    no_entries = 2;
+    CHECK(list(fd, "dir", entries, &no_entries) != 0 && no_entries == 2);
+    free_entries(entries, 2);
+    tar_index_close(idx);
+    close(fd);
+
+    // an archive of the repository, listed by the harness since the start
+    fd = open("test3files.tar", O_RDONLY);
+    if (fd >= 0) {
+        static const char *const files[] = { "file1", "file2", "file3", NULL };
+        CHECK(list_is(fd, NULL, ".", files));
+        close(fd);
+    }
+}
+
+/*
+ * Header iterator.
+ */
+
+static void test_iterator(void) {
+    static const char *const links[] = { "dir/a", "dir/a", "link", "dir", "nowhere", "loop2", "loop1" };
+    int fd = open_work("sample.tar");
+    tar_iter_t iter;
+    CHECK(tar_iter_init(&iter, fd) == 0);
+
+    const tar_iter_entry_t *entry;
+    size_t n = 0;
+    uint64_t offset = 0;
+    while ((entry = tar_iter_next(&iter)) != NULL && n < NB_SAMPLE_ENTRIES) {
+        const expected_entry_t *e = &sample_entries[n];
+        CHECK(strcmp(entry->name, e->path) == 0 && entry->name_len == strlen(e->path));
+        CHECK(entry->offset == offset && entry->header->typeflag == entry->typeflag);
+        CHECK(entry->mtime == 1600000000 && entry->mode == (entry->typeflag == DIRTYPE ? 0755 : 0644));
+        if (entry->typeflag == SYMTYPE || entry->typeflag == LNKTYPE) {
+            CHECK(n >= 6 && strcmp(entry->linkname, links[n - 6]) == 0 && entry->link_len == strlen(links[n - 6]));
+        }
+        if (strcmp(e->path, "dir/b") == 0) CHECK(entry->size == sizeof(large_content));
+        offset += 512 + (entry->size + 511) / 512 * 512;
+        n++;
+    }
+    CHECK(n == NB_SAMPLE_ENTRIES && entry == NULL);
+    tar_iter_release(&iter);
+
+    // an archive cut after its first header ends the iteration without an error
+    int out = raw_create("cut.tar");
+    raw_append(out, "a", REGTYPE, NULL, "a", 1);
+    close(out);
+    int cut = open_work("cut.tar");
+    CHECK(tar_iter_init(&iter, cut) == 0);
+    CHECK((entry = tar_iter_next(&iter)) != NULL && strcmp(entry->name, "a") == 0);
+    CHECK(tar_iter_next(&iter) == NULL);
+    tar_iter_release(&iter);
+    close(cut);
+    close(fd);
+}
+
+/*
+ * Validation.
+ */
+
+/**
+ * Copies a work file and overwrites `len` bytes at `offset` in the copy.
+ */
+static void patch_copy(const char *from, const char *to, off_t offset, const void *bytes, size_t len) {
+    int in = open_work(from);
+    int out = raw_create(to);
+    uint8_t buf[65536];
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0) raw_write(out, buf, (size_t) n);
+    if (pwrite(out, bytes, len, offset) != (ssize_t) len) perror("pwrite");
+    close(in);
+    close(out);
+}
+
+static int check_work(const char *name) {
+    int fd = open_work(name);
+    int ret = check_archive(fd);
+    close(fd);
+    return ret;
+}
+
+static void test_check(void) {
+    CHECK(check_work("sample.tar") == (int) NB_SAMPLE_ENTRIES);
+
+    // the third header, after dir/ and dir/a
+    off_t third = 512 + 1024;
+    patch_copy("sample.tar", "bad_magic.tar", third + 257, "ustaR", 5);
+    CHECK(check_work("bad_magic.tar") == -1);
+    patch_copy("sample.tar", "bad_version.tar", third + 263, "10", 2);
+    CHECK(check_work("bad_version.tar") == -2);
+    patch_copy("sample.tar", "bad_checksum.tar", third + 10, "x", 1);
+    CHECK(check_work("bad_checksum.tar") == -3);
+
+    // bytes with the high bit set count as unsigned in the checksum
+    int fd = raw_create("high.tar");
+    raw_append(fd, "caf\xc3\xa9/\xff\xfe", REGTYPE, NULL, "x", 1);
+    raw_finish(fd);
+    CHECK(check_work("high.tar") == 1);
+
+    fd = raw_create("end.tar");
+    raw_finish(fd);
+    CHECK(check_work("end.tar") == 0);
+
+    tar_header_t header;
+    raw_header(&header, "a", REGTYPE, NULL, 0);
+    raw_checksum(&header);
+    CHECK(tar_check_header(&header) == 0);
+    header.version[0] = '1';
+    CHECK(tar_check_header(&header) == -2);
+}
+
+/*
+ * Parallel validation.
+ */
+
+#define NB_MANY_ENTRIES 3000
+
+static void make_many(void) {
+    int fd = raw_create("many.tar");
+    char name[32];
+    for (int i = 0; i < NB_MANY_ENTRIES; ++i) {
+        snprintf(name, sizeof(name), "d%d/f%d", i % 10, i);
+        raw_append(fd, name, REGTYPE, NULL, name, strlen(name));
+    }
+    raw_finish(fd);
+}
+
+static int check_parallel_work(const char *name, int nb_threads, int flags, uint64_t *bad_offset) {
+    int fd = open_work(name);
+    int ret = check_archive_parallel(fd, nb_threads, flags, bad_offset);
+    close(fd);
+    return ret;
+}
+
+static void test_check_parallel(void) {
+    make_many();
+    // each entry of many.tar takes two blocks, the header and its short content
+    off_t bad = 2000 * 1024;
+    patch_copy("many.tar", "many_magic.tar", bad + 257, "USTAR", 5);
+    patch_copy("many.tar", "many_checksum.tar", bad + 1, "x", 1);
+    patch_copy("many.tar", "many_version.tar", bad + 263, "10", 2);
+
+    for (int nb_threads = 0; nb_threads <= 8; nb_threads += 4) {
+        uint64_t bad_offset = 0;
+        CHECK(check_parallel_work("many.tar", nb_threads, TAR_CHECK_BOUNDS, &bad_offset) == NB_MANY_ENTRIES);
+        CHECK(check_parallel_work("sample.tar", nb_threads, 0, NULL) == (int) NB_SAMPLE_ENTRIES);
+        CHECK(check_parallel_work("many_magic.tar", nb_threads, 0, &bad_offset) == -1 && bad_offset == (uint64_t) bad);
+        bad_offset = 0;
+        CHECK(check_parallel_work("many_version.tar", nb_threads, 0, &bad_offset) == -2 && bad_offset == (uint64_t) bad);
+        bad_offset = 0;
+        CHECK(check_parallel_work("many_checksum.tar", nb_threads, 0, &bad_offset) == -3 && bad_offset == (uint64_t) bad);
+        CHECK(check_parallel_work("bad_checksum.tar", nb_threads, 0, NULL) == check_work("bad_checksum.tar"));
+    }
+
+    // the content of the last entry runs past the end of the file
+    int fd = raw_create("short.tar");
+    raw_append(fd, "a", REGTYPE, NULL, "a", 1);
+    tar_header_t header;
+    raw_header(&header, "b", REGTYPE, NULL, 100000);
+    raw_checksum(&header);
+    raw_write(fd, &header, sizeof(header));
+    close(fd);
+    uint64_t bad_offset = 0;
+    CHECK(check_parallel_work("short.tar", 2, TAR_CHECK_BOUNDS, &bad_offset) == -4 && bad_offset == 1024);
+    CHECK(check_parallel_work("short.tar", 2, 0, NULL) == 2);
+
+    // headers close together are read at once, those after a large content on their own
+    static char big[300000];
+    fd = raw_create("spread.tar");
+    off_t at = 0, bad_at = 0;
+    for (int i = 0; i < 600; ++i) {
+        char name[16];
+        size_t size = i % 50 == 7 ? sizeof(big) : 10;
+        snprintf(name, sizeof(name), "f%d", i);
+        if (i == 558) bad_at = at;
+        raw_append(fd, name, REGTYPE, NULL, big, size);
+        at += 512 + (off_t) ((size + 511) / 512 * 512);
+    }
+    raw_finish(fd);
+    patch_copy("spread.tar", "spread_checksum.tar", bad_at + 1, "x", 1);
+    for (int nb_threads = 1; nb_threads <= 3; nb_threads++) {
+        CHECK(check_parallel_work("spread.tar", nb_threads, TAR_CHECK_BOUNDS, NULL) == 600);
+        bad_offset = 0;
+        CHECK(check_parallel_work("spread_checksum.tar", nb_threads, 0, &bad_offset) == -3 && bad_offset == (uint64_t) bad_at);
+    }
+}
+
+/**
+ * Pages through a directory and checks the pages add up to a full listing.
+ */
+static int pages_match(tar_index_t *idx, char *path, size_t page_size) {
+    char **all = alloc_entries(64);
+    char **page = alloc_entries(page_size);
+    size_t no_all = 64;
+    int ok = tar_index_list(idx, path, all, &no_all) != 0;
+    size_t cursor = 0, listed = 0, nb_pages = 0;
+    do {
+        size_t no_entries = page_size;
+        if (!tar_index_list_page(idx, path, page, &no_entries, &cursor) || no_entries > page_size) {
+            ok = 0;
+            break;
+        }
+        for (size_t i = 0; i < no_entries; i++, listed++) {
+            if (listed >= no_all || strcmp(page[i], all[listed]) != 0)
+                ok = 0;
+        }
+    } while (cursor != 0 && ++nb_pages < 100);
+    free_entries(page, page_size);
+    free_entries(all, 64);
+    return ok && cursor == 0 && listed == no_all;
+}
+
+static void test_index_list_page(void) {
+    int fd = raw_create("wide.tar");
+    raw_append(fd, "w/", DIRTYPE, NULL, NULL, 0);
+    char name[32];
+    for (int i = 0; i < 40; i++) {
+        snprintf(name, sizeof(name), "w/f%02d", i);
+        raw_append(fd, name, REGTYPE, NULL, name, strlen(name));
+    }
+    raw_append(fd, "w/s/", DIRTYPE, NULL, NULL, 0);
+    raw_append(fd, "w/s/x", REGTYPE, NULL, "x", 1);
+    raw_finish(fd);
+
+    fd = open_work("wide.tar");
+    tar_index_t *idx = tar_index_open(fd);
+    char **entries = alloc_entries(64);
+    size_t no_entries = 64;
+    CHECK(tar_index_list(idx, "w", entries, &no_entries) != 0 && no_entries == 41);
+    CHECK(strcmp(entries[0], "w/f00") == 0 && strcmp(entries[40], "w/s/") == 0);
+    free_entries(entries, 64);
+    static const size_t page_sizes[] = { 1, 3, 7, 40, 41, 64 };
+    for (size_t i = 0; i < sizeof(page_sizes) / sizeof(page_sizes[0]); i++) {
+        CHECK(pages_match(idx, "w/", page_sizes[i]));
+        CHECK(pages_match(idx, "", page_sizes[i]));
+    }
+    // a page on something that is not a directory lists nothing
+    entries = alloc_entries(4);
+    size_t cursor = 0;
+    no_entries = 4;
+    CHECK(tar_index_list_page(idx, "w/f00", entries, &no_entries, &cursor) == 0 && no_entries == 0);
+    no_entries = 4;
+    CHECK(tar_index_list_page(idx, "nope", entries, &no_entries, &cursor) == 0 && no_entries == 0);
+    free_entries(entries, 4);
+    tar_index_close(idx);
+    close(fd);
+
+    fd = open_work("sample.tar");
+    idx = tar_index_open(fd);
+    CHECK(pages_match(idx, ".", 2) && pages_match(idx, "dirlink", 1) && pages_match(idx, "dir/sub", 1));
+    tar_index_close(idx);
+    close(fd);
+}
+
+/**
+ * Reads a whole small file through both read paths and compares it with the expected content.
+ */
+static int reads_as(int fd, tar_index_t *idx, char *path, const char *expected) {
+    uint8_t buf[64];
+    size_t len = sizeof(buf);
+    if (read_file(fd, path, 0, buf, &len) != 0 || len != strlen(expected) || memcmp(buf, expected, len) != 0)
+        return 0;
+    len = sizeof(buf);
+    return tar_index_read_file(idx, path, 0, buf, &len) == 0 && len == strlen(expected) && memcmp(buf, expected, len) == 0;
+}
+
+static void test_links(void) {
+    int fd = open_work("sample.tar");
+    tar_index_t *idx = tar_index_open(fd);
+    // links, chains of links, and hard links all read as their final target
+    CHECK(reads_as(fd, idx, "link", small_content) && reads_as(fd, idx, "chain", small_content));
+    CHECK(reads_as(fd, idx, "hard", small_content));
+    CHECK(is_symlink(fd, "chain") && !is_symlink(fd, "hard") && tar_index_is_symlink(idx, "chain"));
+    CHECK(is_dir(fd, "dirlink") == 0 && tar_index_is_dir(idx, "dirlink") == 0);
+
+    // dangling links and loops resolve to nothing
+    uint8_t buf[16];
+    size_t len = sizeof(buf);
+    CHECK(read_file(fd, "dangling", 0, buf, &len) == -1);
+    len = sizeof(buf);
+    CHECK(tar_index_read_file(idx, "dangling", 0, buf, &len) == -1);
+    len = sizeof(buf);
+    CHECK(read_file(fd, "loop1", 0, buf, &len) == -1);
+    len = sizeof(buf);
+    CHECK(tar_index_read_file(idx, "loop2", 0, buf, &len) == -1);
+    char **entries = alloc_entries(4);
+    size_t no_entries = 4;
+    CHECK(list(fd, "loop1", entries, &no_entries) == 0);
+    no_entries = 4;
+    CHECK(tar_index_list(idx, "dangling", entries, &no_entries) == 0);
+    free_entries(entries, 4);
+    tar_index_close(idx);
+    close(fd);
+
+    // relative targets are taken from the directory holding the link
+    fd = raw_create("links.tar");
+    raw_append(fd, "p/", DIRTYPE, NULL, NULL, 0);
+    raw_append(fd, "p/q/", DIRTYPE, NULL, NULL, 0);
+    raw_append(fd, "p/q/f", REGTYPE, NULL, "deep", 4);
+    raw_append(fd, "p/up", SYMTYPE, "q/f", NULL, 0);
+    raw_append(fd, "p/q/back", SYMTYPE, "../up", NULL, 0);
+    raw_append(fd, "p/q/self", SYMTYPE, "./f", NULL, 0);
+    raw_finish(fd);
+    fd = open_work("links.tar");
+    idx = tar_index_open(fd);
+    CHECK(reads_as(fd, idx, "p/up", "deep") && reads_as(fd, idx, "p/q/back", "deep"));
+    CHECK(reads_as(fd, idx, "p/q/self", "deep"));
+    tar_index_close(idx);
+    close(fd);
+}
+
+typedef struct {
+    int fd;
+    tar_index_t *idx;
+    int first;
+    int nb_bad;
+} reader_arg_t;
+
+/**
+ * Reads a stripe of the entries of many.tar, through the descriptor and through the index.
+ */
+static void *reader_thread(void *arg) {
+    reader_arg_t *reader = arg;
+    char name[32];
+    uint8_t buf[32];
+    for (int i = reader->first; i < NB_MANY_ENTRIES; i += 97) {
+        snprintf(name, sizeof(name), "d%d/f%d", i % 10, i);
+        size_t len = sizeof(buf);
+        if (read_file(reader->fd, name, 0, buf, &len) != 0 || len != strlen(name) || memcmp(buf, name, len) != 0)
+            reader->nb_bad++;
+        len = sizeof(buf);
+        if (tar_index_read_file(reader->idx, name, 0, buf, &len) != 0 || len != strlen(name) || memcmp(buf, name, len) != 0)
+            reader->nb_bad++;
+    }
+    return NULL;
+}
+
+static void test_concurrent_reads(void) {
+    int fd = open_work("many.tar");
+    tar_index_t *idx = tar_index_open(fd);
+    pthread_t threads[8];
+    reader_arg_t readers[8];
+    for (int i = 0; i < 8; i++) {
+        readers[i] = (reader_arg_t) { fd, idx, i, 0 };
+        pthread_create(&threads[i], NULL, reader_thread, &readers[i]);
+    }
+    int nb_bad = 0;
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+        nb_bad += readers[i].nb_bad;
+    }
+    CHECK(nb_bad == 0);
+    // the shared descriptor was never moved
+    CHECK(lseek(fd, 0, SEEK_CUR) == 0);
+    tar_index_close(idx);
+    close(fd);
+}
+
+static void test_bench_gen(void) {
+    // the generator is built next to the tests by `make test`
+    if (access("./bench_gen", X_OK) != 0) return;
+    char command[256];
+    snprintf(command, sizeof(command), "./bench_gen -n 500 -d 3 -f 4 -l 0.2 -s 0 -S 5000 -r 7 -o %s",
+             work_path("bench.tar"));
+    CHECK(system(command) == 0);
+
+    int fd = open_work("bench.tar");
+    CHECK(check_archive(fd) > 0);
+    tar_index_t *idx = tar_index_open(fd);
+    tar_iter_t iter;
+    const tar_iter_entry_t *entry;
+    int nb_links = 0, nb_bad = 0;
+    tar_iter_init(&iter, fd);
+    while ((entry = tar_iter_next(&iter)) != NULL) {
+        if (entry->typeflag != SYMTYPE) continue;
+        // every generated link leads to a file written before it
+        tar_stat_t st;
+        nb_links++;
+        if (!tar_index_is_symlink(idx, (char *) entry->name)
+            || !tar_lookup(fd, entry->name, TAR_LOOKUP_FOLLOW, &st) || st.typeflag != REGTYPE
+            || st.offset >= entry->offset)
+            nb_bad++;
+    }
+    tar_iter_release(&iter);
+    CHECK(nb_links > 0 && nb_bad == 0);
+    tar_index_close(idx);
+    close(fd);
+}
+
+/**
+ * Saves the index of an archive to a sidecar next to it.
+ */
+static void save_sidecar(const char *archive, const char *sidecar) {
+    int fd = open_work(archive);
+    tar_index_t *idx = tar_index_open(fd);
+    int out = raw_create(sidecar);
+    CHECK(idx != NULL && tar_index_save(idx, out) == 0);
+    close(out);
+    tar_index_close(idx);
+    close(fd);
+}
+
+/**
+ * Loads a sidecar against an archive, returns whether it was accepted.
+ */
+static int sidecar_loads(const char *archive, const char *sidecar) {
+    int fd = open_work(archive);
+    int in = open_work(sidecar);
+    tar_index_t *idx = tar_index_load(fd, in);
+    close(in);
+    int loaded = idx != NULL;
+    if (idx != NULL) {
+        // a sidecar which is accepted must be usable, whatever its content
+        char **entries = alloc_entries(16);
+        size_t no_entries = 16;
+        uint8_t buf[64];
+        size_t len = sizeof(buf);
+        tar_index_list(idx, "dir", entries, &no_entries);
+        tar_index_read_file(idx, "chain", 0, buf, &len);
+        free_entries(entries, 16);
+        tar_index_close(idx);
+    }
+    close(fd);
+    return loaded;
+}
+
+static void test_sidecar(void) {
+    save_sidecar("sample.tar", "sample.idx");
+    int fd = open_work("sample.tar");
+    int in = open_work("sample.idx");
+    tar_index_t *idx = tar_index_load(fd, in);
+    close(in);
+    CHECK(idx != NULL);
+    if (idx == NULL) return;
+    for (size_t i = 0; i < NB_SAMPLE_ENTRIES; ++i) {
+        const expected_entry_t *e = &sample_entries[i];
+        CHECK(tar_index_exists(idx, e->path));
+        CHECK(!tar_index_is_dir(idx, e->path) == !e->dir && !tar_index_is_file(idx, e->path) == !e->file);
+        CHECK(!tar_index_is_symlink(idx, e->path) == !e->symlink);
+    }
+    static const char *const dir[] = { "dir/a", "dir/b", "dir/sub/", NULL };
+    CHECK(list_is(fd, idx, "dirlink", dir));
+    uint8_t large[sizeof(large_content)];
+    size_t len = sizeof(large);
+    CHECK(tar_index_read_file(idx, "dir/b", 0, large, &len) == 0 && memcmp(large, large_content, len) == 0);
+    len = sizeof(large);
+    CHECK(tar_index_read_file(idx, "chain", 0, large, &len) == 0 && memcmp(large, small_content, len) == 0);
+    tar_index_close(idx);
+    close(fd);
+
+    // truncated sidecars are refused
+    struct stat st;
+    stat(work_path("sample.idx"), &st);
+    int nb_loaded = 0;
+    for (off_t size = 0; size < st.st_size; size += size < 256 ? 8 : 509) {
+        patch_copy("sample.idx", "cut.idx", 0, NULL, 0);
+        truncate(work_path("cut.idx"), size);
+        nb_loaded += sidecar_loads("sample.tar", "cut.idx");
+    }
+    CHECK(nb_loaded == 0);
+    // corrupted sidecars are refused or still safe to use
+    for (off_t offset = 0; offset < st.st_size; offset += 7) {
+        uint8_t byte = 0xff;
+        patch_copy("sample.idx", "flip.idx", offset, &byte, 1);
+        sidecar_loads("sample.tar", "flip.idx");
+    }
+
+    // a sidecar is not used for another archive nor once its archive changed
+    CHECK(!sidecar_loads("many.tar", "sample.idx"));
+    patch_copy("sample.tar", "stale.tar", 0, NULL, 0);
+    save_sidecar("stale.tar", "stale.idx");
+    CHECK(sidecar_loads("stale.tar", "stale.idx"));
+    int out = open(work_path("stale.tar"), O_WRONLY | O_APPEND);
+    raw_write(out, large_content, 512);
+    close(out);
+    CHECK(!sidecar_loads("stale.tar", "stale.idx"));
+}
+
+/**
+ * Reads a whole extracted file and compares it with the expected content.
+ */
+static int extracted_as(const char *path, const void *expected, size_t len) {
+    static uint8_t buf[sizeof(large_content) + 1];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    return n == (ssize_t) len && memcmp(buf, expected, len) == 0;
+}
+
+static void test_extract(void) {
+    int fd = open_work("sample.tar");
+    CHECK(tar_extract(fd, work_path("out")) == (int) NB_SAMPLE_ENTRIES);
+    close(fd);
+
+    char path[PATH_MAX], target[64];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/dir/a", work_path("out"));
+    CHECK(extracted_as(path, small_content, strlen(small_content)));
+    CHECK(stat(path, &st) == 0 && (st.st_mode & 07777) == 0644 && st.st_mtime == 1600000000);
+    ino_t inode = st.st_ino;
+    snprintf(path, sizeof(path), "%s/dir/b", work_path("out"));
+    CHECK(extracted_as(path, large_content, sizeof(large_content)));
+    snprintf(path, sizeof(path), "%s/dir/sub", work_path("out"));
+    CHECK(stat(path, &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & 07777) == 0755);
+    snprintf(path, sizeof(path), "%s/hard", work_path("out"));
+    CHECK(lstat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_ino == inode);
+    snprintf(path, sizeof(path), "%s/chain", work_path("out"));
+    ssize_t n = readlink(path, target, sizeof(target));
+    CHECK(n == 4 && memcmp(target, "link", 4) == 0);
+    CHECK(extracted_as(path, small_content, strlen(small_content)));
+    snprintf(path, sizeof(path), "%s/dangling", work_path("out"));
+    CHECK(lstat(path, &st) == 0 && S_ISLNK(st.st_mode));
+
+    // extracting again overwrites
+    fd = open_work("sample.tar");
+    CHECK(tar_extract(fd, work_path("out")) == (int) NB_SAMPLE_ENTRIES);
+    close(fd);
+
+    // nothing is written outside of the destination, even through a symlink it extracted itself
+    mkdir(work_path("victim"), 0755);
+    fd = raw_create("escape.tar");
+    raw_append(fd, "x", SYMTYPE, "../victim", NULL, 0);
+    raw_append(fd, "x/", DIRTYPE, NULL, NULL, 0);
+    raw_append(fd, "x/evil", REGTYPE, NULL, "evil", 4);
+    raw_append(fd, "../evil", REGTYPE, NULL, "evil", 4);
+    raw_append(fd, "/tmp/evil", REGTYPE, NULL, "evil", 4);
+    raw_append(fd, "ok", REGTYPE, NULL, "ok", 2);
+    raw_finish(fd);
+    fd = open_work("escape.tar");
+    tar_extract(fd, work_path("jail"));
+    close(fd);
+    CHECK(stat(work_path("victim"), &st) == 0 && (st.st_mode & 07777) == 0755);
+    snprintf(path, sizeof(path), "%s/evil", work_path("victim"));
+    CHECK(access(path, F_OK) != 0 && access(work_path("evil"), F_OK) != 0);
+    snprintf(path, sizeof(path), "%s/ok", work_path("jail"));
+    CHECK(extracted_as(path, "ok", 2));
+}
+
+#define NB_ASYNC_READS 200
+
+static void test_async(void) {
+    int fd = open_work("many.tar");
+    tar_index_t *idx = tar_index_open(fd);
+    static const int modes[] = { 0, TAR_ASYNC_THREADS };
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        tar_async_t *ctx = tar_async_create(idx, 16, modes[m]);
+        CHECK(ctx != NULL);
+        if (ctx == NULL) continue;
+        static uint8_t bufs[NB_ASYNC_READS][32];
+        tar_async_completion_t completions[8];
+        int submitted = 0, pending = 0, nb_bad = 0;
+        char name[32];
+        while (submitted < NB_ASYNC_READS || pending > 0) {
+            // fill the queue, then collect whatever is finished
+            while (submitted < NB_ASYNC_READS) {
+                int i = submitted;
+                snprintf(name, sizeof(name), "d%d/f%d", (i * 13) % 10, i * 13);
+                if (i % 50 == 49) snprintf(name, sizeof(name), "nope%d", i);
+                if (tar_async_submit(ctx, name, 0, bufs[i], sizeof(bufs[i]), (void *) (intptr_t) i) != 0) break;
+                submitted++;
+                pending++;
+            }
+            int n = tar_async_poll(ctx, completions, 8, 1);
+            if (n <= 0) break;
+            for (int c = 0; c < n; c++) {
+                int i = (int) (intptr_t) completions[c].user_data;
+                snprintf(name, sizeof(name), "d%d/f%d", (i * 13) % 10, i * 13);
+                uint8_t expected[32];
+                size_t len = sizeof(expected);
+                ssize_t result = i % 50 == 49 ? -1 : tar_index_read_file(idx, name, 0, expected, &len);
+                if (completions[c].result != result || completions[c].error != 0
+                    || (result == 0 && (completions[c].len != len || memcmp(bufs[i], expected, len) != 0)))
+                    nb_bad++;
+            }
+            pending -= n;
+        }
+        CHECK(submitted == NB_ASYNC_READS && pending == 0 && nb_bad == 0);
+
+        // partial reads report what is left, as read_file() does
+        uint8_t buf[10];
+        tar_async_completion_t completion;
+        CHECK(tar_async_submit(ctx, "d3/f3", 1, buf, 2, NULL) == 0);
+        CHECK(tar_async_poll(ctx, &completion, 1, 1) == 1);
+        CHECK(completion.result == 2 && completion.len == 2 && memcmp(buf, "3/", 2) == 0);
+        tar_async_destroy(ctx);
+    }
+    tar_index_close(idx);
+
+    // a descriptor that cannot be read makes every read fail, with its errno
+    idx = tar_index_open(fd);
+    int write_only = open(work_path("many.tar"), O_WRONLY);
+    dup2(write_only, fd);
+    close(write_only);
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        tar_async_t *ctx = tar_async_create(idx, 4, modes[m]);
+        uint8_t buf[32];
+        tar_async_completion_t completion;
+        CHECK(ctx != NULL && tar_async_submit(ctx, "d0/f0", 0, buf, sizeof(buf), NULL) == 0);
+        CHECK(tar_async_poll(ctx, &completion, 1, 1) == 1);
+        CHECK(completion.result == -3 && completion.error == EBADF);
+        tar_async_destroy(ctx);
+    }
+    tar_index_close(idx);
+    close(fd);
+}
+
+static void test_writer(void) {
+    char long_dir[128], long_name[160], too_long[300];
+    memset(long_dir, 'd', 120);
+    long_dir[120] = '\0';
+    snprintf(long_name, sizeof(long_name), "w/%s/file", long_dir);
+    memset(too_long, 'x', sizeof(too_long) - 1);
+    too_long[sizeof(too_long) - 1] = '\0';
+    int in = raw_create("on_disk");
+    raw_write(in, "from the disk", 13);
+    close(in);
+    chmod(work_path("on_disk"), 0600);
+
+    int out = raw_create("written.tar");
+    tar_writer_t *writer = tar_writer_open(out);
+    CHECK(writer != NULL);
+    if (writer == NULL) return;
+    CHECK(tar_writer_add_dir(writer, "w", 0750, 1600000000) == 0);
+    CHECK(tar_writer_add_file(writer, "w/large", large_content, sizeof(large_content), 0640, 1600000000) == 0);
+    CHECK(tar_writer_add_file(writer, "w/empty", NULL, 0, 0644, 1600000000) == 0);
+    CHECK(tar_writer_add_file(writer, "w/old", (const uint8_t *) "old", 3, 0644, -1000) == 0);
+    CHECK(tar_writer_add_file(writer, long_name, (const uint8_t *) "long", 4, 0644, 1600000000) == 0);
+    CHECK(tar_writer_add_symlink(writer, "w/link", "large", 1600000000) == 0);
+    CHECK(tar_writer_add_path(writer, "w/disk", work_path("on_disk")) == 0);
+    // names that fit in no ustar header are refused without breaking the archive
+    CHECK(tar_writer_add_file(writer, too_long, (const uint8_t *) "x", 1, 0644, 0) == -1);
+    CHECK(tar_writer_add_file(writer, too_long + 150, (const uint8_t *) "x", 1, 0644, 0) == -1);
+    CHECK(tar_writer_add_symlink(writer, "w/bad", too_long, 0) == -1);
+    CHECK(tar_writer_add_path(writer, "w/none", work_path("none")) == -1);
+    CHECK(tar_writer_close(writer) == 0);
+    close(out);
+
+    int fd = open_work("written.tar");
+    CHECK(check_archive(fd) == 7);
+    static const char *const w[] = { "w/large", "w/empty", "w/old", "w/link", "w/disk", NULL };
+    CHECK(list_is(fd, NULL, "w", w));
+    tar_stat_t st;
+    CHECK(tar_lookup(fd, "w", 0, &st) && st.typeflag == DIRTYPE && st.mode == 0750);
+    CHECK(tar_lookup(fd, "w/old", 0, &st) && st.mtime == -1000);
+    CHECK(tar_lookup(fd, "w/disk", 0, &st) && st.mode == 0600 && st.size == 13);
+    CHECK(tar_lookup(fd, long_name, 0, &st) && st.size == 4);
+    CHECK(tar_lookup(fd, "w/link", TAR_LOOKUP_FOLLOW, &st) && st.size == sizeof(large_content));
+    static uint8_t large[sizeof(large_content)];
+    size_t len = sizeof(large);
+    CHECK(read_file(fd, "w/link", 0, large, &len) == 0 && len == sizeof(large) && memcmp(large, large_content, len) == 0);
+    len = sizeof(large);
+    CHECK(read_file(fd, "w/disk", 0, large, &len) == 0 && len == 13 && memcmp(large, "from the disk", 13) == 0);
+    len = sizeof(large);
+    CHECK(read_file(fd, "w/empty", 0, large, &len) == 0 && len == 0);
+    close(fd);
+}
+
+#define NB_PACKED_FILES 200
+
+/**
+ * Packs the files of the source directory with tar_writer_add_paths(), returns what it returned.
+ */
+static int pack_work(const char *archive, const char *const *names, const char *const *paths, size_t count,
+                     int nb_threads) {
+    int out = raw_create(archive);
+    tar_writer_t *writer = tar_writer_open(out);
+    int ret = tar_writer_add_paths(writer, names, paths, count, nb_threads);
+    if (tar_writer_close(writer) < 0) ret = -2;
+    close(out);
+    return ret;
+}
+
+static void test_pack(void) {
+    static char names[NB_PACKED_FILES][32], paths[NB_PACKED_FILES][PATH_MAX];
+    const char *name_list[NB_PACKED_FILES], *path_list[NB_PACKED_FILES];
+    mkdir(work_path("src"), 0755);
+    for (int i = 0; i < NB_PACKED_FILES; i++) {
+        snprintf(names[i], sizeof(names[i]), "f%03d", i);
+        snprintf(paths[i], sizeof(paths[i]), "%s/%s", work_path("src"), names[i]);
+        int fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        // sizes vary so that the reads finish out of order
+        raw_write(fd, large_content + i, (size_t) (i * 331) % 5000);
+        close(fd);
+        name_list[i] = names[i];
+        path_list[i] = paths[i];
+    }
+
+    static const int threads[] = { 1, 4, 0 };
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        CHECK(pack_work("packed.tar", name_list, path_list, NB_PACKED_FILES, threads[t]) == 0);
+        int fd = open_work("packed.tar");
+        tar_iter_t iter;
+        const tar_iter_entry_t *entry;
+        int n = 0, nb_bad = 0;
+        uint8_t buf[5000];
+        tar_iter_init(&iter, fd);
+        while ((entry = tar_iter_next(&iter)) != NULL) {
+            size_t len = sizeof(buf);
+            // the entries come in the order of the lists, with their content
+            if (n >= NB_PACKED_FILES || strcmp(entry->name, names[n]) != 0
+                || read_file(fd, names[n], 0, buf, &len) != 0 || len != (size_t) (n * 331) % 5000
+                || memcmp(buf, large_content + n, len) != 0)
+                nb_bad++;
+            n++;
+        }
+        tar_iter_release(&iter);
+        CHECK(n == NB_PACKED_FILES && nb_bad == 0);
+        close(fd);
+    }
+
+    // a file that cannot be read stops the archive right before it
+    path_list[120] = work_path("none");
+    CHECK(pack_work("packed.tar", name_list, path_list, NB_PACKED_FILES, 4) == -1);
+    int fd = open_work("packed.tar");
+    CHECK(check_archive(fd) == 120 && exists(fd, "f119") && !exists(fd, "f121"));
+    close(fd);
+}
+
+/**
+ * Compresses an archive of the working directory with gzip, in as many members as given.
+ */
+static void gzip_work(const char *from, const char *to, int nb_members) {
+    int in = open_work(from);
+    struct stat st;
+    fstat(in, &st);
+    uint8_t *data = malloc((size_t) st.st_size);
+    ssize_t n = read(in, data, (size_t) st.st_size);
+    close(in);
+    close(raw_create(to));
+    off_t member = st.st_size / nb_members + 1;
+    for (off_t start = 0; n > 0 && start < st.st_size; start += member) {
+        gzFile out = gzopen(work_path(to), "ab");
+        size_t len = (size_t) (st.st_size - start < member ? st.st_size - start : member);
+        gzwrite(out, data + start, (unsigned) len);
+        gzclose(out);
+    }
+    free(data);
+}
+
+static void test_gzip(void) {
+    gzip_work("sample.tar", "sample.tar.gz", 1);
+    gzip_work("sample.tar", "members.tar.gz", 3);
+    gzip_work("many.tar", "many.tar.gz", 1);
+
+    static const char *const archives[] = { "sample.tar.gz", "members.tar.gz" };
+    for (size_t a = 0; a < sizeof(archives) / sizeof(archives[0]); a++) {
+        int fd = open_work(archives[a]);
+        CHECK(check_archive(fd) == (int) NB_SAMPLE_ENTRIES);
+        static const char *const dir[] = { "dir/a", "dir/b", "dir/sub/", NULL };
+        CHECK(list_is(fd, NULL, "dirlink", dir));
+        tar_index_t *idx = tar_index_open(fd);
+        CHECK(idx != NULL && list_is(fd, idx, "dir", dir));
+        for (size_t i = 0; i < NB_SAMPLE_ENTRIES; ++i) {
+            const expected_entry_t *e = &sample_entries[i];
+            CHECK(!is_dir(fd, e->path) == !e->dir && !tar_index_is_file(idx, e->path) == !e->file);
+        }
+        static uint8_t large[sizeof(large_content)];
+        size_t len = 1000;
+        CHECK(read_file(fd, "dir/b", 50000, large, &len) > 0 && memcmp(large, large_content + 50000, len) == 0);
+        len = sizeof(large);
+        CHECK(tar_index_read_file(idx, "dir/b", 0, large, &len) == 0 && memcmp(large, large_content, len) == 0);
+        CHECK(reads_as(fd, idx, "chain", small_content));
+        tar_index_close(idx);
+
+        // a compressed archive cannot be mapped, it is indexed instead
+        idx = tar_open_mmap(fd);
+        const uint8_t *data;
+        CHECK(idx != NULL && tar_file_view(idx, "dir/a", &data, &len) == -2);
+        CHECK(reads_as(fd, idx, "dir/a", small_content));
+        tar_index_close(idx);
+        close(fd);
+    }
+
+    // random reads past several checkpoints, backwards
+    int fd = open_work("many.tar.gz");
+    CHECK(check_archive_parallel(fd, 4, 0, NULL) == NB_MANY_ENTRIES);
+    tar_index_t *idx = tar_index_open(fd);
+    int nb_bad = 0;
+    for (int i = NB_MANY_ENTRIES - 1; i >= 0; i -= 37) {
+        char name[32];
+        snprintf(name, sizeof(name), "d%d/f%d", i % 10, i);
+        nb_bad += !reads_as(fd, idx, name, name);
+        i -= i % 3 == 0 ? 400 : 0;
+    }
+    CHECK(nb_bad == 0);
+    tar_index_close(idx);
+    close(fd);
+}
+
+typedef struct {
+    const char *archive;
+    size_t limit;                 /* number of bytes of the archive written to the pipe */
+    int out;
+} feeder_arg_t;
+
+/**
+ * Writes an archive to a pipe in small uneven chunks, as a slow producer would.
+ */
+static void *feeder_thread(void *arg) {
+    feeder_arg_t *feeder = arg;
+    int in = open_work(feeder->archive);
+    uint8_t buf[777];
+    size_t total = 0;
+    ssize_t n;
+    while (total < feeder->limit && (n = read(in, buf, sizeof(buf) - total % 5)) > 0) {
+        if ((size_t) n > feeder->limit - total) n = (ssize_t) (feeder->limit - total);
+        if (write(feeder->out, buf, (size_t) n) != n) break;
+        total += (size_t) n;
+    }
+    close(in);
+    close(feeder->out);
+    return NULL;
+}
+
+typedef struct {
+    int nb_headers;
+    int stop_at;                  /* header number where the visitor stops, or -1 */
+    int bad_names;
+    size_t nb_data;
+    uint8_t data[sizeof(large_content)];
+} stream_state_t;
+
+static int stream_header(void *arg, const tar_iter_entry_t *entry) {
+    stream_state_t *state = arg;
+    if (state->nb_headers == state->stop_at) return -1;
+    if ((size_t) state->nb_headers >= NB_SAMPLE_ENTRIES
+        || strcmp(entry->name, sample_entries[state->nb_headers].path) != 0)
+        state->bad_names++;
+    state->nb_headers++;
+    return strcmp(entry->name, "dir/b") == 0;
+}
+
+static int stream_data(void *arg, const uint8_t *data, size_t len) {
+    stream_state_t *state = arg;
+    if (state->nb_data + len > sizeof(state->data)) return -1;
+    memcpy(state->data + state->nb_data, data, len);
+    state->nb_data += len;
+    return 0;
+}
+
+/**
+ * Streams an archive of the working directory through a pipe.
+ */
+static int stream_work(const char *archive, size_t limit, stream_state_t *state) {
+    int fds[2];
+    if (pipe(fds) < 0) return -100;
+    feeder_arg_t feeder = { archive, limit, fds[1] };
+    pthread_t thread;
+    pthread_create(&thread, NULL, feeder_thread, &feeder);
+    tar_visitor_t visitor = { stream_header, stream_data, state };
+    int ret = tar_stream(fds[0], &visitor);
+    close(fds[0]);
+    pthread_join(thread, NULL);
+    return ret;
+}
+
+static void test_stream(void) {
+    // the feeder may be left writing to a pipe nobody reads anymore
+    signal(SIGPIPE, SIG_IGN);
+    static stream_state_t state;
+    state = (stream_state_t) { .stop_at = -1 };
+    CHECK(stream_work("sample.tar", SIZE_MAX, &state) == (int) NB_SAMPLE_ENTRIES);
+    CHECK(state.nb_headers == (int) NB_SAMPLE_ENTRIES && state.bad_names == 0);
+    CHECK(state.nb_data == sizeof(large_content) && memcmp(state.data, large_content, state.nb_data) == 0);
+
+    state = (stream_state_t) { .stop_at = 3 };
+    CHECK(stream_work("sample.tar", SIZE_MAX, &state) == -5 && state.nb_headers == 3);
+    // a stream that ends inside the content of dir/b
+    state = (stream_state_t) { .stop_at = -1 };
+    CHECK(stream_work("sample.tar", 512 * 5 + 20000, &state) == -4 && state.nb_headers == 3);
+    // a stream that ends partway through the header of dir/b, and one that ends right before it
+    state = (stream_state_t) { .stop_at = -1 };
+    CHECK(stream_work("sample.tar", 512 * 3 + 100, &state) == -4 && state.nb_headers == 2);
+    state = (stream_state_t) { .stop_at = -1 };
+    CHECK(stream_work("sample.tar", 512 * 3, &state) == 2 && state.nb_headers == 2);
+    state = (stream_state_t) { .stop_at = -1 };
+    CHECK(stream_work("bad_checksum.tar", SIZE_MAX, &state) == -3);
+
+    // a visitor without callbacks only checks the archive
+    int fd = open_work("many.tar");
+    tar_visitor_t visitor = { NULL, NULL, NULL };
+    CHECK(tar_stream(fd, &visitor) == NB_MANY_ENTRIES);
+    close(fd);
+}
+
+/**
+ * Appends a PAX record, "<length> <key>=<value>\n" where the length counts the whole record.
+ */
+static size_t pax_record(char *records, size_t used, const char *key, const char *value) {
+    size_t len = strlen(key) + strlen(value) + 3;
+    size_t digits = 1;
+    for (size_t n = len; n >= 10; n /= 10) digits++;
+    if (len + digits >= (digits == 1 ? 10 : digits == 2 ? 100 : 1000)) digits++;
+    return used + (size_t) sprintf(records + used, "%zu %s=%s\n", len + digits, key, value);
+}
+
+/**
+ * Writes a value in base-256, big-endian with the high bit of the first byte set.
+ */
+static void base256(char *field, size_t width, int64_t value) {
+    for (size_t i = width; i-- > 0; value >>= 8) field[i] = (char) (value & 0xff);
+    field[0] |= (char) 0x80;
+}
+
+static void test_extensions(void) {
+    char long_name[200], long_target[200], records[1024];
+    for (int i = 0; i < 199; i++) long_name[i] = i % 50 == 49 ? '/' : 'a' + i % 26;
+    long_name[199] = '\0';
+    memcpy(long_target, long_name, sizeof(long_name));
+    long_target[198] = 'z';
+    tar_header_t header;
+    int fd = raw_create("ext.tar");
+
+    // base-256 size and negative mtime
+    raw_header(&header, "binary", REGTYPE, NULL, 0);
+    base256(header.size, sizeof(header.size), 3000);
+    base256(header.mtime, sizeof(header.mtime), -86400);
+    raw_append_header(fd, &header, large_content, 3000);
+
+    // PAX global mtime for every later entry, then a PAX path and size for the next entry only
+    size_t used = pax_record(records, 0, "mtime", "1234");
+    raw_append(fd, "pax_global_header", XGLTYPE, NULL, records, used);
+    used = pax_record(records, 0, "path", long_name);
+    used = pax_record(records, used, "size", "5");
+    raw_append(fd, "PaxHeaders/x", XHDTYPE, NULL, records, used);
+    raw_header(&header, "short", REGTYPE, NULL, 0);
+    raw_append_header(fd, &header, "paxed", 5);
+
+    // GNU long name and long link target
+    raw_append(fd, "././@LongLink", GNU_LONGNAME, NULL, long_target, strlen(long_target) + 1);
+    raw_append(fd, "truncated", REGTYPE, NULL, "gnu", 3);
+    raw_append(fd, "././@LongLink", GNU_LONGNAME, NULL, "gnu_link", 9);
+    raw_append(fd, "././@LongLink", GNU_LONGLINK, NULL, long_target, strlen(long_target) + 1);
+    raw_append(fd, "cut", SYMTYPE, "cut", NULL, 0);
+
+    // a name split between the ustar prefix and name fields
+    raw_header(&header, "prefixed", REGTYPE, NULL, 3);
+    strcpy(header.prefix, "some/prefix");
+    raw_append_header(fd, &header, "pre", 3);
+
+    raw_append(fd, "after", REGTYPE, NULL, "after", 5);
+    raw_finish(fd);
+
+    fd = open_work("ext.tar");
+    // extension headers are counted as headers
+    CHECK(check_archive(fd) == 11);
+    tar_index_t *idx = tar_index_open(fd);
+    CHECK(reads_as(fd, idx, long_name, "paxed") && !exists(fd, "short") && !tar_index_exists(idx, "short"));
+    CHECK(reads_as(fd, idx, long_target, "gnu") && !exists(fd, "truncated"));
+    CHECK(reads_as(fd, idx, "gnu_link", "gnu") && is_symlink(fd, "gnu_link") && !exists(fd, "cut"));
+    CHECK(reads_as(fd, idx, "some/prefix/prefixed", "pre") && reads_as(fd, idx, "after", "after"));
+    static uint8_t buf[4000];
+    size_t len = sizeof(buf);
+    CHECK(read_file(fd, "binary", 0, buf, &len) == 0 && len == 3000 && memcmp(buf, large_content, len) == 0);
+    tar_index_close(idx);
+
+    // the iterator returns the extension headers, with the decoded values on the entries after them
+    tar_iter_t iter;
+    const tar_iter_entry_t *entry;
+    int nb_extensions = 0, nb_entries = 0;
+    tar_iter_init(&iter, fd);
+    while ((entry = tar_iter_next(&iter)) != NULL) {
+        if (TAR_IS_EXTENSION(entry->typeflag)) {
+            nb_extensions++;
+            continue;
+        }
+        nb_entries++;
+        if (strcmp(entry->name, "gnu_link") == 0)
+            CHECK(entry->link_len == strlen(long_target) && strcmp(entry->linkname, long_target) == 0);
+        if (entry->size == 5 && entry->typeflag == REGTYPE && entry->name_len == strlen(long_name))
+            CHECK(strcmp(entry->name, long_name) == 0);
+        if (strcmp(entry->name, "binary") == 0) CHECK(entry->size == 3000 && entry->mtime == -86400);
+        if (strcmp(entry->name, "after") == 0) CHECK(entry->mtime == 1234);
+    }
+    tar_iter_release(&iter);
+    CHECK(nb_extensions == 5 && nb_entries == 6);
+    close(fd);
+}
+
+/**
+ * Writes an archive whose first entry gets its size from a PAX record.
+ */
+static void make_pax_size(const char *name, const char *size) {
+    char records[128];
+    int fd = raw_create(name);
+    size_t used = pax_record(records, 0, "size", size);
+    raw_append(fd, "PaxHeaders/f", XHDTYPE, NULL, records, used);
+    raw_append(fd, "f", REGTYPE, NULL, "data", 4);
+    raw_append(fd, "g", REGTYPE, NULL, "g", 1);
+    raw_finish(fd);
+}
+
+static void test_pax_sizes(void) {
+    // sizes which would send a scan backwards or past the archive are corrupt, whatever reads the archive
+    static const char *const sizes[] = { "-1536", "18446744073709550080", "9223372036854775808", "12x", "", "100000" };
+    char name[32];
+    alarm(60);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        snprintf(name, sizeof(name), "pax_size%zu.tar", i);
+        make_pax_size(name, sizes[i]);
+        int fd = open_work(name);
+        uint64_t bad_offset = 1;
+        CHECK(check_archive(fd) == -4);
+        CHECK(check_archive_parallel(fd, 2, 0, &bad_offset) == -4 && bad_offset == 0);
+        CHECK(!exists(fd, "g") && tar_index_open(fd) == NULL && tar_open_mmap(fd) == NULL);
+        CHECK(tar_extract(fd, work_path("pax_out")) == -1);
+        tar_visitor_t visitor = { NULL, NULL, NULL };
+        CHECK(tar_stream(fd, &visitor) == -4);
+        close(fd);
+    }
+    // a valid size is used, decimals ignored
+    make_pax_size("pax_valid.tar", "2.5");
+    int fd = open_work("pax_valid.tar");
+    tar_index_t *idx = tar_index_open(fd);
+    CHECK(check_archive(fd) == 3 && reads_as(fd, idx, "f", "da") && reads_as(fd, idx, "g", "g"));
+    tar_index_close(idx);
+    close(fd);
+    alarm(0);
+}
+
+/**
+ * Decodes an octal field one digit at a time, as the headers were read before tar_number().
+ */
+static int64_t reference_octal(const char *field, size_t len) {
+    size_t i = 0;
+    while (i < len && field[i] == ' ') i++;
+    int64_t value = 0;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) value = value * 8 + (field[i] - '0');
+    return value;
+}
+
+static void test_number(void) {
+    static const struct {
+        const char *text;
+        int64_t value;
+    } cases[] = {
+        { "00000000644", 0644 }, { "0000644\0", 0644 }, { "    644 ", 0644 }, { "644     ", 0644 },
+        { "644\0\0\0\0\0", 0644 }, { "", 0 }, { "        ", 0 }, { "0", 0 }, { "77777777777", 077777777777 },
+        { "777777777777", 0777777777777 }, { "12389", 0123 }, { "  1 2", 1 },
+    };
+    tar_header_t header;
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        memset(&header, 'x', sizeof(header));
+        memset(header.size, 0, sizeof(header.size));
+        memcpy(header.size, cases[c].text, strlen(cases[c].text));
+        CHECK(TAR_NUMBER(header.size) == cases[c].value);
+    }
+    // the width is respected, whatever follows the field
+    memset(&header, '7', sizeof(header));
+    CHECK(TAR_NUMBER(header.mode) == 077777777 && tar_number(header.mode, 3) == 0777);
+
+    base256(header.size, sizeof(header.size), (int64_t) 1 << 40);
+    CHECK(TAR_NUMBER(header.size) == (int64_t) 1 << 40);
+    base256(header.mtime, sizeof(header.mtime), -1);
+    CHECK(TAR_NUMBER(header.mtime) == -1);
+
+    // random fields of digits, spaces, nulls and other bytes decode as digit by digit
+    static const char alphabet[] = "0123456777  \0\089x";
+    int nb_bad = 0;
+    uint64_t state = 12345;
+    for (int n = 0; n < 100000; n++) {
+        memset(&header, '7', sizeof(header));
+        for (size_t i = 0; i < sizeof(header.size); i++) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            header.size[i] = alphabet[(state >> 33) % (sizeof(alphabet) - 1)];
+        }
+        size_t len = 1 + n % sizeof(header.size);
+        nb_bad += tar_number(header.size, len) != reference_octal(header.size, len);
+    }
+    CHECK(nb_bad == 0);
+}
+
+static void test_lookup(void) {
+    int fd = open_work("sample.tar");
+    tar_index_t *idx = tar_index_open(fd);
+    tar_stat_t st;
+    // every spelling of a path leads to the same entry
+    static const char *const spellings[] = { "dir/a", "./dir/a", "/dir/a", "dir//a", "dir/./a", "dir/a/", "./dir/./a" };
+    for (size_t i = 0; i < sizeof(spellings) / sizeof(spellings[0]); i++) {
+        CHECK(tar_lookup(fd, spellings[i], 0, &st) && st.typeflag == REGTYPE && st.offset == 512);
+        CHECK(exists(fd, (char *) spellings[i]) && tar_index_exists(idx, (char *) spellings[i]));
+    }
+    CHECK(tar_lookup(fd, "dir", 0, &st) && st.typeflag == DIRTYPE && st.offset == 0 && st.mode == 0755);
+    CHECK(!tar_lookup(fd, "dir/", 0, &st) == 0 && !tar_lookup(fd, "di", 0, &st) && !tar_lookup(fd, "dir/aa", 0, &st));
+
+    // links are described themselves, or what they lead to
+    CHECK(tar_lookup(fd, "chain", 0, &st) && st.typeflag == SYMTYPE && st.mtime == 1600000000);
+    CHECK(tar_lookup(fd, "chain", TAR_LOOKUP_FOLLOW, &st) && st.typeflag == REGTYPE && st.offset == 512);
+    CHECK(tar_lookup(fd, "hard", 0, &st) && st.typeflag == LNKTYPE);
+    CHECK(tar_lookup(fd, "hard", TAR_LOOKUP_FOLLOW, &st) && st.typeflag == REGTYPE && st.size == strlen(small_content));
+    CHECK(tar_lookup(fd, "dirlink", TAR_LOOKUP_FOLLOW, &st) && st.typeflag == DIRTYPE);
+    CHECK(tar_lookup(fd, "dangling", 0, &st) && !tar_lookup(fd, "dangling", TAR_LOOKUP_FOLLOW, &st));
+    CHECK(!tar_lookup(fd, "loop1", TAR_LOOKUP_FOLLOW, &st));
+    tar_index_close(idx);
+    close(fd);
+
+    // names written with a leading "./", as by `tar -C dir .`
+    fd = raw_create("dot.tar");
+    raw_append(fd, "./", DIRTYPE, NULL, NULL, 0);
+    raw_append(fd, "./d/", DIRTYPE, NULL, NULL, 0);
+    raw_append(fd, "./d/f", REGTYPE, NULL, "dotted", 6);
+    raw_finish(fd);
+    fd = open_work("dot.tar");
+    idx = tar_index_open(fd);
+    static const char *const root[] = { "./d/", NULL };
+    static const char *const d[] = { "./d/f", NULL };
+    CHECK(reads_as(fd, idx, "d/f", "dotted") && reads_as(fd, idx, "./d/f", "dotted"));
+    CHECK(list_is(fd, NULL, "", root) && list_is(fd, idx, "", root));
+    CHECK(list_is(fd, NULL, "d", d) && list_is(fd, idx, "./d/", d));
+    tar_index_close(idx);
+    close(fd);
+
+    // a member appended again replaces the earlier one, as tar -x would leave it
+    fd = raw_create("dup.tar");
+    raw_append(fd, "f", REGTYPE, NULL, "one", 3);
+    raw_append(fd, "x", REGTYPE, NULL, "file", 4);
+    raw_append(fd, "d/", DIRTYPE, NULL, NULL, 0);
+    raw_append(fd, "d/g", REGTYPE, NULL, "g", 1);
+    raw_append(fd, "./f", REGTYPE, NULL, "two", 3);
+    raw_append(fd, "x", SYMTYPE, "f", NULL, 0);
+    raw_append(fd, "d/", DIRTYPE, NULL, NULL, 0);
+    raw_finish(fd);
+    fd = open_work("dup.tar");
+    idx = tar_index_open(fd);
+    CHECK(reads_as(fd, idx, "f", "two") && reads_as(fd, idx, "x", "two"));
+    CHECK(is_symlink(fd, "x") && tar_index_is_symlink(idx, "x") && !is_file(fd, "x") && !tar_index_is_file(idx, "x"));
+    CHECK(tar_lookup(fd, "f", 0, &st) && st.offset == 512 * 7);
+    static const char *const dup_root[] = { "./f", "x", "d/", NULL };
+    static const char *const dup_d[] = { "d/g", NULL };
+    CHECK(list_is(fd, NULL, "", dup_root) && list_is(fd, idx, "", dup_root));
+    CHECK(list_is(fd, NULL, "d", dup_d) && list_is(fd, idx, "d", dup_d));
+    tar_index_close(idx);
+    idx = tar_open_mmap(fd);
+    CHECK(reads_as(fd, idx, "f", "two") && list_is(fd, idx, "", dup_root));
+    tar_index_close(idx);
+    close(fd);
+
+    // many children all appended twice, the second time under "./"
+    enum { NB_DUP = 3000 };
+    char name[32];
+    fd = raw_create("many_dup.tar");
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < NB_DUP; ++i) {
+            snprintf(name, sizeof(name), "%sf%d", pass ? "./" : "", i);
+            raw_append(fd, name, REGTYPE, NULL, NULL, 0);
+        }
     }
+    raw_finish(fd);
+    fd = open_work("many_dup.tar");
+    char **entries = alloc_entries(NB_DUP + 1);
+    size_t count = NB_DUP + 1;
+    int same = 1;
+    CHECK(list(fd, "", entries, &count) == 1 && count == NB_DUP);
+    for (size_t i = 0; i < count; ++i) {
+        snprintf(name, sizeof(name), "./f%zu", i);
+        same &= strcmp(entries[i], name) == 0;
+    }
+    // a short array keeps the first children, still under their last name
+    count = 10;
+    CHECK(list(fd, "", entries, &count) == 1 && count == 10 && strcmp(entries[9], "./f9") == 0);
+    CHECK(same);
+    free_entries(entries, NB_DUP + 1);
+    close(fd);
+}
+
+/**
+ * Runs a mix of queries on many.tar, returns a digest of all their results.
+ */
+static uint64_t query_mix(int fd, tar_index_t *idx) {
+    uint64_t digest = 0;
+    char name[32];
+    uint8_t buf[32];
+    for (int i = 0; i < NB_MANY_ENTRIES; i += 211) {
+        snprintf(name, sizeof(name), "d%d/f%d", i % 10, i);
+        size_t len = sizeof(buf);
+        digest = digest * 31 + (uint64_t) read_file(fd, name, 0, buf, &len) + len + buf[len - 1];
+        len = sizeof(buf);
+        digest = digest * 31 + (uint64_t) tar_index_read_file(idx, name, 1, buf, &len) + len + buf[0];
+        digest = digest * 31 + (uint64_t) exists(fd, name) + (uint64_t) is_dir(fd, name);
+    }
+    digest = digest * 31 + (uint64_t) check_archive(fd);
+    return digest;
+}
+
+static void test_cache(void) {
+    int fd = open_work("many.tar");
+    tar_index_t *idx = tar_index_open(fd);
+    uint64_t expected = query_mix(fd, idx);
 
-    int fd = open(argv[1] , O_RDONLY);
+    tar_cache_stats_t before, after;
+    CHECK(tar_set_cache_size(1 << 20, 256 << 10) == 0);
+    tar_cache_stats(&before);
+    CHECK(before.capacity == 1 << 20);
+    CHECK(query_mix(fd, idx) == expected);
+    tar_cache_stats(&after);
+    CHECK(after.misses > before.misses && after.used <= after.capacity);
+    // the same queries on a smaller part of the archive are then served from the cache
+    uint8_t buf[32];
+    size_t len = sizeof(buf);
+    tar_cache_stats(&before);
+    for (int i = 0; i < 10; i++) {
+        len = sizeof(buf);
+        CHECK(tar_index_read_file(idx, "d0/f0", 0, buf, &len) == 0 && len == 5 && memcmp(buf, "d0/f0", 5) == 0);
+    }
+    tar_cache_stats(&after);
+    CHECK(after.hits >= before.hits + 9);
+    CHECK(query_mix(fd, idx) == expected);
+
+    // tar_extract() reads the archive once, around the cache
+    tar_cache_stats(&before);
+    CHECK(tar_extract(fd, work_path("many")) == NB_MANY_ENTRIES);
+    tar_cache_stats(&after);
+    CHECK(after.hits == before.hits && after.misses == before.misses);
+    tar_index_close(idx);
+    close(fd);
+
+    // cached blocks of an archive are not used once it is modified, by an index opened after the change
+    patch_copy("sample.tar", "modified.tar", 0, NULL, 0);
+    fd = open_work("modified.tar");
+    idx = tar_index_open(fd);
+    CHECK(reads_as(fd, idx, "dir/a", small_content));
+    tar_index_close(idx);
+    int out = open(work_path("modified.tar"), O_WRONLY);
+    CHECK(pwrite(out, "HELLO", 5, 1024) == 5);
+    close(out);
+    idx = tar_index_open(fd);
+    CHECK(reads_as(fd, idx, "dir/a", "HELLO, world\n"));
+    tar_index_close(idx);
+    close(fd);
+
+    CHECK(tar_set_cache_size(0, 0) == 0);
+    tar_cache_stats(&after);
+    CHECK(after.capacity == 0 && after.used == 0);
+}
+
+/**
+ * Looks up paths together and one by one, returns whether both agree.
+ */
+static int lookup_many_matches(const char *archive, const char *const *paths, size_t count) {
+    int fd = open_work(archive);
+    tar_stat_t stats[64];
+    int found[64];
+    int same = count <= 64;
+    for (int flags = 0; same && flags <= TAR_LOOKUP_FOLLOW; flags++) {
+        long nb_found = tar_lookup_many(fd, paths, count, flags, stats, found);
+        long expected = 0;
+        for (size_t i = 0; i < count; i++) {
+            tar_stat_t st;
+            int one = paths[i] != NULL && tar_lookup(fd, paths[i], flags, &st);
+            expected += one != 0;
+            if (!found[i] != !one) same = 0;
+            else if (one && (stats[i].offset != st.offset || stats[i].typeflag != st.typeflag
+                             || stats[i].size != st.size || stats[i].mtime != st.mtime || stats[i].mode != st.mode))
+                same = 0;
+        }
+        if (nb_found != expected) same = 0;
+    }
+    close(fd);
+    return same;
+}
+
+static void test_lookup_many(void) {
+    const char *paths[64];
+    size_t count = 0;
+    for (size_t i = 0; i < NB_SAMPLE_ENTRIES; i++) paths[count++] = sample_entries[i].path;
+    // other spellings, paths repeated, missing and null
+    static const char *const others[] = { "./dir/a", "dir//b/", "dir/a", "chain", "nope", "dir/nope", "", ".", NULL,
+                                          "dirlink/a", "f", "x", "d/g", "./f", "p/q/back", "p/up" };
+    for (size_t i = 0; i < sizeof(others) / sizeof(others[0]); i++) paths[count++] = others[i];
+    CHECK(lookup_many_matches("sample.tar", paths, count));
+    CHECK(lookup_many_matches("sample.tar.gz", paths, count));
+    CHECK(lookup_many_matches("dup.tar", paths, count));
+    CHECK(lookup_many_matches("links.tar", paths, count));
+    CHECK(lookup_many_matches("ext.tar", paths, count));
+
+    int fd = open_work("sample.tar");
+    tar_stat_t stats[4];
+    int found[4];
+    const char *some[] = { "chain", "dir", "loop1", "top" };
+    CHECK(tar_lookup_many(fd, some, 4, TAR_LOOKUP_FOLLOW, stats, found) == 3);
+    CHECK(found[0] && stats[0].typeflag == REGTYPE && found[1] && stats[1].typeflag == DIRTYPE && !found[2] && found[3]);
+    CHECK(tar_lookup_many(fd, some, 0, 0, stats, found) == 0);
+    close(fd);
+}
+
+static void test_read_files(void) {
+    static uint8_t bufs[40][2048], expected[2048];
+    tar_read_request_t requests[40];
+    char names[40][32];
+    static const char *const archives[] = { "many.tar", "many.tar.gz" };
+    for (size_t a = 0; a < sizeof(archives) / sizeof(archives[0]); a++) {
+        int fd = open_work(archives[a]);
+        // out of order, repeated, partial, past the end and missing
+        for (int i = 0; i < 40; i++) {
+            int n = (i * 1237) % NB_MANY_ENTRIES;
+            if (i % 10 == 3) n = (i - 1) * 1237 % NB_MANY_ENTRIES;
+            snprintf(names[i], sizeof(names[i]), i % 10 == 7 ? "d%d/nope%d" : "d%d/f%d", n % 10, n);
+            requests[i] = (tar_read_request_t) { names[i], (size_t) (i % 4), bufs[i], i % 5 == 0 ? 2 : sizeof(bufs[i]), 0 };
+            if (i % 10 == 9) requests[i].offset = 100;
+        }
+        requests[20].path = "d0";
+        CHECK(read_files(fd, requests, 40) == 0);
+        int nb_bad = 0;
+        for (int i = 0; i < 40; i++) {
+            size_t len = i % 5 == 0 ? 2 : sizeof(expected);
+            ssize_t result = read_file(fd, (char *) requests[i].path, requests[i].offset, expected, &len);
+            if (requests[i].result != result || (result >= 0 && (requests[i].len != len || memcmp(bufs[i], expected, len) != 0)))
+                nb_bad++;
+        }
+        CHECK(nb_bad == 0);
+        CHECK(read_files(fd, requests, 0) == 0);
+        close(fd);
+    }
+
+    // large and small files of the same archive, through links
+    int fd = open_work("sample.tar");
+    static uint8_t large[sizeof(large_content)];
+    uint8_t small[64];
+    tar_read_request_t mixed[] = {
+        { "chain", 0, small, sizeof(small), 0 },
+        { "dir/b", 1000, large, sizeof(large), 0 },
+        { "dirlink", 0, small, sizeof(small), 0 },
+    };
+    CHECK(read_files(fd, mixed, 3) == 0);
+    CHECK(mixed[0].result == 0 && mixed[0].len == strlen(small_content) && memcmp(small, small_content, mixed[0].len) == 0);
+    CHECK(mixed[1].result == 0 && mixed[1].len == sizeof(large_content) - 1000);
+    CHECK(memcmp(large, large_content + 1000, mixed[1].len) == 0 && mixed[2].result == -1);
+    close(fd);
+}
+
+static void test_stats(void) {
+    for (int f = 0; f < TAR_STATS_FUNCTIONS; f++) CHECK(tar_stats_function_name(f) != NULL);
+    CHECK(strcmp(tar_stats_function_name(TAR_STATS_READ_FILE), "read_file") == 0);
+    CHECK(strcmp(tar_stats_function_name(TAR_STATS_ENTRY_PREAD), "tar_entry_pread") == 0);
+    CHECK(tar_stats_function_name(-1) == NULL && tar_stats_function_name(TAR_STATS_FUNCTIONS) == NULL);
+
+    int fd = open_work("sample.tar");
+    tar_stats_t stats;
+    tar_stats_reset(NULL);
+    int built_in = tar_stats_snapshot(NULL, &stats) == 0;
+#ifdef LIB_TAR_STATS
+    CHECK(built_in);
+#else
+    CHECK(!built_in && stats.syscalls == 0 && stats.calls[TAR_STATS_READ_FILE] == 0);
+#endif
+    uint8_t buf[64];
+    size_t len = sizeof(buf);
+    read_file(fd, "dir/a", 0, buf, &len);
+    tar_index_t *idx = tar_index_open(fd);
+    tar_index_t *mapped = tar_open_mmap(fd);
+    tar_stats_reset(idx);
+    tar_stats_reset(mapped);
+    len = sizeof(buf);
+    tar_index_read_file(idx, "dir/a", 0, buf, &len);
+    len = sizeof(buf);
+    tar_index_read_file(mapped, "dir/a", 0, buf, &len);
+    if (built_in) {
+        tar_stats_snapshot(NULL, &stats);
+        CHECK(stats.calls[TAR_STATS_READ_FILE] == 1 && stats.calls[TAR_STATS_INDEX_OPEN] == 2);
+        CHECK(stats.calls[TAR_STATS_INDEX_READ_FILE] == 0 && stats.syscalls > 0 && stats.headers >= 2);
+        CHECK(stats.bytes_read > 0 && stats.nanoseconds[TAR_STATS_READ_FILE] > 0);
+        // each index counts what is done through it, once
+        tar_stats_snapshot(idx, &stats);
+        CHECK(stats.calls[TAR_STATS_INDEX_READ_FILE] == 1 && stats.calls[TAR_STATS_READ_FILE] == 0 && stats.headers == 0);
+        tar_stats_snapshot(mapped, &stats);
+        CHECK(stats.calls[TAR_STATS_INDEX_READ_FILE] == 1 && stats.syscalls == 0);
+        tar_stats_reset(NULL);
+        tar_stats_snapshot(NULL, &stats);
+        CHECK(stats.calls[TAR_STATS_READ_FILE] == 0 && stats.syscalls == 0);
+
+        // a public function built on another one counts only its own call
+        tar_entry_close(tar_entry_open(fd, "dir/a"));
+        tar_read_request_t request = { .path = "dir/a", .dest = buf, .len = sizeof(buf) };
+        read_files(fd, &request, 1);
+        tar_stats_snapshot(NULL, &stats);
+        CHECK(stats.calls[TAR_STATS_ENTRY_OPEN] == 1 && stats.calls[TAR_STATS_READ_FILES] == 1);
+        CHECK(stats.calls[TAR_STATS_LOOKUP] == 0 && stats.calls[TAR_STATS_LOOKUP_MANY] == 0);
+        tar_stats_reset(idx);
+        tar_entry_close(tar_index_entry_open(idx, "dir/a"));
+        tar_stats_snapshot(idx, &stats);
+        CHECK(stats.calls[TAR_STATS_ENTRY_OPEN] == 1 && stats.calls[TAR_STATS_INDEX_LOOKUP] == 0);
+    }
+    tar_index_close(mapped);
+    tar_index_close(idx);
+    close(fd);
+}
+
+/**
+ * Reads a handle on dir/b at pseudo-random offsets, returns the number of reads that did not match.
+ */
+static int entry_mismatches(tar_entry_t *entry) {
+    static uint8_t buf[8192];
+    int nb_bad = 0;
+    uint64_t state = 42;
+    for (int n = 0; n < 300; n++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t offset = (state >> 33) % (sizeof(large_content) + 100);
+        size_t len = (size_t) (state >> 13) % sizeof(buf);
+        size_t expected = offset >= sizeof(large_content) ? 0 : sizeof(large_content) - offset;
+        if (expected > len) expected = len;
+        ssize_t got = tar_entry_pread(entry, offset, buf, len);
+        if (got != (ssize_t) expected || (expected > 0 && memcmp(buf, large_content + offset, expected) != 0))
+            nb_bad++;
+    }
+    return nb_bad;
+}
+
+static void test_entry(void) {
+    static const char *const archives[] = { "sample.tar", "sample.tar.gz" };
+    for (size_t a = 0; a < sizeof(archives) / sizeof(archives[0]); a++) {
+        int fd = open_work(archives[a]);
+        tar_index_t *idx = tar_index_open(fd);
+        tar_index_t *mapped = tar_open_mmap(fd);
+        tar_entry_t *entries[] = { tar_entry_open(fd, "dir/b"), tar_index_entry_open(idx, "dir/b"),
+                                   tar_index_entry_open(mapped, "./dir/b") };
+        for (size_t e = 0; e < sizeof(entries) / sizeof(entries[0]); e++) {
+            CHECK(entries[e] != NULL);
+            if (entries[e] == NULL) continue;
+            tar_stat_t st;
+            tar_entry_stat(entries[e], &st);
+            CHECK(st.typeflag == REGTYPE && st.size == sizeof(large_content) && st.offset == 512 * 3);
+            CHECK(entry_mismatches(entries[e]) == 0);
+            uint8_t byte;
+            CHECK(tar_entry_pread(entries[e], sizeof(large_content), &byte, 1) == 0);
+            CHECK(tar_entry_pread(entries[e], UINT64_MAX, &byte, 1) == 0);
+            tar_entry_close(entries[e]);
+        }
+
+        // links lead to their file, anything else is not opened
+        tar_entry_t *entry = tar_entry_open(fd, "chain");
+        uint8_t buf[64];
+        CHECK(entry != NULL && tar_entry_pread(entry, 7, buf, sizeof(buf)) == (ssize_t) strlen(small_content) - 7);
+        CHECK(memcmp(buf, small_content + 7, strlen(small_content) - 7) == 0);
+        tar_entry_close(entry);
+        CHECK(tar_entry_open(fd, "dir") == NULL && tar_entry_open(fd, "dangling") == NULL);
+        CHECK(tar_index_entry_open(idx, "loop1") == NULL && tar_index_entry_open(idx, "nope") == NULL);
+        tar_entry_close(NULL);
+        tar_index_close(mapped);
+        tar_index_close(idx);
+        close(fd);
+    }
+}
+
+static int unlock_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    // extracted directories may have lost their write permission
+    if (type == FTW_D) chmod(path, 0700);
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    return remove(path);
+}
+
+/**
+ * Lists the root of an archive given on the command line.
+ */
+static int list_archive(const char *path) {
+    int fd = open(path, O_RDONLY);
     if (fd == -1) {
         perror("open(tar_file)");
         return -1;
     }
 
+    printf("check_archive returned %d\n", check_archive(fd));
 
-    //int ret0 = check_archive(fd);
-    // printf("check archive val : %d", ret0);
+    size_t no_entries = 64;
+    char **entries = malloc(sizeof(char *) * no_entries);
+    for (size_t i = 0; i < no_entries; i++) {
+        entries[i] = calloc(TAR_PATH_MAX, sizeof(char));
+    }
+    int ret = list(fd, ".", entries, &no_entries);
+    printf("list returned %d, the in-out argmt val is : %zu\n", ret, no_entries);
+    for (size_t i = 0; i < no_entries; ++i) {
+        printf("entries : %s\n", entries[i]);
+    }
+    return EXIT_SUCCESS;
+}
 
-    //int num_entries = 5;
-    size_t no_entries;
-    int a = 8;
-    no_entries = (size_t) a;
-    size_t *no_entriesptr = &no_entries;
+int main(int argc, char **argv) {
+    if (argc >= 2) return list_archive(argv[1]);
 
-    size_t st=8;
-    char **array = malloc(sizeof(char *)*st);
-    for(int i=0;i<st;i++){
-        array[i] = (char *)calloc(20,sizeof(char *));
+    if (mkdtemp(work_dir) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
     }
-    int ret = list(fd, ".", (char **) array, no_entriesptr);
-    printf("list returned %d, the in-out argmt val is : %zu\n", ret, *no_entriesptr);
+    make_sample();
 
-    for (int i = 0; i < 5; ++i) {
-        printf("entries : %s\n", array[i]);
-    }
-    char *s = malloc(sizeof (char )*6);
-    strcpy(s, "kurwa\0");
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    test_index();
+    test_mmap();
+    test_list();
+    test_iterator();
+    test_check();
+    test_check_parallel();
+    test_index_list_page();
+    test_links();
+    test_concurrent_reads();
+    test_bench_gen();
+    test_sidecar();
+    test_extract();
+    test_async();
+    test_writer();
+    test_pack();
+    test_gzip();
+    test_stream();
+    test_extensions();
+    test_pax_sizes();
+    test_number();
+    test_lookup();
+    test_cache();
+    test_lookup_many();
+    test_read_files();
+    test_stats();
+    test_entry();
+
+    nftw(work_dir, unlock_entry, 16, FTW_PHYS);
+    nftw(work_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%d checks, %d failed\n", nb_checks, nb_failures);
+    return nb_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}